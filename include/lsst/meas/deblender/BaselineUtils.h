@@ -5,17 +5,143 @@
 
 #include <vector>
 #include <utility>
+#include <list>
+#include <map>
+#include <mutex>
 
 #include "lsst/afw/image/Image.h"
 #include "lsst/afw/image/MaskedImage.h"
 #include "lsst/afw/detection/Footprint.h"
 #include "lsst/afw/detection/HeavyFootprint.h"
 #include "lsst/afw/detection/Peak.h"
+#include "lsst/afw/detection/Psf.h"
 
 namespace lsst {
     namespace meas {
         namespace deblender {
 
+            // The spans of each row of a SpanSet, looked up by y rather
+            // than searched for.  The spans must be sorted and merged, as
+            // in a normalized SpanSet.  Build one per parent footprint and
+            // share it between the calls that need it.
+            class SpanIndex {
+            public:
+                typedef lsst::afw::geom::SpanSet::const_iterator const_iterator;
+
+                explicit SpanIndex(std::shared_ptr<lsst::afw::geom::SpanSet const> spans);
+
+                lsst::afw::geom::SpanSet const& getSpans() const { return *_spans; }
+
+                lsst::afw::geom::Box2I getBBox() const { return _spans->getBBox(); }
+
+                // The spans in row y, [rowBegin, rowEnd); empty if there are none.
+                const_iterator rowBegin(int y) const;
+                const_iterator rowEnd(int y) const;
+
+                // The span containing (x, y), or getSpans().end() if none does.
+                const_iterator findSpan(int x, int y) const;
+
+                // The pixels with a neighbour (above, below, left or right)
+                // outside the SpanSet, as from SpanSet::findEdgePixels.
+                std::shared_ptr<lsst::afw::geom::SpanSet> findEdgePixels() const;
+
+            private:
+                std::shared_ptr<lsst::afw::geom::SpanSet const> _spans;
+                int _y0;
+                // spans of row y are [_rows[y - _y0], _rows[y - _y0 + 1])
+                std::vector<std::size_t> _rows;
+            };
+
+            // Bounding boxes (of a parent's templates, footprints or PSF
+            // images) binned on a uniform grid of cells, to find those that
+            // overlap -- each other, or a given box -- without comparing
+            // every pair.  In a large parent most pairs don't overlap.
+            // Empty boxes overlap nothing.
+            class BoxIndex {
+            public:
+                // cellSize 0 takes the mean size of the boxes
+                explicit BoxIndex(std::vector<lsst::afw::geom::Box2I> const& boxes, int cellSize=0);
+
+                int size() const { return _boxes.size(); }
+                int getCellSize() const { return _cellSize; }
+
+                // The boxes overlapping box, in increasing order.
+                std::vector<int> query(lsst::afw::geom::Box2I const& box) const;
+
+                // The pairs (i, j), i < j, of boxes that overlap, sorted.
+                std::vector<std::pair<int, int> > getOverlappingPairs() const;
+
+            private:
+                // the range of cells a box covers
+                lsst::afw::geom::Box2I _cellRange(lsst::afw::geom::Box2I const& box) const;
+
+                std::vector<lsst::afw::geom::Box2I> _boxes;
+                int _cellSize;
+                int _x0, _y0;
+                int _nx, _ny;
+                // the boxes in each cell, row by row
+                std::vector<std::vector<int> > _cells;
+            };
+
+            // PSF images, cached by position so they are computed once for
+            // all the parents of an exposure, by the PSF fits and template
+            // building alike: make one per exposure and share it.  With a
+            // gridSize, positions are snapped to a grid of that many pixels
+            // (or, with interpolate, the image is interpolated bilinearly
+            // between those at the four grid points around the position);
+            // with none, images are cached at exactly the positions asked
+            // for.  Grid images are moved by whole pixels to the position
+            // asked for, so are centred within half a pixel of it.  The
+            // least recently used images are dropped to keep the cache
+            // within maxBytes.  Safe to share between threads.
+            class PsfImageCache {
+            public:
+                typedef lsst::afw::image::Image<double> Image;
+
+                explicit PsfImageCache(std::shared_ptr<lsst::afw::detection::Psf const> psf,
+                                       double gridSize=0., std::size_t maxBytes=64 << 20,
+                                       bool interpolate=false);
+
+                std::shared_ptr<lsst::afw::detection::Psf const> getPsf() const { return _psf; }
+                double getGridSize() const { return _gridSize; }
+                std::size_t getMaxBytes() const { return _maxBytes; }
+                bool getInterpolate() const { return _interpolate; }
+
+                // The PSF image at position, as Psf::computeImage; it may
+                // be shared, so must not be modified.
+                std::shared_ptr<Image const>
+                computeImage(lsst::afw::geom::Point2D const& position) const;
+
+                // the bytes of images held, and the lookups found and not
+                // found in the cache
+                std::size_t getBytes() const;
+                std::size_t getHits() const;
+                std::size_t getMisses() const;
+
+                void clear();
+
+            private:
+                typedef std::pair<double, double> Key;
+                typedef std::list<std::pair<Key, std::shared_ptr<Image const> > > LruList;
+
+                // the image at exactly "key", from the cache if it can be;
+                // the mutex must be held
+                std::shared_ptr<Image const> _lookup(Key const& key) const;
+
+                std::shared_ptr<lsst::afw::detection::Psf const> _psf;
+                double _gridSize;
+                std::size_t _maxBytes;
+                bool _interpolate;
+
+                mutable std::mutex _mutex;
+                // most recently used first
+                mutable LruList _lru;
+                mutable std::map<Key, LruList::iterator> _index;
+                mutable std::size_t _bytes;
+                mutable std::size_t _hits;
+                mutable std::size_t _misses;
+            };
+
             template <typename ImagePixelT,
                       typename MaskPixelT=lsst::afw::image::MaskPixel,
                       typename VariancePixelT=lsst::afw::image::VariancePixel>
@@ -40,25 +166,66 @@ namespace lsst {
                 symmetrizeFootprint(lsst::afw::detection::Footprint const& foot,
                                     int cx, int cy);
 
+                static
+                PTR(lsst::afw::detection::Footprint)
+                symmetrizeFootprint(lsst::afw::detection::Footprint const& foot,
+                                    SpanIndex const& index,
+                                    int cx, int cy);
+
+                static
+                std::pair<ImagePtrT, FootprintPtrT>
+                buildSymmetricTemplate(MaskedImageT const& img,
+                                       lsst::afw::detection::Footprint const& foot,
+                                       lsst::afw::detection::PeakRecord const& pk,
+                                       double sigma1,
+                                       bool minZero,
+                                       bool patchEdges,
+                                       bool* patchedEdges);
+
                 static
                 std::pair<ImagePtrT, FootprintPtrT>
                 buildSymmetricTemplate(MaskedImageT const& img,
                                        lsst::afw::detection::Footprint const& foot,
+                                       SpanIndex const& index,
+                                       lsst::afw::geom::SpanSet const& edgePixels,
                                        lsst::afw::detection::PeakRecord const& pk,
                                        double sigma1,
                                        bool minZero,
                                        bool patchEdges,
                                        bool* patchedEdges);
 
+                static void
+                buildSymmetricTemplates(MaskedImageT const& img,
+                                        lsst::afw::detection::Footprint const& foot,
+                                        lsst::afw::detection::PeakCatalog const& peaks,
+                                        std::vector<bool> const& skip,
+                                        double sigma1,
+                                        bool minZero,
+                                        bool patchEdges,
+                                        std::vector<ImagePtrT> & templates,
+                                        std::vector<FootprintPtrT> & tfoots,
+                                        std::vector<bool> & patchedEdges,
+                                        int nThreads=1);
+
                 static void
                 medianFilter(ImageT const& img,
                              ImageT & outimg,
                              int halfsize);
 
+                static void
+                medianFilter(ImageT const& img,
+                             ImageT & outimg,
+                             int halfsize,
+                             lsst::afw::detection::Footprint const& foot);
+
                 static void
                 makeMonotonic(ImageT & img,
                               lsst::afw::detection::PeakRecord const& pk);
 
+                static void
+                makeMonotonicRadial(ImageT & img,
+                                    lsst::afw::detection::PeakRecord const& pk);
+
                 static const int ASSIGN_STRAYFLUX                          = 0x1;
                 static const int STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY = 0x2;
                 static const int STRAYFLUX_TO_POINT_SOURCES_ALWAYS         = 0x4;
@@ -67,6 +234,9 @@ namespace lsst {
                 static const int STRAYFLUX_R_TO_FOOTPRINT                  = 0x8;
                 static const int STRAYFLUX_NEAREST_FOOTPRINT              = 0x10;
                 static const int STRAYFLUX_TRIM                           = 0x20;
+                // with STRAYFLUX_NEAREST_FOOTPRINT: nearest in Euclidean rather
+                // than Manhattan distance
+                static const int STRAYFLUX_NEAREST_FOOTPRINT_EUCLIDEAN    = 0x40;
 
                 // swig doesn't seem to understand std::vector<MaskedImagePtrT>...
                 static
@@ -85,6 +255,37 @@ namespace lsst {
                               double clipStrayFluxFraction
                      );
 
+                static
+                std::vector<HeavyFootprintPtrT>
+                apportionFluxToHeavy(MaskedImageT const& img,
+                                     lsst::afw::detection::Footprint const& foot,
+                                     std::vector<ImagePtrT> templates,
+                                     std::vector<std::shared_ptr<lsst::afw::detection::Footprint> > templ_footprints,
+                                     ImagePtrT templ_sum,
+                                     std::vector<bool> const& ispsf,
+                                     std::vector<int>  const& pkx,
+                                     std::vector<int>  const& pky,
+                                     std::vector<HeavyFootprintPtrT> & strays,
+                                     int strayFluxOptions,
+                                     double clipStrayFluxFraction
+                    );
+
+                static
+                HeavyFootprintPtrT
+                mergeHeavyFootprints(HeavyFootprintT const& h1,
+                                     HeavyFootprintT const& h2);
+
+                static
+                std::shared_ptr<lsst::afw::geom::SpanSet>
+                findStrayPixels(lsst::afw::detection::Footprint const& foot,
+                                ImageT const& tsum,
+                                MaskedImageT const& img);
+
+                static
+                std::shared_ptr<lsst::afw::geom::SpanSet>
+                findEdgeMaskPixels(MaskedImageT const& img,
+                                   lsst::afw::detection::Footprint const& foot);
+
                 static
                 bool
                 hasSignificantFluxAtEdge(ImagePtrT,
@@ -97,6 +298,64 @@ namespace lsst {
                                          std::shared_ptr<lsst::afw::detection::Footprint>,
                                          ImagePixelT threshold);
 
+                static
+                int
+                getRampSize(double psffwhm);
+
+                static
+                std::shared_ptr<lsst::afw::image::Image<double> >
+                getRampPsf(PsfImageCache const& psf,
+                           lsst::afw::geom::Box2I const& bbox,
+                           int S);
+
+                static
+                std::pair<ImagePtrT, FootprintPtrT>
+                rampFluxAtEdge(MaskedImageT const& img,
+                               lsst::afw::detection::Footprint const& foot,
+                               ImageT const& timg,
+                               lsst::afw::detection::Footprint const& tfoot,
+                               lsst::afw::detection::PeakRecord const& pk,
+                               lsst::afw::image::Image<double> const& psf,
+                               int S,
+                               bool patchEdges,
+                               bool* patchedEdges);
+
+                static
+                std::pair<ImagePtrT, FootprintPtrT>
+                rampFluxAtEdge(MaskedImageT const& img,
+                               lsst::afw::detection::Footprint const& grownFoot,
+                               lsst::afw::geom::SpanSet const& grownEdgePixels,
+                               ImageT const& timg,
+                               lsst::afw::detection::Footprint const& tfoot,
+                               SpanIndex const& edgePixels,
+                               lsst::afw::detection::PeakRecord const& pk,
+                               lsst::afw::image::Image<double> const& psf,
+                               int S,
+                               bool patchEdges,
+                               bool* patchedEdges);
+
+                static
+                std::vector<double>
+                weightTemplates(MaskedImageT const& img,
+                                lsst::afw::detection::Footprint const& foot,
+                                std::vector<ImagePtrT> const& timgs);
+
+                // Clip the spans of foot to the nonzero pixels of img:
+                // all-zero spans are dropped and the ends of the rest
+                // moved in, but spans are not split at internal zeros.
+                static
+                void
+                clipFootprintToNonzero(FootprintT & foot,
+                                       ImageT const& img);
+
+                // Clip each template footprint to its template, returning
+                // the templates trimmed to the clipped footprints' bboxes
+                // (copies, where they change).  Null entries are skipped.
+                static
+                std::vector<ImagePtrT>
+                clipFootprintsToNonzero(std::vector<FootprintPtrT> const& tfoots,
+                                        std::vector<ImagePtrT> const& timgs);
+
 
                 static
                 void
@@ -117,6 +376,178 @@ namespace lsst {
                              std::vector<std::shared_ptr<typename lsst::afw::detection::HeavyFootprint<ImagePixelT,MaskPixelT,VariancePixelT> > > & strays);
 
             };
+
+            // The per-peak template stages of the deblender -- building the
+            // symmetric template, ramping flux at its edges, median smoothing,
+            // making it monotonic and clipping its footprint to the nonzero
+            // pixels -- run together
+            // on each peak in turn, reusing scratch space between peaks
+            // rather than allocating new images for each stage.  The
+            // switches mirror the options of baseline.deblend.
+            template <typename ImagePixelT,
+                      typename MaskPixelT=lsst::afw::image::MaskPixel,
+                      typename VariancePixelT=lsst::afw::image::VariancePixel>
+            class TemplatePipeline {
+
+            public:
+                typedef BaselineUtils<ImagePixelT, MaskPixelT, VariancePixelT> Utils;
+                typedef typename Utils::MaskedImageT MaskedImageT;
+                typedef typename Utils::ImageT ImageT;
+                typedef typename Utils::ImagePtrT ImagePtrT;
+                typedef typename Utils::FootprintPtrT FootprintPtrT;
+
+                TemplatePipeline();
+
+                // grow templates over EDGE pixels (buildSymmetricTemplate)
+                bool patchEdges;
+                // ramp templates with significant flux at their edges
+                // (BaselineUtils::rampFluxAtEdge)
+                bool rampFluxAtEdge;
+                // median-filter the templates, with boxes of this halfsize
+                bool medianSmoothTemplate;
+                int medianFilterHalfsize;
+                // ... filtering just the template footprints
+                bool medianFilterFootprint;
+                // make the templates monotonic; with makeMonotonicRadial
+                // rather than makeMonotonic if monotonicRadial
+                bool monotonicTemplate;
+                bool monotonicRadial;
+                // clip template footprints to their nonzero pixels
+                bool clipFootprintToNonzero;
+                // share the peaks among this many threads
+                int nThreads;
+
+                void
+                run(MaskedImageT const& img,
+                    lsst::afw::detection::Footprint const& foot,
+                    lsst::afw::detection::PeakCatalog const& peaks,
+                    std::vector<bool> const& skip,
+                    double sigma1,
+                    std::shared_ptr<PsfImageCache const> psf,
+                    double psffwhm,
+                    std::vector<ImagePtrT> & templates,
+                    std::vector<FootprintPtrT> & tfoots,
+                    std::vector<bool> & patchedEdges,
+                    std::vector<bool> & rampedEdges,
+                    std::vector<ImagePtrT> * symmetricTemplates=nullptr,
+                    std::vector<FootprintPtrT> * symmetricFootprints=nullptr) const;
+            };
+
+            // The outcome of fitting a PSF model to one peak (PsfFitter).
+            // The first flags say why no fit was made, if one wasn't.
+            struct PsfFit {
+                PsfFit();
+
+                bool outOfBounds;
+                bool tinyFootprint;
+                bool noValidPixels;
+                bool failed;
+                bool badDof;
+
+                // chi-squared and degrees of freedom of the fits without and
+                // with the decenter terms, and of the refit with the PSF
+                // shifted, if one was made (hasFit3)
+                double chisq1, dof1;
+                double chisq2, dof2;
+                double chisq3, dof3;
+                bool hasFit3;
+                // the decenter was too big to try; the shifted model was kept
+                bool bigDecenter;
+                bool withDecenter;
+                // the peak passed the PSF cuts
+                bool isPsf;
+
+                // the fit region, its center and the model that was kept
+                int R0, R1;
+                int xlo, xhi, ylo, yhi;
+                double cx, cy;
+                double chisq, dof;
+                std::vector<double> params;
+                double flux;
+                int nOthers;
+            };
+
+            // Fits a PSF + smooth background model to a small region around
+            // each peak of a parent, as plugins.fitPsfs does: all the peaks
+            // in one call, with the design matrices built straight from the
+            // pixels and solved by a small dense least-squares solver.  The
+            // cuts are those of fitPsfs.
+            template <typename ImagePixelT,
+                      typename MaskPixelT=lsst::afw::image::MaskPixel,
+                      typename VariancePixelT=lsst::afw::image::VariancePixel>
+            class PsfFitter {
+
+            public:
+                typedef typename BaselineUtils<ImagePixelT, MaskPixelT, VariancePixelT>::MaskedImageT
+                    MaskedImageT;
+
+                PsfFitter();
+
+                double psfChisqCut1;
+                double psfChisqCut2;
+                double psfChisqCut2b;
+                int tinyFootprintSize;
+
+                // fit the first npeaks peaks of foot; the rest are only
+                // included as neighbours
+                std::vector<PsfFit>
+                fit(MaskedImageT const& img,
+                    lsst::afw::detection::Footprint const& foot,
+                    PsfImageCache const& psf,
+                    double psffwhm,
+                    int npeaks) const;
+            };
+
+            // The dot products between all pairs of a parent's templates,
+            // each over the pixels its footprint shares with the other's (as
+            // HeavyFootprint::dot), which reconstructTemplates uses to find
+            // "degenerate" templates.  They are computed once; removing or
+            // rescaling a template updates them in place, so a template can
+            // be rejected at a time without recomputing the rest.
+            template <typename ImagePixelT,
+                      typename MaskPixelT=lsst::afw::image::MaskPixel,
+                      typename VariancePixelT=lsst::afw::image::VariancePixel>
+            class TemplateGram {
+
+            public:
+                typedef BaselineUtils<ImagePixelT, MaskPixelT, VariancePixelT> Utils;
+                typedef typename Utils::ImageT ImageT;
+                typedef typename Utils::ImagePtrT ImagePtrT;
+                typedef typename Utils::FootprintPtrT FootprintPtrT;
+
+                // a null template starts out removed
+                TemplateGram(std::vector<ImagePtrT> const& timgs,
+                             std::vector<FootprintPtrT> const& tfoots);
+
+                int size() const { return _n; }
+                bool isActive(int i) const;
+                double dot(int i, int j) const;
+
+                void remove(int i);
+                // as when template i is multiplied by factor
+                void scale(int i, double factor);
+
+                // The degenerate pair reconstructTemplates rejects one of:
+                // the first template i (in order) with a normalized dot
+                // product above maxTempDotProd with an earlier template,
+                // and the earlier template j it has the largest one with.
+                // Returns false if there is none.
+                bool findDegenerate(double maxTempDotProd, int & i, int & j, double & cosine) const;
+
+            private:
+                double _cosine(int i, int j) const;
+                void _check(int i) const;
+
+                int _n;
+                std::vector<double> _dots;
+                std::vector<bool> _active;
+                // the largest cosine of each template with an earlier one,
+                // and which that is (-1 if none is positive); rows are
+                // recomputed when they are invalidated
+                mutable std::vector<double> _rowMax;
+                mutable std::vector<int> _rowArg;
+                mutable std::vector<bool> _rowValid;
+            };
         }
     }
 }
@@ -34,6 +34,7 @@ import lsst.afw.geom as afwGeom
 import lsst.afw.math as afwMath
 
 from . import plugins
+from .baselineUtils import PsfImageCache
 
 DEFAULT_PLUGINS = [
     plugins.DeblenderPlugin(plugins.fitPsfs),
@@ -169,7 +170,8 @@ class DeblendedParent(object):
         maskedImages: list of `afw.image.MaskedImageF`s
             Masked image containing the ``footprint`` in each band.
         psf: list of `afw.detection.Psf`s
-            Psf of the ``maskedImage`` for each band.
+            Psf of the ``maskedImage`` for each band, or a `PsfImageCache` of it
+            to share its images with other parents.
         psffwhm: list of `float`s
             FWHM of the ``maskedImage``'s ``psf`` in each band.
         avgNoise: `float`or list of `float`s, optional
@@ -187,6 +189,12 @@ class DeblendedParent(object):
         self.filter = filterName
         self.fp = footprint
         self.maskedImage = maskedImage
+        # PSF images are all computed through psfCache
+        if isinstance(psf, PsfImageCache):
+            self.psfCache = psf
+            psf = psf.getPsf()
+        else:
+            self.psfCache = PsfImageCache(psf)
         self.psf = psf
         self.psffwhm = psffwhm
         self.img = maskedImage.getImage()
@@ -198,6 +206,8 @@ class DeblendedParent(object):
         self.debResult = debResult
         self.peakCount = debResult.peakCount
         self.templateSum = None
+        # dot products between the templates, made by plugins.reconstructTemplates
+        self.templateGram = None
         
         # avgNoise is an estiamte of the average noise level for the image in this filter
         if avgNoise is None:
@@ -339,6 +349,8 @@ class DeblendedPeak(object):
 
         # The flux assigned to this template -- a MaskedImage
         self.fluxPortion = None
+        # ... or, alternatively, a HeavyFootprint over the template footprint
+        self.fluxPortionHeavy = None
 
         # The stray flux assigned to this template (may be None), a HeavyFootprint
         self.strayFlux = None
@@ -378,7 +390,14 @@ class DeblendedPeak(object):
 
         @param[in]     strayFlux   include stray flux also?
         """
-        if self.templateFootprint is None or self.fluxPortion is None:
+        if self.templateFootprint is None:
+            return None
+        if self.fluxPortionHeavy is not None:
+            heavy = self.fluxPortionHeavy
+            if strayFlux and self.strayFlux is not None:
+                heavy = plugins.butils.mergeHeavyFootprints(heavy, self.strayFlux)
+            return heavy
+        if self.fluxPortion is None:
             return None
         heavy = afwDet.makeHeavyFootprint(self.templateFootprint, self.fluxPortion)
         if strayFlux:
@@ -393,6 +412,13 @@ class DeblendedPeak(object):
     def setFluxPortion(self, mimg):
         self.fluxPortion = mimg
 
+    def setFluxPortionHeavy(self, heavy):
+        """!
+        Set the flux apportioned to this peak as a HeavyFootprint over the template footprint,
+        in place of a MaskedImage portion.
+        """
+        self.fluxPortionHeavy = heavy
+
     def setTemplateWeight(self, w):
         self.templateWeight = w
 
@@ -443,16 +469,19 @@ class DeblendedPeak(object):
     def setTemplate(self, image, footprint):
         self.templateImage = image
         self.templateFootprint = footprint
+        # the parent's template dot products are out of date
+        if self.parent is not None:
+            self.parent.templateGram = None
 
 def deblend(footprint, maskedImage, psf, psffwhm, filters=None,
             psfChisqCut1=1.5, psfChisqCut2=1.5, psfChisqCut2b=1.5, fitPsfs=True,
-            medianSmoothTemplate=True, medianFilterHalfsize=2,
-            monotonicTemplate=True, weightTemplates=False,
+            medianSmoothTemplate=True, medianFilterHalfsize=2, medianFilterFootprint=False,
+            monotonicTemplate=True, monotonicAlgorithm='shadow', weightTemplates=False,
             log=None, verbose=False, sigma1=None, maxNumberOfPeaks=0,
             assignStrayFlux=True, strayFluxToPointSources='necessary', strayFluxAssignment='r-to-peak',
             rampFluxAtEdge=False, patchEdges=False, tinyFootprintSize=2,
             getTemplateSum=False, clipStrayFluxFraction=0.001, clipFootprintToNonzero=True,
-            removeDegenerateTemplates=False, maxTempDotProd=0.5
+            removeDegenerateTemplates=False, maxTempDotProd=0.5, heavyPortions=False
             ):
     """Deblend a parent ``Footprint`` in a ``MaskedImageF``.
     
@@ -522,7 +551,8 @@ def deblend(footprint, maskedImage, psf, psffwhm, filters=None,
     maskedImage: `afw.image.MaskedImageF`
         Masked image containing the ``footprint``
     psf: `afw.detection.Psf`
-        Psf of the ``maskedImage``
+        Psf of the ``maskedImage``, or a `PsfImageCache` of it, to share the PSF images
+        between parents
     psffwhm: `float`
         FWHM of the ``maskedImage``'s ``psf``
     psfChisqCut*: `float`, optional
@@ -550,9 +580,16 @@ def deblend(footprint, maskedImage, psf, psffwhm, filters=None,
         each output pixel will be the median of  the pixels in a 101 x 101-pixel box in the input image.
         This parameter is only used when ``medianSmoothTemplate==True``, otherwise it is ignored.
         The default value is 2.
+    medianFilterFootprint: `bool`, optional
+        If True, only filter the pixels in each template footprint, using boxes clipped
+        to the template image near its edges; see `plugins.medianSmoothTemplates`.
+        The default is False.
     monotonicTempalte: `bool`, optional
         If True then make the template monotonic.
         The default is True.
+    monotonicAlgorithm: `str`, optional
+        How to make the templates monotonic, if ``monotonicTemplate==True``:
+        'shadow' (the default) or 'radial'; see `plugins.makeTemplatesMonotonic`.
     weightTemplates: `bool`, optional
         If True, re-weight the templates so that their linear combination best represents
         the observed ``maskedImage``.
@@ -589,6 +626,8 @@ def deblend(footprint, maskedImage, psf, psffwhm, filters=None,
           minimum distance from the stray flux to footprint
         * ``nearest-footprint``: Stray flux is assigned to the footprint with lowest L-1 (Manhattan)
           distance to the stray flux
+        * ``nearest-footprint-euclidean``: As ``nearest-footprint``, but using the L-2 (Euclidean)
+          distance
     rampFluxAtEdge: `bool`, optional
         If True then extend footprints with excessive flux on the edges as described above.
         The default is False.
@@ -620,6 +659,12 @@ def deblend(footprint, maskedImage, psf, psffwhm, filters=None,
         All dot products between templates greater than ``maxTempDotProduct`` will result in one
         of the templates removed. This parameter is only used when ``removeDegenerateTempaltes==True``.
         The default is 0.5.
+    heavyPortions: `bool`, optional
+        If True then the flux assigned to each peak is stored as a `HeavyFootprint` over its
+        template footprint rather than as a `MaskedImage` covering the template bounding box,
+        which saves memory for large templates. ``DeblendedPeak.getFluxPortion`` returns the
+        same either way.
+        The default is False.
     
     Returns
     -------
@@ -638,16 +683,15 @@ def deblend(footprint, maskedImage, psf, psffwhm, filters=None,
                                                   psfChisqCut2=psfChisqCut2,
                                                   psfChisqCut2b=psfChisqCut2b,
                                                   tinyFootprintSize=tinyFootprintSize))
-    debPlugins.append(plugins.DeblenderPlugin(plugins.buildSymmetricTemplates, patchEdges=patchEdges))
-    if rampFluxAtEdge:
-        debPlugins.append(plugins.DeblenderPlugin(plugins.rampFluxAtEdge, patchEdges=patchEdges))
-    if medianSmoothTemplate:
-        debPlugins.append(plugins.DeblenderPlugin(plugins.medianSmoothTemplates,
-                                                  medianFilterHalfsize=medianFilterHalfsize))
-    if monotonicTemplate:
-        debPlugins.append(plugins.DeblenderPlugin(plugins.makeTemplatesMonotonic))
-    if clipFootprintToNonzero:
-        debPlugins.append(plugins.DeblenderPlugin(plugins.clipFootprintsToNonzero))
+    debPlugins.append(plugins.DeblenderPlugin(plugins.buildTemplates,
+                                              patchEdges=patchEdges,
+                                              rampFluxAtEdge=rampFluxAtEdge,
+                                              medianSmoothTemplate=medianSmoothTemplate,
+                                              medianFilterHalfsize=medianFilterHalfsize,
+                                              medianFilterFootprint=medianFilterFootprint,
+                                              monotonicTemplate=monotonicTemplate,
+                                              monotonicAlgorithm=monotonicAlgorithm,
+                                              clipFootprintToNonzero=clipFootprintToNonzero))
     if weightTemplates:
         debPlugins.append(plugins.DeblenderPlugin(plugins.weightTemplates))
     if removeDegenerateTemplates:
@@ -663,7 +707,8 @@ def deblend(footprint, maskedImage, psf, psffwhm, filters=None,
                                               assignStrayFlux=assignStrayFlux,
                                               strayFluxAssignment=strayFluxAssignment,
                                               strayFluxToPointSources=strayFluxToPointSources,
-                                              getTemplateSum=getTemplateSum))
+                                              getTemplateSum=getTemplateSum,
+                                              heavyPortions=heavyPortions))
 
     debResult = newDeblend(debPlugins, footprint, maskedImage, psf, psffwhm, filters, log, verbose, avgNoise)
 
@@ -752,20 +797,18 @@ class CachingPsf(object):
     In the PSF fitting code, we request PSF models for all peaks near
     the one being fit.  This was turning out to be quite expensive in
     some cases.  Here, we cache the PSF models to bring the cost down
-    closer to O(N) rather than O(N^2).
+    closer to O(N) rather than O(N^2).  The images are held by a
+    `PsfImageCache`, which may be shared (by a whole exposure, say);
+    where the PSF cannot be computed, that at its average position is used.
     """
 
     def __init__(self, psf):
-        self.cache = {}
-        self.psf = psf
+        if not isinstance(psf, PsfImageCache):
+            psf = PsfImageCache(psf)
+        self.cache = psf
 
     def computeImage(self, cx, cy):
-        im = self.cache.get((cx, cy), None)
-        if im is not None:
-            return im
         try:
-            im = self.psf.computeImage(afwGeom.Point2D(cx, cy))
+            return self.cache.computeImage(afwGeom.Point2D(cx, cy))
         except lsst.pex.exceptions.Exception:
-            im = self.psf.computeImage()
-        self.cache[(cx, cy)] = im
-        return im
+            return self.cache.computeImage(self.cache.getPsf().getAveragePosition())
@@ -26,6 +26,7 @@
 #include "lsst/afw/image/MaskedImage.h"
 #include "lsst/afw/detection/Footprint.h"
 #include "lsst/afw/detection/Peak.h"
+#include "lsst/afw/detection/Psf.h"
 
 #include "lsst/meas/deblender/BaselineUtils.h"
 
@@ -42,13 +43,21 @@ template <typename ImagePixelT, typename MaskPixelT = lsst::afw::image::MaskPixe
           typename VariancePixelT = lsst::afw::image::VariancePixel>
 void declareBaselineUtils(py::module& mod, const std::string& suffix) {
     using MaskedImageT = lsst::afw::image::MaskedImage<ImagePixelT, MaskPixelT, VariancePixelT>;
+    using ImageT = lsst::afw::image::Image<ImagePixelT>;
     using ImagePtrT = std::shared_ptr<lsst::afw::image::Image<ImagePixelT>>;
     using FootprintPtrT = std::shared_ptr<lsst::afw::detection::Footprint>;
     using Class = BaselineUtils<ImagePixelT, MaskPixelT, VariancePixelT>;
     using PyClass = py::class_<Class, std::shared_ptr<Class>>;
 
     py::class_<Class> cls(mod, ("BaselineUtils" + suffix).c_str());
-    cls.def_static("symmetrizeFootprint", &Class::symmetrizeFootprint, "foot"_a, "cx"_a, "cy"_a);
+    cls.def_static("symmetrizeFootprint",
+                   (FootprintPtrT (*)(lsst::afw::detection::Footprint const&, int, int)) &
+                           Class::symmetrizeFootprint,
+                   "foot"_a, "cx"_a, "cy"_a);
+    cls.def_static("symmetrizeFootprint",
+                   (FootprintPtrT (*)(lsst::afw::detection::Footprint const&, SpanIndex const&, int, int)) &
+                           Class::symmetrizeFootprint,
+                   "foot"_a, "index"_a, "cx"_a, "cy"_a);
     // The C++ function returns a std::pair return value but also takes a referenced boolean
     // (patchedEdges) that is modified by the function and used by the python API,
     // so we wrap this in a lambda to combine the std::pair and patchedEdges in a tuple
@@ -63,8 +72,42 @@ void declareBaselineUtils(py::module& mod, const std::string& suffix) {
         result = Class::buildSymmetricTemplate(img, foot, pk, sigma1, minZero, patchEdges, &patchedEdges);
         return py::make_tuple(result.first, result.second, patchedEdges);
     });
-    cls.def_static("medianFilter", &Class::medianFilter, "img"_a, "outimg"_a, "halfsize"_a);
+    cls.def_static("buildSymmetricTemplate", [](MaskedImageT const& img,
+                                                lsst::afw::detection::Footprint const& foot,
+                                                SpanIndex const& index,
+                                                lsst::afw::geom::SpanSet const& edgePixels,
+                                                lsst::afw::detection::PeakRecord const& pk, double sigma1,
+                                                bool minZero, bool patchEdges) {
+        bool patchedEdges;
+        std::pair<ImagePtrT, FootprintPtrT> result;
+
+        result = Class::buildSymmetricTemplate(img, foot, index, edgePixels, pk, sigma1, minZero,
+                                               patchEdges, &patchedEdges);
+        return py::make_tuple(result.first, result.second, patchedEdges);
+    });
+    // As above, returning the templates, their footprints and the patchedEdges flags as a tuple.
+    cls.def_static("buildSymmetricTemplates", [](MaskedImageT const& img,
+                                                 lsst::afw::detection::Footprint const& foot,
+                                                 lsst::afw::detection::PeakCatalog const& peaks,
+                                                 std::vector<bool> const& skip, double sigma1,
+                                                 bool minZero, bool patchEdges, int nThreads) {
+        std::vector<ImagePtrT> templates;
+        std::vector<FootprintPtrT> tfoots;
+        std::vector<bool> patchedEdges;
+
+        Class::buildSymmetricTemplates(img, foot, peaks, skip, sigma1, minZero, patchEdges, templates,
+                                       tfoots, patchedEdges, nThreads);
+        return py::make_tuple(templates, tfoots, patchedEdges);
+    }, "img"_a, "foot"_a, "peaks"_a, "skip"_a, "sigma1"_a, "minZero"_a, "patchEdges"_a, "nThreads"_a = 1);
+    cls.def_static("medianFilter",
+                   (void (*)(ImageT const&, ImageT&, int)) & Class::medianFilter,
+                   "img"_a, "outimg"_a, "halfsize"_a);
+    cls.def_static("medianFilter",
+                   (void (*)(ImageT const&, ImageT&, int, lsst::afw::detection::Footprint const&)) &
+                           Class::medianFilter,
+                   "img"_a, "outimg"_a, "halfsize"_a, "foot"_a);
     cls.def_static("makeMonotonic", &Class::makeMonotonic, "img"_a, "pk"_a);
+    cls.def_static("makeMonotonicRadial", &Class::makeMonotonicRadial, "img"_a, "pk"_a);
     // apportionFlux expects an empty vector containing HeavyFootprint pointers that is modified
     // in the function. But when a list is passed to pybind11 in place of the vector,
     // the changes are not passed back to python. So instead we create the vector in this lambda and
@@ -88,10 +131,46 @@ void declareBaselineUtils(py::module& mod, const std::string& suffix) {
 
         return py::make_tuple(result, strays);
     });
+    // As for apportionFlux, return the HeavyFootprint portions and strays as a tuple.
+    cls.def_static("apportionFluxToHeavy", [](MaskedImageT const& img,
+                                              lsst::afw::detection::Footprint const& foot,
+                                              std::vector<ImagePtrT> templates,
+                                              std::vector<FootprintPtrT> templ_footprints,
+                                              ImagePtrT templ_sum, std::vector<bool> const& ispsf,
+                                              std::vector<int> const& pkx, std::vector<int> const& pky,
+                                              int strayFluxOptions, double clipStrayFluxFraction) {
+        std::vector<typename Class::HeavyFootprintPtrT> strays;
+        std::vector<typename Class::HeavyFootprintPtrT> result =
+                Class::apportionFluxToHeavy(img, foot, templates, templ_footprints, templ_sum, ispsf, pkx,
+                                            pky, strays, strayFluxOptions, clipStrayFluxFraction);
+        return py::make_tuple(result, strays);
+    });
+    cls.def_static("mergeHeavyFootprints", &Class::mergeHeavyFootprints, "h1"_a, "h2"_a);
+    cls.def_static("findStrayPixels", &Class::findStrayPixels, "foot"_a, "tsum"_a, "img"_a);
+    cls.def_static("findEdgeMaskPixels", &Class::findEdgeMaskPixels, "img"_a, "foot"_a);
     cls.def_static("hasSignificantFluxAtEdge", &Class::hasSignificantFluxAtEdge, "img"_a, "sfoot"_a,
                    "thresh"_a);
     cls.def_static("getSignificantEdgePixels", &Class::getSignificantEdgePixels, "img"_a, "sfoot"_a,
                    "thresh"_a);
+    cls.def_static("weightTemplates", &Class::weightTemplates, "img"_a, "foot"_a, "timgs"_a);
+    cls.def_static("clipFootprintToNonzero", &Class::clipFootprintToNonzero, "foot"_a, "img"_a);
+    cls.def_static("clipFootprintsToNonzero", &Class::clipFootprintsToNonzero, "tfoots"_a, "timgs"_a);
+    cls.def_static("getRampSize", &Class::getRampSize, "psffwhm"_a);
+    cls.def_static("getRampPsf", &Class::getRampPsf, "psf"_a, "bbox"_a, "S"_a);
+    cls.def_static("getRampPsf", [](std::shared_ptr<lsst::afw::detection::Psf const> psf,
+                                    lsst::afw::geom::Box2I const& bbox, int S) {
+        return Class::getRampPsf(PsfImageCache(psf), bbox, S);
+    }, "psf"_a, "bbox"_a, "S"_a);
+    // As for buildSymmetricTemplate, return the template, its footprint and patchedEdges as a tuple.
+    cls.def_static("rampFluxAtEdge", [](MaskedImageT const& img, lsst::afw::detection::Footprint const& foot,
+                                        ImageT const& timg, lsst::afw::detection::Footprint const& tfoot,
+                                        lsst::afw::detection::PeakRecord const& pk,
+                                        lsst::afw::image::Image<double> const& psf, int S, bool patchEdges) {
+        bool patchedEdges;
+        std::pair<ImagePtrT, FootprintPtrT> result =
+                Class::rampFluxAtEdge(img, foot, timg, tfoot, pk, psf, S, patchEdges, &patchedEdges);
+        return py::make_tuple(result.first, result.second, patchedEdges);
+    }, "img"_a, "foot"_a, "timg"_a, "tfoot"_a, "pk"_a, "psf"_a, "S"_a, "patchEdges"_a);
     // There appears to be an issue binding to a static const member of a templated type, so for now
     // we just use the values constants
     cls.attr("ASSIGN_STRAYFLUX") = py::cast(Class::ASSIGN_STRAYFLUX);
@@ -101,17 +180,187 @@ void declareBaselineUtils(py::module& mod, const std::string& suffix) {
     cls.attr("STRAYFLUX_R_TO_FOOTPRINT") = py::cast(Class::STRAYFLUX_R_TO_FOOTPRINT);
     cls.attr("STRAYFLUX_NEAREST_FOOTPRINT") = py::cast(Class::STRAYFLUX_NEAREST_FOOTPRINT);
     cls.attr("STRAYFLUX_TRIM") = py::cast(Class::STRAYFLUX_TRIM);
+    cls.attr("STRAYFLUX_NEAREST_FOOTPRINT_EUCLIDEAN") =
+            py::cast(Class::STRAYFLUX_NEAREST_FOOTPRINT_EUCLIDEAN);
 };
 
+template <typename ImagePixelT, typename MaskPixelT = lsst::afw::image::MaskPixel,
+          typename VariancePixelT = lsst::afw::image::VariancePixel>
+void declareTemplatePipeline(py::module& mod, const std::string& suffix) {
+    using Class = TemplatePipeline<ImagePixelT, MaskPixelT, VariancePixelT>;
+    using ImagePtrT = typename Class::ImagePtrT;
+    using FootprintPtrT = typename Class::FootprintPtrT;
+
+    py::class_<Class, std::shared_ptr<Class>> cls(mod, ("TemplatePipeline" + suffix).c_str());
+    cls.def(py::init<>());
+    cls.def_readwrite("patchEdges", &Class::patchEdges);
+    cls.def_readwrite("rampFluxAtEdge", &Class::rampFluxAtEdge);
+    cls.def_readwrite("medianSmoothTemplate", &Class::medianSmoothTemplate);
+    cls.def_readwrite("medianFilterHalfsize", &Class::medianFilterHalfsize);
+    cls.def_readwrite("medianFilterFootprint", &Class::medianFilterFootprint);
+    cls.def_readwrite("monotonicTemplate", &Class::monotonicTemplate);
+    cls.def_readwrite("monotonicRadial", &Class::monotonicRadial);
+    cls.def_readwrite("clipFootprintToNonzero", &Class::clipFootprintToNonzero);
+    cls.def_readwrite("nThreads", &Class::nThreads);
+    // Return the templates, their footprints, the patchedEdges and rampedEdges flags and
+    // (if keepSymmetric) the symmetric templates and their footprints as a tuple.
+    auto run = [](Class const& self, typename Class::MaskedImageT const& img,
+                  lsst::afw::detection::Footprint const& foot,
+                  lsst::afw::detection::PeakCatalog const& peaks, std::vector<bool> const& skip,
+                  double sigma1, std::shared_ptr<PsfImageCache const> psf, double psffwhm,
+                  bool keepSymmetric) {
+        std::vector<ImagePtrT> templates;
+        std::vector<FootprintPtrT> tfoots;
+        std::vector<bool> patchedEdges;
+        std::vector<bool> rampedEdges;
+        std::vector<ImagePtrT> symmetric;
+        std::vector<FootprintPtrT> symmetricFoots;
+
+        self.run(img, foot, peaks, skip, sigma1, psf, psffwhm, templates, tfoots, patchedEdges, rampedEdges,
+                 keepSymmetric ? &symmetric : nullptr, keepSymmetric ? &symmetricFoots : nullptr);
+        return py::make_tuple(templates, tfoots, patchedEdges, rampedEdges, symmetric, symmetricFoots);
+    };
+    cls.def("run", run, "img"_a, "foot"_a, "peaks"_a, "skip"_a, "sigma1"_a, "psf"_a = nullptr,
+            "psffwhm"_a = 0., "keepSymmetric"_a = false);
+    // ... or with a bare Psf, given its own cache
+    cls.def("run", [run](Class const& self, typename Class::MaskedImageT const& img,
+                         lsst::afw::detection::Footprint const& foot,
+                         lsst::afw::detection::PeakCatalog const& peaks, std::vector<bool> const& skip,
+                         double sigma1, std::shared_ptr<lsst::afw::detection::Psf const> psf,
+                         double psffwhm, bool keepSymmetric) {
+        return run(self, img, foot, peaks, skip, sigma1, std::make_shared<PsfImageCache>(psf), psffwhm,
+                   keepSymmetric);
+    }, "img"_a, "foot"_a, "peaks"_a, "skip"_a, "sigma1"_a, "psf"_a, "psffwhm"_a = 0.,
+       "keepSymmetric"_a = false);
+}
+
+void declarePsfFit(py::module& mod) {
+    py::class_<PsfFit, std::shared_ptr<PsfFit>> cls(mod, "PsfFit");
+    cls.def_readonly("outOfBounds", &PsfFit::outOfBounds);
+    cls.def_readonly("tinyFootprint", &PsfFit::tinyFootprint);
+    cls.def_readonly("noValidPixels", &PsfFit::noValidPixels);
+    cls.def_readonly("failed", &PsfFit::failed);
+    cls.def_readonly("badDof", &PsfFit::badDof);
+    cls.def_readonly("chisq1", &PsfFit::chisq1);
+    cls.def_readonly("dof1", &PsfFit::dof1);
+    cls.def_readonly("chisq2", &PsfFit::chisq2);
+    cls.def_readonly("dof2", &PsfFit::dof2);
+    cls.def_readonly("chisq3", &PsfFit::chisq3);
+    cls.def_readonly("dof3", &PsfFit::dof3);
+    cls.def_readonly("hasFit3", &PsfFit::hasFit3);
+    cls.def_readonly("bigDecenter", &PsfFit::bigDecenter);
+    cls.def_readonly("withDecenter", &PsfFit::withDecenter);
+    cls.def_readonly("isPsf", &PsfFit::isPsf);
+    cls.def_readonly("R0", &PsfFit::R0);
+    cls.def_readonly("R1", &PsfFit::R1);
+    cls.def_readonly("xlo", &PsfFit::xlo);
+    cls.def_readonly("xhi", &PsfFit::xhi);
+    cls.def_readonly("ylo", &PsfFit::ylo);
+    cls.def_readonly("yhi", &PsfFit::yhi);
+    cls.def_readonly("cx", &PsfFit::cx);
+    cls.def_readonly("cy", &PsfFit::cy);
+    cls.def_readonly("chisq", &PsfFit::chisq);
+    cls.def_readonly("dof", &PsfFit::dof);
+    cls.def_readonly("params", &PsfFit::params);
+    cls.def_readonly("flux", &PsfFit::flux);
+    cls.def_readonly("nOthers", &PsfFit::nOthers);
+}
+
+template <typename ImagePixelT, typename MaskPixelT = lsst::afw::image::MaskPixel,
+          typename VariancePixelT = lsst::afw::image::VariancePixel>
+void declarePsfFitter(py::module& mod, const std::string& suffix) {
+    using Class = PsfFitter<ImagePixelT, MaskPixelT, VariancePixelT>;
+
+    py::class_<Class, std::shared_ptr<Class>> cls(mod, ("PsfFitter" + suffix).c_str());
+    cls.def(py::init<>());
+    cls.def_readwrite("psfChisqCut1", &Class::psfChisqCut1);
+    cls.def_readwrite("psfChisqCut2", &Class::psfChisqCut2);
+    cls.def_readwrite("psfChisqCut2b", &Class::psfChisqCut2b);
+    cls.def_readwrite("tinyFootprintSize", &Class::tinyFootprintSize);
+    cls.def("fit", &Class::fit, "img"_a, "foot"_a, "psf"_a, "psffwhm"_a, "npeaks"_a);
+    cls.def("fit", [](Class const& self, typename Class::MaskedImageT const& img,
+                      lsst::afw::detection::Footprint const& foot,
+                      std::shared_ptr<lsst::afw::detection::Psf const> psf, double psffwhm, int npeaks) {
+        return self.fit(img, foot, PsfImageCache(psf), psffwhm, npeaks);
+    }, "img"_a, "foot"_a, "psf"_a, "psffwhm"_a, "npeaks"_a);
+}
+
+template <typename ImagePixelT, typename MaskPixelT = lsst::afw::image::MaskPixel,
+          typename VariancePixelT = lsst::afw::image::VariancePixel>
+void declareTemplateGram(py::module& mod, const std::string& suffix) {
+    using Class = TemplateGram<ImagePixelT, MaskPixelT, VariancePixelT>;
+
+    py::class_<Class, std::shared_ptr<Class>> cls(mod, ("TemplateGram" + suffix).c_str());
+    cls.def(py::init<std::vector<typename Class::ImagePtrT> const&,
+                     std::vector<typename Class::FootprintPtrT> const&>(),
+            "timgs"_a, "tfoots"_a);
+    cls.def("size", &Class::size);
+    cls.def("isActive", &Class::isActive, "i"_a);
+    cls.def("dot", &Class::dot, "i"_a, "j"_a);
+    cls.def("remove", &Class::remove, "i"_a);
+    cls.def("scale", &Class::scale, "i"_a, "factor"_a);
+    // (i, j, cosine), or None
+    cls.def("findDegenerate", [](Class const& self, double maxTempDotProd) -> py::object {
+        int i, j;
+        double cosine;
+        if (!self.findDegenerate(maxTempDotProd, i, j, cosine)) {
+            return py::none();
+        }
+        return py::make_tuple(i, j, cosine);
+    }, "maxTempDotProd"_a);
+}
+
+void declarePsfImageCache(py::module& mod) {
+    py::class_<PsfImageCache, std::shared_ptr<PsfImageCache>> cls(mod, "PsfImageCache");
+    cls.def(py::init<std::shared_ptr<lsst::afw::detection::Psf const>, double, std::size_t, bool>(),
+            "psf"_a, "gridSize"_a = 0., "maxBytes"_a = 64 << 20, "interpolate"_a = false);
+    cls.def("getPsf", &PsfImageCache::getPsf);
+    cls.def("getGridSize", &PsfImageCache::getGridSize);
+    cls.def("getMaxBytes", &PsfImageCache::getMaxBytes);
+    cls.def("getInterpolate", &PsfImageCache::getInterpolate);
+    // A copy, as python may modify it
+    cls.def("computeImage", [](PsfImageCache const& self, lsst::afw::geom::Point2D const& position) {
+        return std::make_shared<PsfImageCache::Image>(*self.computeImage(position), true);
+    }, "position"_a);
+    cls.def("getBytes", &PsfImageCache::getBytes);
+    cls.def("getHits", &PsfImageCache::getHits);
+    cls.def("getMisses", &PsfImageCache::getMisses);
+    cls.def("clear", &PsfImageCache::clear);
+}
+
+void declareBoxIndex(py::module& mod) {
+    py::class_<BoxIndex, std::shared_ptr<BoxIndex>> cls(mod, "BoxIndex");
+    cls.def(py::init<std::vector<lsst::afw::geom::Box2I> const&, int>(), "boxes"_a, "cellSize"_a = 0);
+    cls.def("size", &BoxIndex::size);
+    cls.def("getCellSize", &BoxIndex::getCellSize);
+    cls.def("query", &BoxIndex::query, "box"_a);
+    cls.def("getOverlappingPairs", &BoxIndex::getOverlappingPairs);
+}
+
+void declareSpanIndex(py::module& mod) {
+    py::class_<SpanIndex, std::shared_ptr<SpanIndex>> cls(mod, "SpanIndex");
+    cls.def(py::init<std::shared_ptr<lsst::afw::geom::SpanSet const>>(), "spans"_a);
+    cls.def("getBBox", &SpanIndex::getBBox);
+    cls.def("findEdgePixels", &SpanIndex::findEdgePixels);
+}
+
 }  // <anonymous>
 
 PYBIND11_PLUGIN(baselineUtils) {
+    py::module::import("lsst.afw.geom");
     py::module::import("lsst.afw.image");
     py::module::import("lsst.afw.detection");
 
     py::module mod("baselineUtils");
 
+    declareSpanIndex(mod);
+    declareBoxIndex(mod);
+    declarePsfImageCache(mod);
     declareBaselineUtils<float>(mod, "F");
+    declareTemplatePipeline<float>(mod, "F");
+    declarePsfFit(mod);
+    declarePsfFitter<float>(mod, "F");
+    declareTemplateGram<float>(mod, "F");
 
     return mod.ptr();
 }
@@ -70,6 +70,8 @@ class SourceDeblendConfig(pexConf.Config):
                                'CAUTION: this can be computationally expensive on large footprints!'),
             'nearest-footprint': ('Assign 100% to the nearest footprint (using L-1 norm aka '
                                   'Manhattan distance)'),
+            'nearest-footprint-euclidean': ('Assign 100% to the nearest footprint (using L-2 norm aka '
+                                            'Euclidean distance)'),
             'trim': ('Shrink the parent footprint to pixels that are not assigned to children')
         }
     )
@@ -132,6 +134,32 @@ class SourceDeblendConfig(pexConf.Config):
                                         "be removed."))
     medianSmoothTemplate = pexConf.Field(dtype=bool, default=True,
                                          doc="Apply a smoothing filter to all of the template images")
+    medianFilterFootprint = pexConf.Field(dtype=bool, default=False,
+                                          doc=("Median filter only the pixels in each template footprint, "
+                                               "rather than the whole template image"))
+    heavyPortions = pexConf.Field(dtype=bool, default=False,
+                                  doc=("Keep the flux assigned to each child as a HeavyFootprint over its "
+                                       "template footprint, rather than an image of its bounding box; "
+                                       "saves memory for large templates"))
+    psfCacheGridSize = pexConf.Field(dtype=float, default=0.,
+                                     doc=("Snap the positions of the PSF images cached for the exposure to a "
+                                          "grid of this many pixels; 0 caches them at the exact positions. "
+                                          "Images are moved by whole pixels to where they are wanted, so "
+                                          "grids coarser than a pixel leave them up to half a pixel off"))
+    psfCacheInterpolate = pexConf.Field(dtype=bool, default=False,
+                                        doc=("Interpolate PSF images between the cache's grid points "
+                                             "rather than snapping to the nearest (needs psfCacheGridSize)"))
+    psfCacheMaxBytes = pexConf.Field(dtype=int, default=64*1024*1024,
+                                     doc="Most memory to use for the exposure's cache of PSF images")
+    monotonicAlgorithm = pexConf.ChoiceField(
+        doc='How to make the templates monotonic',
+        dtype=str, default='shadow',
+        allowed={
+            'shadow': 'Each pixel casts a cone-shaped "shadow" on pixels further from the peak',
+            'radial': ('Clamp each pixel to its neighbours nearer the peak, in one pass outward; '
+                       'faster, but with narrower shadows'),
+        }
+    )
 
 ## \addtogroup LSST_task_documentation
 ## \{
@@ -256,6 +284,11 @@ class SourceDeblendTask(pipeBase.Task):
         self.log.info("Deblending %d sources" % len(srcs))
 
         from lsst.meas.deblender.baseline import deblend
+        from lsst.meas.deblender.baselineUtils import PsfImageCache
+
+        # PSF images are shared by all of the parents
+        psfCache = PsfImageCache(psf, self.config.psfCacheGridSize, self.config.psfCacheMaxBytes,
+                                 self.config.psfCacheInterpolate)
 
         # find the median stdev in the image...
         mi = exposure.getMaskedImage()
@@ -305,7 +338,7 @@ class SourceDeblendTask(pipeBase.Task):
 
             try:
                 res = deblend(
-                    fp, mi, psf, psf_fwhm, sigma1=sigma1,
+                    fp, mi, psfCache, psf_fwhm, sigma1=sigma1,
                     psfChisqCut1=self.config.psfChisq1,
                     psfChisqCut2=self.config.psfChisq2,
                     psfChisqCut2b=self.config.psfChisq2b,
@@ -320,7 +353,10 @@ class SourceDeblendTask(pipeBase.Task):
                     weightTemplates=self.config.weightTemplates,
                     removeDegenerateTemplates=self.config.removeDegenerateTemplates,
                     maxTempDotProd=self.config.maxTempDotProd,
-                    medianSmoothTemplate=self.config.medianSmoothTemplate
+                    medianSmoothTemplate=self.config.medianSmoothTemplate,
+                    medianFilterFootprint=self.config.medianFilterFootprint,
+                    monotonicAlgorithm=self.config.monotonicAlgorithm,
+                    heavyPortions=self.config.heavyPortions
                 )
                 if self.config.catchFailures:
                     src.set(self.deblendFailedKey, False)
@@ -397,6 +433,7 @@ class SourceDeblendTask(pipeBase.Task):
         n1 = len(srcs)
         self.log.info('Deblended: of %i sources, %i were deblended, creating %i children, total %i sources'
                       % (n0, nparents, n1-n0, n1))
+        self.log.debug('PSF image cache: %i hits, %i misses', psfCache.getHits(), psfCache.getMisses())
 
     def preSingleDeblendHook(self, exposure, srcs, i, fp, psf, psf_fwhm, sigma1):
         pass
@@ -30,6 +30,7 @@ import lsst.afw.geom as afwGeom
 
 # Import C++ routines
 from .baselineUtils import BaselineUtilsF as butils
+from .baselineUtils import TemplatePipelineF, PsfFitterF, TemplateGramF
 
 
 def clipFootprintToNonzeroImpl(foot, image):
@@ -39,10 +40,13 @@ def clipFootprintToNonzeroImpl(foot, image):
      totally zero, and moves endpoints to non-zero; it does not
      split spans that have internal zeros.
     '''
+    if isinstance(image, afwImage.ImageF):
+        butils.clipFootprintToNonzero(foot, image)
+        return
     x0 = image.getX0()
     y0 = image.getY0()
-    xImMax = x0 + image.getDimensions().getX()
-    yImMax = y0 + image.getDimensions().getY()
+    xImMax = x0 + image.getDimensions().getX() - 1
+    yImMax = y0 + image.getDimensions().getY() - 1
     newSpans = []
     arr = image.getArray()
     for span in foot.spans:
@@ -159,12 +163,32 @@ def fitPsfs(debResult, log, psfChisqCut1=1.5, psfChisqCut2=1.5, psfChisqCut2b=1.
         otherwise it is ``False``.
     """
     from .baseline import CachingPsf
+    import lsstDebug
+
+    # The debugging plots and images are only made by the python fitter, _fitPsf
+    debug = lsstDebug.Info(__name__)
+    useFitter = not (debug.plots or debug.psf)
+    fitter = PsfFitterF()
+    fitter.psfChisqCut1 = psfChisqCut1
+    fitter.psfChisqCut2 = psfChisqCut2
+    fitter.psfChisqCut2b = psfChisqCut2b
+    fitter.tinyFootprintSize = tinyFootprintSize
+
     modified = False
     # Loop over all of the filters to build the PSF
     for fidx in debResult.filters:
         dp = debResult.deblendedParents[fidx]
         peaks = dp.fp.getPeaks()
-        cpsf = CachingPsf(dp.psf)
+        cpsf = CachingPsf(dp.psfCache)
+
+        if useFitter:
+            # Fit all of the peaks at once
+            fits = fitter.fit(dp.maskedImage, dp.fp, dp.psfCache, dp.psffwhm, len(dp.peaks))
+            for pki, (pkres, fit) in enumerate(zip(dp.peaks, fits)):
+                log.trace('Filter %s, Peak %i', fidx, pki)
+                ispsf = _applyPsfFit(fit, dp.fp, pkres, log, cpsf)
+                modified = modified or ispsf
+            continue
 
         # create mask image for pixels within the footprint
         fmask = afwImage.Mask(dp.bb)
@@ -619,36 +643,105 @@ def _fitPsf(fp, fmask, pk, pkF, pkres, fbb, peaks, peaksF, log, psf, psffwhm,
     pkres.psfFitNOthers = len(otherpeaks)
 
     if ispsf:
-        pkres.setDeblendedAsPsf()
-
-        # replace the template image by the PSF + derivatives
-        # image.
-        log.trace('Deblending as PSF; setting template to PSF model')
-
-        # Instantiate the PSF model and clip it to the footprint
-        psfimg = psf.computeImage(cx, cy)
-        # Scale by fit flux.
-        psfimg *= Xpsf[I_psf]
-        psfimg = psfimg.convertF()
-
-        # Clip the Footprint to the PSF model image bbox.
-        fpcopy = afwDet.Footprint(fp)
-        psfbb = psfimg.getBBox()
-        fpcopy.clipTo(psfbb)
-        bb = fpcopy.getBBox()
-
-        # Copy the part of the PSF model within the clipped footprint.
-        psfmod = afwImage.ImageF(bb)
-        fpcopy.spans.copyImage(psfimg, psfmod)
-        # Save it as our template.
-        clipFootprintToNonzeroImpl(fpcopy, psfmod)
-        pkres.setTemplate(psfmod, fpcopy)
-
-        # DEBUG
-        pkres.setPsfTemplate(psfmod, fpcopy)
+        _setPsfTemplate(fp, pkres, log, psf, cx, cy, Xpsf[I_psf])
 
     return ispsf
 
+def _applyPsfFit(fit, fp, pkres, log, psf):
+    """Record the result of a `PsfFitterF` fit to a peak, as _fitPsf does
+
+    Parameters
+    ----------
+    fit: `PsfFit`
+        The fit to the peak.
+    fp: `afw.detection.Footprint`
+        Footprint containing the peak.
+    pkres: `meas.deblender.DeblendedPeak`
+        Peak results object that will hold the results.
+    log: `log.Log`
+        LSST logger for logging purposes.
+    psf: `afw.detection.Psf`
+        Psf of the image, to build the template from if the peak is a PSF.
+
+    Results
+    -------
+    ispsf: `bool`
+        Whether or not the peak matches a PSF model.
+    """
+    if fit.outOfBounds:
+        pkres.setOutOfBounds()
+        return
+    if fit.tinyFootprint:
+        log.trace('Skipping this peak: tiny footprint / close to edge')
+        pkres.setTinyFootprint()
+        return
+    if fit.noValidPixels:
+        log.warn('Skipping peak: no unmasked pixels nearby')
+        pkres.setNoValidPixels()
+        return
+    if fit.failed:
+        log.warn("Failed to fit PSF to child: non-finite values in the model")
+        pkres.setPsfFitFailed()
+        return
+    if fit.badDof:
+        log.trace('Skipping this peak: bad DOF')
+        pkres.setBadPsfDof()
+        return
+
+    pkres.psfFit1 = (fit.chisq1, fit.dof1)
+    pkres.psfFit2 = (fit.chisq2, fit.dof2)
+    if fit.hasFit3:
+        pkres.psfFit3 = (fit.chisq3, fit.dof3)
+    if fit.bigDecenter:
+        pkres.psfFitBigDecenter = True
+    if fit.withDecenter:
+        pkres.psfFitWithDecenter = True
+
+    pkres.psfFitR0 = fit.R0
+    pkres.psfFitR1 = fit.R1
+    pkres.psfFitStampExtent = (fit.xlo, fit.xhi, fit.ylo, fit.yhi)
+    pkres.psfFitCenter = (fit.cx, fit.cy)
+    pkres.psfFitBest = (fit.chisq, fit.dof)
+    pkres.psfFitParams = np.array(fit.params)
+    pkres.psfFitFlux = fit.flux
+    pkres.psfFitNOthers = fit.nOthers
+
+    if fit.isPsf:
+        _setPsfTemplate(fp, pkres, log, psf, fit.cx, fit.cy, fit.flux)
+    return fit.isPsf
+
+def _setPsfTemplate(fp, pkres, log, psf, cx, cy, flux):
+    """Mark a peak as a PSF and set its template to the PSF model at (cx, cy) with the given flux
+    """
+    pkres.setDeblendedAsPsf()
+
+    # replace the template image by the PSF + derivatives
+    # image.
+    log.trace('Deblending as PSF; setting template to PSF model')
+
+    # Instantiate the PSF model and clip it to the footprint; a copy, as
+    # the PSF image is cached and used again for neighbouring peaks' fits.
+    psfimg = afwImage.ImageD(psf.computeImage(cx, cy), True)
+    # Scale by fit flux.
+    psfimg *= flux
+    psfimg = psfimg.convertF()
+
+    # Clip the Footprint to the PSF model image bbox.
+    fpcopy = afwDet.Footprint(fp)
+    psfbb = psfimg.getBBox()
+    fpcopy.clipTo(psfbb)
+    bb = fpcopy.getBBox()
+
+    # Copy the part of the PSF model within the clipped footprint.
+    psfmod = afwImage.ImageF(bb)
+    fpcopy.spans.copyImage(psfimg, psfmod)
+    # Save it as our template.
+    clipFootprintToNonzeroImpl(fpcopy, psfmod)
+    pkres.setTemplate(psfmod, fpcopy)
+
+    # DEBUG
+    pkres.setPsfTemplate(psfmod, fpcopy)
+
 def buildSymmetricTemplates(debResult, log, patchEdges=False, setOrigTemplate=True):
     """Build a symmetric template for each peak in each filter
 
@@ -678,9 +771,10 @@ def buildSymmetricTemplates(debResult, log, patchEdges=False, setOrigTemplate=Tr
         dp = debResult.deblendedParents[fidx]
         imbb = dp.img.getBBox()
         log.trace('Creating templates for footprint at x0,y0,W,H = %i, %i, %i, %i)', dp.x0, dp.y0, dp.W, dp.H)
-
+        # The peaks to build templates for; the rest are skipped.
+        peaks = dp.fp.getPeaks()
+        skip = [True]*len(peaks)
         for peaki, pkres in enumerate(dp.peaks):
-            log.trace('Deblending peak %i of %i', peaki, len(dp.peaks))
             # TODO: Check debResult to see if the peak is deblended as a point source
             # when comparing all bands, not just a single band
             if pkres.skip or pkres.deblendedAsPsf:
@@ -692,15 +786,26 @@ def buildSymmetricTemplates(debResult, log, patchEdges=False, setOrigTemplate=Tr
                 log.trace('Peak center is not inside image; skipping %i', pkres.pki)
                 pkres.setOutOfBounds()
                 continue
-            log.trace('computing template for peak %i at (%i, %i)', pkres.pki, cx, cy)
-            timg, tfoot, patched = butils.buildSymmetricTemplate(dp.maskedImage, dp.fp, pk, dp.avgNoise,
-                                                       True, patchEdges)
+            skip[pkres.pki] = False
+        if all(skip):
+            continue
+
+        # Build them all at once, sharing the work that depends only on the parent
+        timgs, tfoots, patched = butils.buildSymmetricTemplates(dp.maskedImage, dp.fp, peaks, skip,
+                                                                dp.avgNoise, True, patchEdges)
+
+        for pkres in dp.peaks:
+            if skip[pkres.pki]:
+                continue
+            cx, cy = pkres.peak.getIx(), pkres.peak.getIy()
+            log.trace('computed template for peak %i of %i at (%i, %i)', pkres.pki, len(dp.peaks), cx, cy)
+            timg, tfoot = timgs[pkres.pki], tfoots[pkres.pki]
             if timg is None:
                 log.trace('Peak %i at (%i, %i): failed to build symmetric template', pkres.pki, cx, cy)
                 pkres.setFailedSymmetricTemplate()
                 continue
 
-            if patched:
+            if patched[pkres.pki]:
                 pkres.setPatched()
 
             # possibly save the original symmetric template
@@ -747,7 +852,7 @@ def rampFluxAtEdge(debResult, log, patchEdges=False):
                 try:
                     (timg2, tfoot2, patched) = _handle_flux_at_edge(log, dp.psffwhm, timg, tfoot, dp.fp,
                                                                     dp.maskedImage, dp.x0, dp.x1,
-                                                                    dp.y0, dp.y1, dp.psf, pkres.peak,
+                                                                    dp.y0, dp.y1, dp.psfCache, pkres.peak,
                                                                     dp.avgNoise, patchEdges)
                 except lsst.pex.exceptions.Exception as exc:
                     if (isinstance(exc, lsst.pex.exceptions.InvalidParameterError)
@@ -788,7 +893,7 @@ def _handle_flux_at_edge(log, psffwhm, t1, tfoot, fp, maskedImage,
         Minimum x,y for the bounding box of the footprint ``fp``.
     x1,y1: `int`
         Maximum x,y for the bounding box of the footprint ``fp``.
-    psf: `afw.detection.Psf`
+    psf: `afw.detection.Psf` or `PsfImageCache`
         PSF of the image.
     pk: `afw.detection.PeakRecord`
         The peak within the Footprint whose footprint is being extended.
@@ -818,80 +923,14 @@ def _handle_flux_at_edge(log, psffwhm, t1, tfoot, fp, maskedImage,
     # Then find the symmetric template of that image.
 
     # The size we'll grow by
-    S = psffwhm*1.5
-    # make it an odd integer
-    S = int((S + 0.5)/2)*2 + 1
-
-    tbb = tfoot.getBBox()
-    tbb.grow(S)
-
-    # (footprint+margin)-clipped image;
-    # we need the pixels OUTSIDE the footprint to be 0.
-    fpcopy = afwDet.Footprint(fp)
-    fpcopy.dilate(S)
-    fpcopy.setSpans(fpcopy.spans.clippedTo(tbb))
-    fpcopy.removeOrphanPeaks()
-    padim = maskedImage.Factory(tbb)
-    fpcopy.spans.clippedTo(maskedImage.getBBox()).copyMaskedImage(maskedImage, padim)
-
-    # find pixels on the edge of the template
-    edgepix = butils.getSignificantEdgePixels(t1, tfoot, -1e6)
-
-    # instantiate PSF image
-    xc = int((x0 + x1)/2)
-    yc = int((y0 + y1)/2)
-    psfim = psf.computeImage(afwGeom.Point2D(xc, yc))
-    pbb = psfim.getBBox()
-    # shift PSF image to be centered on zero
-    lx, ly = pbb.getMinX(), pbb.getMinY()
-    psfim.setXY0(lx - xc, ly - yc)
-    pbb = psfim.getBBox()
-    # clip PSF to S, if necessary
-    Sbox = afwGeom.Box2I(afwGeom.Point2I(-S, -S), afwGeom.Extent2I(2*S+1, 2*S+1))
-    if not Sbox.contains(pbb):
-        # clip PSF image
-        psfim = psfim.Factory(psfim, Sbox, afwImage.PARENT, True)
-        pbb = psfim.getBBox()
-    px0 = pbb.getMinX()
-    px1 = pbb.getMaxX()
-    py0 = pbb.getMinY()
-    py1 = pbb.getMaxY()
-
-    # Compute the ramped-down edge pixels
-    ramped = t1.Factory(tbb)
-    Tout = ramped.getArray()
-    Tin = t1.getArray()
-    tx0, ty0 = t1.getX0(), t1.getY0()
-    ox0, oy0 = ramped.getX0(), ramped.getY0()
-    P = psfim.getArray()
-    P /= P.max()
-    # For each edge pixel, Tout = max(Tout, edgepix * PSF)
-    for span in edgepix.getSpans():
-        y = span.getY()
-        for x in range(span.getX0(), span.getX1()+1):
-            slc = (slice(y+py0 - oy0, y+py1+1 - oy0),
-                   slice(x+px0 - ox0, x+px1+1 - ox0))
-            Tout[slc] = np.maximum(Tout[slc], Tin[y-ty0, x-tx0]*P)
-
-    # Fill in the "padim" (which has the right variance and
-    # mask planes) with the ramped pixels, outside the footprint
-    I = (padim.getImage().getArray() == 0)
-    padim.getImage().getArray()[I] = ramped.getArray()[I]
-
-    t2, tfoot2, patched = butils.buildSymmetricTemplate(padim, fpcopy, pk, sigma1, True, patchEdges)
-
-    # This template footprint may extend outside the parent
-    # footprint -- or the image.  Clip it.
-    # NOTE that this may make it asymmetric, unlike normal templates.
-    imbb = maskedImage.getBBox()
-    tfoot2.clipTo(imbb)
-    tbb = tfoot2.getBBox()
-    # clip template image to bbox
-    t2 = t2.Factory(t2, tbb, afwImage.PARENT, True)
+    S = butils.getRampSize(psffwhm)
+    # PSF image, centred on zero and clipped to S
+    psfim = butils.getRampPsf(psf, afwGeom.Box2I(afwGeom.Point2I(x0, y0), afwGeom.Point2I(x1, y1)), S)
 
+    t2, tfoot2, patched = butils.rampFluxAtEdge(maskedImage, fp, t1, tfoot, pk, psfim, S, patchEdges)
     return t2, tfoot2, patched
 
-def medianSmoothTemplates(debResult, log, medianFilterHalfsize=2):
+def medianSmoothTemplates(debResult, log, medianFilterHalfsize=2, medianFilterFootprint=False):
     """Applying median smoothing filter to the template images for every peak in every filter.
 
     Parameters
@@ -904,6 +943,10 @@ def medianSmoothTemplates(debResult, log, medianFilterHalfsize=2):
         Half the box size of the median filter, i.e. a ``medianFilterHalfSize`` of 50 means that
         each output pixel will be the median of  the pixels in a 101 x 101-pixel box in the input image.
         This parameter is only used when ``medianSmoothTemplate==True``, otherwise it is ignored.
+    medianFilterFootprint: `bool`, optional
+        If ``True``, only filter the pixels in each template footprint, using boxes clipped
+        to the template image near its edges, rather than filtering the whole template image
+        and copying a ``medianFilterHalfsize`` margin.
 
     Returns
     -------
@@ -921,7 +964,12 @@ def medianSmoothTemplates(debResult, log, medianFilterHalfsize=2):
             modified = True
             timg, tfoot = pkres.templateImage, pkres.templateFootprint
             filtsize = medianFilterHalfsize*2 + 1
-            if timg.getWidth() >= filtsize and timg.getHeight() >= filtsize:
+            if medianFilterFootprint:
+                log.trace('Median filtering template footprint %i', pkres.pki)
+                inimg = timg.Factory(timg, True)
+                butils.medianFilter(inimg, timg, medianFilterHalfsize, tfoot)
+                pkres.setMedianFilteredTemplate(timg, tfoot)
+            elif timg.getWidth() >= filtsize and timg.getHeight() >= filtsize:
                 log.trace('Median filtering template %i', pkres.pki)
                 # We want the output to go in "t1", so copy it into
                 # "inimg" for input
@@ -935,7 +983,7 @@ def medianSmoothTemplates(debResult, log, medianFilterHalfsize=2):
             pkres.setTemplate(timg, tfoot)
     return modified
 
-def makeTemplatesMonotonic(debResult, log):
+def makeTemplatesMonotonic(debResult, log, monotonicAlgorithm='shadow'):
     """Make the templates monotonic.
 
     The pixels in the templates are modified such that pixels further from the peak will
@@ -947,6 +995,11 @@ def makeTemplatesMonotonic(debResult, log):
         Container for the final deblender results.
     log: `log.Log`
         LSST logger for logging purposes.
+    monotonicAlgorithm: `str`, optional
+        Which algorithm to use:
+        'shadow' casts a cone-shaped "shadow" outward from each pixel (`BaselineUtils.makeMonotonic`);
+        'radial' clamps each pixel, in a single pass outward from the peak, to its
+        neighbours nearer the peak (`BaselineUtils.makeMonotonicRadial`).
 
     Returns
     -------
@@ -954,6 +1007,13 @@ def makeTemplatesMonotonic(debResult, log):
         Whether or not any templates were modified.
         This will be ``True`` as long as there is at least one source that is not flagged as a PSF.
     """
+    if monotonicAlgorithm == 'shadow':
+        makeMonotonic = butils.makeMonotonic
+    elif monotonicAlgorithm == 'radial':
+        makeMonotonic = butils.makeMonotonicRadial
+    else:
+        raise ValueError('Unknown monotonicAlgorithm "%s"' % monotonicAlgorithm)
+
     modified = False
     # Loop over all filters
     for fidx in debResult.filters:
@@ -965,7 +1025,7 @@ def makeTemplatesMonotonic(debResult, log):
             timg, tfoot = pkres.templateImage, pkres.templateFootprint
             pk = pkres.peak
             log.trace('Making template %i monotonic', pkres.pki)
-            butils.makeMonotonic(timg, pk)
+            makeMonotonic(timg, pk)
             pkres.setTemplate(timg, tfoot)
     return modified
 
@@ -993,16 +1053,118 @@ def clipFootprintsToNonzero(debResult, log):
     # Loop over all filters
     for fidx in debResult.filters:
         dp = debResult.deblendedParents[fidx]
-        for peaki, pkres in enumerate(dp.peaks):
+        # All of the templates of the parent are clipped in one C++ call.
+        peaks = [pkres for pkres in dp.peaks if not (pkres.skip or pkres.deblendedAsPsf)]
+        if len(peaks) == 0:
+            continue
+        modified = True
+        tfoots = [pkres.templateFootprint for pkres in peaks]
+        timgs = butils.clipFootprintsToNonzero(tfoots, [pkres.templateImage for pkres in peaks])
+        for pkres, timg, tfoot in zip(peaks, timgs, tfoots):
+            pkres.setTemplate(timg, tfoot)
+    return False
+
+def buildTemplates(debResult, log, patchEdges=False, rampFluxAtEdge=False, medianSmoothTemplate=True,
+                   medianFilterHalfsize=2, medianFilterFootprint=False, monotonicTemplate=True,
+                   monotonicAlgorithm='shadow', clipFootprintToNonzero=True, setOrigTemplate=True):
+    """Build the template for each peak in each filter, running all of the template stages at once
+
+    This gives the same templates as `buildSymmetricTemplates` followed by `rampFluxAtEdge`,
+    `medianSmoothTemplates`, `makeTemplatesMonotonic` and `clipFootprintsToNonzero`, but runs the
+    stages one peak at a time in C++ (`TemplatePipelineF`), so each template is built and modified
+    in place without a round trip through python between stages.  The ramped and median-filtered
+    templates are not saved.
+
+    Parameters
+    ----------
+    debResult: `lsst.meas.deblender.baseline.DeblenderResult`
+        Container for the final deblender results.
+    log: `log.Log`
+        LSST logger for logging purposes.
+    patchEdges: `bool`, optional
+        See `buildSymmetricTemplates`.
+    rampFluxAtEdge: `bool`, optional
+        Whether to ramp templates with significant flux at their edges; see `rampFluxAtEdge`.
+    medianSmoothTemplate: `bool`, optional
+        Whether to median filter the templates; see `medianSmoothTemplates` for
+        ``medianFilterHalfsize`` and ``medianFilterFootprint``.
+    monotonicTemplate: `bool`, optional
+        Whether to make the templates monotonic; see `makeTemplatesMonotonic` for
+        ``monotonicAlgorithm``.
+    clipFootprintToNonzero: `bool`, optional
+        Whether to clip the template footprints; see `clipFootprintsToNonzero`.
+    setOrigTemplate: `bool`, optional
+        Whether to save the symmetric templates as the ``origTemplate`` of each peak.
+
+    Returns
+    -------
+    modified: `bool`
+        If any peaks are not skipped or marked as point sources, ``modified`` is ``True.
+        Otherwise ``modified`` is ``False``.
+    """
+    if monotonicAlgorithm not in ('shadow', 'radial'):
+        raise ValueError('Unknown monotonicAlgorithm "%s"' % monotonicAlgorithm)
+    pipeline = TemplatePipelineF()
+    pipeline.patchEdges = patchEdges
+    pipeline.rampFluxAtEdge = rampFluxAtEdge
+    pipeline.medianSmoothTemplate = medianSmoothTemplate
+    pipeline.medianFilterHalfsize = medianFilterHalfsize
+    pipeline.medianFilterFootprint = medianFilterFootprint
+    pipeline.monotonicTemplate = monotonicTemplate
+    pipeline.monotonicRadial = (monotonicAlgorithm == 'radial')
+    pipeline.clipFootprintToNonzero = clipFootprintToNonzero
+
+    modified = False
+    for fidx in debResult.filters:
+        dp = debResult.deblendedParents[fidx]
+        imbb = dp.img.getBBox()
+        log.trace('Creating templates for footprint at x0,y0,W,H = %i, %i, %i, %i)', dp.x0, dp.y0, dp.W, dp.H)
+        peaks = dp.fp.getPeaks()
+        skip = [True]*len(peaks)
+        for pkres in dp.peaks:
             if pkres.skip or pkres.deblendedAsPsf:
                 continue
             modified = True
-            timg, tfoot = pkres.templateImage, pkres.templateFootprint
-            clipFootprintToNonzeroImpl(tfoot, timg)
-            if not tfoot.getBBox().isEmpty() and tfoot.getBBox() != timg.getBBox(afwImage.PARENT):
-                timg = timg.Factory(timg, tfoot.getBBox(), afwImage.PARENT, True)
+            cx, cy = pkres.peak.getIx(), pkres.peak.getIy()
+            if not imbb.contains(afwGeom.Point2I(cx, cy)):
+                log.trace('Peak center is not inside image; skipping %i', pkres.pki)
+                pkres.setOutOfBounds()
+                continue
+            skip[pkres.pki] = False
+        if all(skip):
+            continue
+
+        timgs, tfoots, patched, ramped, symmetric, sfoots = pipeline.run(dp.maskedImage, dp.fp, peaks, skip,
+                                                                         dp.avgNoise, dp.psfCache,
+                                                                         dp.psffwhm, setOrigTemplate)
+
+        for pkres in dp.peaks:
+            if skip[pkres.pki]:
+                continue
+            cx, cy = pkres.peak.getIx(), pkres.peak.getIy()
+            timg, tfoot = timgs[pkres.pki], tfoots[pkres.pki]
+            if timg is None and ramped[pkres.pki]:
+                # the CoaddPsf could not be evaluated to ramp the template
+                pkres.setOutOfBounds()
+                continue
+            if timg is None:
+                log.trace('Peak %i at (%i, %i): failed to build symmetric template', pkres.pki, cx, cy)
+                pkres.setFailedSymmetricTemplate()
+                continue
+            log.trace('computed template for peak %i of %i at (%i, %i)', pkres.pki, len(dp.peaks), cx, cy)
+
+            if patched[pkres.pki]:
+                pkres.setPatched()
+            if ramped[pkres.pki]:
+                log.trace("Template %i has significant flux at edge: ramped", pkres.pki)
+                pkres.hasRampedTemplate = True
+
+            # the symmetric templates and footprints are already copies
+            if setOrigTemplate:
+                pkres.origTemplate = symmetric[pkres.pki]
+                pkres.origFootprint = sfoots[pkres.pki]
             pkres.setTemplate(timg, tfoot)
-    return False
+    return modified
 
 def weightTemplates(debResult, log):
     """Weight the templates to best fit the observed image in each filter
@@ -1044,24 +1206,10 @@ def _weightTemplates(dp):
     -------
     None
     """
-    nchild = np.sum([pkres.skip is False for pkres in dp.peaks])
-    A = np.zeros((dp.W*dp.H, nchild))
-    parentImage = afwImage.ImageF(dp.bb)
-    afwDet.copyWithinFootprintImage(dp.fp, dp.img, parentImage)
-    b = parentImage.getArray().ravel()
-
-    index = 0
-    for pkres in dp.peaks:
-        if pkres.skip:
-            continue
-        childImage = afwImage.ImageF(dp.bb)
-        afwDet.copyWithinFootprintImage(dp.fp, pkres.templateImage, childImage)
-        A[:, index] = childImage.getArray().ravel()
-        index += 1
-
-    X1, r1, rank1, s1 = np.linalg.lstsq(A, b)
-    del A
-    del b
+    # The normal equations are built in C++ from just the template pixels in
+    # the footprint, rather than as a dense (pixels x templates) matrix.
+    timgs = [pkres.templateImage for pkres in dp.peaks if not pkres.skip]
+    X1 = butils.weightTemplates(dp.maskedImage, dp.fp, timgs)
 
     index = 0
     for pkres in dp.peaks:
@@ -1069,6 +1217,8 @@ def _weightTemplates(dp):
             continue
         pkres.templateImage *= X1[index]
         pkres.setTemplateWeight(X1[index])
+        if dp.templateGram is not None:
+            dp.templateGram.scale(pkres.pki, X1[index])
         index += 1
 
 def reconstructTemplates(debResult, log, maxTempDotProd=0.5):
@@ -1102,78 +1252,62 @@ def reconstructTemplates(debResult, log, maxTempDotProd=0.5):
     foundReject = False
     for fidx in debResult.filters:
         dp = debResult.deblendedParents[fidx]
-        nchild = np.sum([pkres.skip is False for pkres in dp.peaks])
-        indexes = [pkres.pki for pkres in dp.peaks if pkres.skip is False]
-
-        # We build a matrix that stores the dot product between templates.
-        # We convert the template images to HeavyFootprints because they already have a method
-        # to compute the dot product.
-        A = np.zeros((nchild, nchild))
-        maxTemplate = []
-        heavies = []
-        for pkres in dp.peaks:
-            if pkres.skip:
-                continue
-            heavies.append(afwDet.makeHeavyFootprint(pkres.templateFootprint,
-                                                     afwImage.MaskedImageF(pkres.templateImage)))
-            maxTemplate.append(np.max(pkres.templateImage.getArray()))
-
-        for i in range(nchild):
-            for j in range(i + 1):
-                A[i, j] = heavies[i].dot(heavies[j])
-
-        # Normalize the dot products to get the cosine of the angle between templates
-        for i in range(nchild):
-            for j in range(i):
-                norm = A[i, i]*A[j, j]
-                if norm <= 0:
-                    A[i, j] = 0
-                else:
-                    A[i, j] /= np.sqrt(norm)
-
-        # Iterate over pairs of objects and find the maximum non-diagonal element of the matrix.
-        # Exit the loop once we find a single degenerate pair greater than the threshold.
-        rejectedIndex = -1
-        for i in range(nchild):
-            currentMax = 0.
-            for j in range(i):
-                if A[i, j] > currentMax:
-                    currentMax = A[i, j]
-                    if currentMax > maxTempDotProd:
-                        foundReject = True
-                        rejectedIndex = j
 
-            if foundReject:
-                break
-
-        del A
+        # The dot products between templates are computed once, in C++, and kept on the parent
+        # (until a template is replaced) so that each time a template is rejected and this is run
+        # again only the templates it affects are looked at again.
+        gram = dp.templateGram
+        if gram is None:
+            timgs = []
+            tfoots = []
+            for pkres in dp.peaks:
+                if pkres.skip:
+                    timgs.append(None)
+                    tfoots.append(None)
+                else:
+                    timgs.append(pkres.templateImage)
+                    tfoots.append(pkres.templateFootprint)
+            gram = TemplateGramF(timgs, tfoots)
+            dp.templateGram = gram
+        for pkres in dp.peaks:
+            if pkres.skip and gram.isActive(pkres.pki):
+                gram.remove(pkres.pki)
+
+        # Find the first template with a normalized dot product (the cosine of the angle between
+        # templates) greater than the threshold with an earlier template, and the earlier template
+        # it is most degenerate with.
+        degenerate = gram.findDegenerate(maxTempDotProd)
+        if degenerate is None:
+            continue
+        foundReject = True
+        i, j, currentMax = degenerate
 
         # If one of the objects is identified as a PSF keep the other one, otherwise keep the one
         # with the maximum template value
-        if foundReject:
-            keep = indexes[i]
-            reject = indexes[rejectedIndex]
-            exitLoop = False
-            if dp.peaks[keep].deblendedAsPsf and dp.peaks[reject].deblendedAsPsf is False:
-                keep = indexes[rejectedIndex]
-                reject = indexes[i]
-            elif dp.peaks[keep].deblendedAsPsf is False and dp.peaks[reject].deblendedAsPsf:
-                reject = indexes[rejectedIndex]
-                keep = indexes[i]
-            else:
-                if maxTemplate[rejectedIndex] > maxTemplate[i]:
-                        keep = indexes[rejectedIndex]
-                        reject = indexes[i]
-            log.trace('Removing object with index %d : %f.  Degenerate with %d' % (reject, currentMax,
-                                                                                   keep))
-            dp.peaks[reject].skip = True
-            dp.peaks[reject].degenerate = True
+        keep = i
+        reject = j
+        if dp.peaks[keep].deblendedAsPsf and dp.peaks[reject].deblendedAsPsf is False:
+            keep = j
+            reject = i
+        elif dp.peaks[keep].deblendedAsPsf is False and dp.peaks[reject].deblendedAsPsf:
+            reject = j
+            keep = i
+        else:
+            if (np.max(dp.peaks[j].templateImage.getArray()) >
+                    np.max(dp.peaks[i].templateImage.getArray())):
+                keep = j
+                reject = i
+        log.trace('Removing object with index %d : %f.  Degenerate with %d' % (reject, currentMax,
+                                                                               keep))
+        dp.peaks[reject].skip = True
+        dp.peaks[reject].degenerate = True
+        gram.remove(reject)
 
     return foundReject
 
 def apportionFlux(debResult, log, assignStrayFlux=True, strayFluxAssignment='r-to-peak',
                   strayFluxToPointSources='necessary', clipStrayFluxFraction=0.001,
-                  getTemplateSum=False):
+                  getTemplateSum=False, heavyPortions=False):
     """Apportion flux to all of the peak templates in each filter
 
     Divide the ``maskedImage`` flux amongst all of the templates based on the fraction of
@@ -1198,6 +1332,8 @@ def apportionFlux(debResult, log, assignStrayFlux=True, strayFluxAssignment='r-t
           minimum distance from the stray flux to footprint
         * ``nearest-footprint``: Stray flux is assigned to the footprint with lowest L-1 (Manhattan)
           distance to the stray flux
+        * ``nearest-footprint-euclidean``: As ``nearest-footprint``, but using the L-2 (Euclidean)
+          distance
     strayFluxToPointSources: `string`, optional
         Determines how stray flux is apportioned to point sources
         * ``never``: never apportion stray flux to point sources
@@ -1210,6 +1346,10 @@ def apportionFlux(debResult, log, assignStrayFlux=True, strayFluxAssignment='r-t
         As part of the flux calculation, the sum of the templates is calculated.
         If ``getTemplateSum==True`` then the sum of the templates is stored in the result
         (a `DeblendedFootprint`).
+    heavyPortions: `bool`, optional
+        If True, store the flux assigned to each peak as a `HeavyFootprint` over its template
+        footprint (see `DeblendedPeak.setFluxPortionHeavy`) rather than as a `MaskedImage`
+        covering the template bounding box, which saves memory for large templates.
 
     Returns
     -------
@@ -1219,7 +1359,8 @@ def apportionFlux(debResult, log, assignStrayFlux=True, strayFluxAssignment='r-t
         any deblender plugins will be re-run.
     """
     validStrayPtSrc = ['never', 'necessary', 'always']
-    validStrayAssign = ['r-to-peak', 'r-to-footprint', 'nearest-footprint', 'trim']
+    validStrayAssign = ['r-to-peak', 'r-to-footprint', 'nearest-footprint',
+                        'nearest-footprint-euclidean', 'trim']
     if strayFluxToPointSources not in validStrayPtSrc:
         raise ValueError((('strayFluxToPointSources: value \"%s\" not in the set of allowed values: ') %
                           strayFluxToPointSources) + str(validStrayPtSrc))
@@ -1279,8 +1420,15 @@ def apportionFlux(debResult, log, assignStrayFlux=True, strayFluxAssignment='r-t
                 strayopts |= butils.STRAYFLUX_R_TO_FOOTPRINT
             elif strayFluxAssignment == 'nearest-footprint':
                 strayopts |= butils.STRAYFLUX_NEAREST_FOOTPRINT
+            elif strayFluxAssignment == 'nearest-footprint-euclidean':
+                strayopts |= (butils.STRAYFLUX_NEAREST_FOOTPRINT |
+                              butils.STRAYFLUX_NEAREST_FOOTPRINT_EUCLIDEAN)
 
-        portions, strayflux = butils.apportionFlux(dp.maskedImage, dp.fp, tmimgs, tfoots, sumimg, dpsf,
+        if heavyPortions:
+            apportion = butils.apportionFluxToHeavy
+        else:
+            apportion = butils.apportionFlux
+        portions, strayflux = apportion(dp.maskedImage, dp.fp, tmimgs, tfoots, sumimg, dpsf,
                                         pkx, pky, strayopts, clipStrayFluxFraction)
 
         # Shrink parent to union of children
@@ -1299,7 +1447,10 @@ def apportionFlux(debResult, log, assignStrayFlux=True, strayFluxAssignment='r-t
         for j, (pk, pkres) in enumerate(zip(dp.fp.getPeaks(), dp.peaks)):
             if pkres.skip:
                 continue
-            pkres.setFluxPortion(portions[ii])
+            if heavyPortions:
+                pkres.setFluxPortionHeavy(portions[ii])
+            else:
+                pkres.setFluxPortion(portions[ii])
 
             if assignStrayFlux:
                 # NOTE that due to a swig bug (https://github.com/swig/swig/issues/59)
@@ -1317,7 +1468,7 @@ def apportionFlux(debResult, log, assignStrayFlux=True, strayFluxAssignment='r-t
                 continue
 
             for foot, add in [(pkres.templateFootprint, True), (pkres.origFootprint, True),
-                              (pkres.strayFlux, False)]:
+                              (pkres.fluxPortionHeavy, True), (pkres.strayFlux, False)]:
                 if foot is None:
                     continue
                 pks = foot.getPeaks()
@@ -1,6 +1,16 @@
 #include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <exception>
 #include <cmath>
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <numeric>
+#include <string>
 
 #include "lsst/log/Log.h"
 #include "lsst/meas/deblender/BaselineUtils.h"
@@ -33,579 +43,2568 @@ const int deblend::BaselineUtils<ImagePixelT, MaskPixelT, VariancePixelT>::STRAY
 template <typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
 const int deblend::BaselineUtils<ImagePixelT, MaskPixelT, VariancePixelT>::STRAYFLUX_TRIM;
 
-static bool span_compare(geom::Span const & sp1,
-                         geom::Span const & sp2) {
-    return (sp1 < sp2);
-}
+template <typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+const int deblend::BaselineUtils<ImagePixelT, MaskPixelT, VariancePixelT>::STRAYFLUX_NEAREST_FOOTPRINT_EUCLIDEAN;
 
 namespace {
-    void nearestFootprint(std::vector<PTR(det::Footprint)> const& foots,
-                          std::shared_ptr<image::Image<std::uint16_t>> argmin,
-                          std::shared_ptr<image::Image<std::uint16_t>> dist)
-    {
+    /*
+     * Smallest halfsize for which medianFilter uses the sliding engine
+     * (3x3 and 5x5 boxes go to the exchange networks when possible);
+     * below this, copying the (at most 9-pixel) window and running
+     * nth_element is cheaper than maintaining the rank counts.
+     */
+    int const MEDIAN_SLIDING_MIN_HALFSIZE = 2;
+
+    /*
+     * Median of the S x S window centred on column x of the rows
+     * "rows", by brute force: copy into "vals" (resized as needed) and
+     * nth_element.
+     */
+    template <typename PixelT>
+    PixelT windowMedian(PixelT const* const* rows, int halfsize, int x,
+                        std::vector<PixelT> & vals) {
+        int const S = 2*halfsize + 1;
+        vals.resize(S*S);
+        typename std::vector<PixelT>::iterator v = vals.begin();
+        for (int i = 0; i < S; ++i) {
+            v = std::copy(rows[i] + x - halfsize, rows[i] + x + halfsize + 1, v);
+        }
+        std::nth_element(vals.begin(), vals.begin() + vals.size()/2, vals.end());
+        return vals[vals.size()/2];
+    }
+
+    /*
+     * Min/max exchange networks that leave the median of 9 and 25 values
+     * in the middle element (Paeth's 3x3 network and Devillard's 5x5
+     * one; see N. Devillard, "Fast median search: an ANSI C
+     * implementation", 1998).  Each pair (i, j) puts min(p[i], p[j]) in
+     * p[i] and the max in p[j].
+     */
+    int const MEDIAN9_NETWORK[19][2] = {
+        {1, 2}, {4, 5}, {7, 8}, {0, 1}, {3, 4},
+        {6, 7}, {1, 2}, {4, 5}, {7, 8}, {0, 3},
+        {5, 8}, {4, 7}, {3, 6}, {1, 4}, {2, 5},
+        {4, 7}, {4, 2}, {6, 4}, {4, 2}
+    };
+
+    int const MEDIAN25_NETWORK[99][2] = {
+        {0, 1}, {3, 4}, {2, 4}, {2, 3}, {6, 7},
+        {5, 7}, {5, 6}, {9, 10}, {8, 10}, {8, 9},
+        {12, 13}, {11, 13}, {11, 12}, {15, 16}, {14, 16},
+        {14, 15}, {18, 19}, {17, 19}, {17, 18}, {21, 22},
+        {20, 22}, {20, 21}, {23, 24}, {2, 5}, {3, 6},
+        {0, 6}, {0, 3}, {4, 7}, {1, 7}, {1, 4},
+        {11, 14}, {8, 14}, {8, 11}, {12, 15}, {9, 15},
+        {9, 12}, {13, 16}, {10, 16}, {10, 13}, {20, 23},
+        {17, 23}, {17, 20}, {21, 24}, {18, 24}, {18, 21},
+        {19, 22}, {8, 17}, {9, 18}, {0, 18}, {0, 9},
+        {10, 19}, {1, 19}, {1, 10}, {11, 20}, {2, 20},
+        {2, 11}, {12, 21}, {3, 21}, {3, 12}, {13, 22},
+        {4, 22}, {4, 13}, {14, 23}, {5, 23}, {5, 14},
+        {15, 24}, {6, 24}, {6, 15}, {7, 16}, {7, 19},
+        {13, 21}, {15, 23}, {7, 13}, {7, 15}, {1, 9},
+        {3, 11}, {5, 17}, {11, 17}, {9, 17}, {4, 10},
+        {6, 12}, {7, 14}, {4, 6}, {4, 7}, {12, 14},
+        {10, 14}, {6, 7}, {10, 12}, {6, 10}, {6, 17},
+        {12, 17}, {7, 17}, {7, 10}, {12, 18}, {7, 12},
+        {10, 18}, {12, 20}, {10, 20}, {10, 12}
+    };
+
+    /*
+     * Number of adjacent output pixels pushed through a median network
+     * together: each exchange is applied to all of them in a fixed-length
+     * loop over plain arrays, which the compiler turns into packed
+     * min/max instructions.
+     */
+    int const MEDIAN_NETWORK_LANES = 8;
+
+    /*
+     * Median-filter output pixels [x0, x1) of a row using the exchange
+     * network "network" over the N = (2*halfsize+1)^2 window pixels;
+     * "rows" points to the 2*halfsize+1 input rows centred on the output
+     * row.  As for SlidingMedian, a zero median is recomputed by brute
+     * force if the image holds any -0, and NaNs are not allowed.
+     */
+    template <typename PixelT, int N, int M>
+    void medianNetworkRow(PixelT const* const* rows, int halfsize,
+                          int x0, int x1, PixelT* out,
+                          int const (&network)[M][2],
+                          bool hasNegativeZero) {
+        int const L = MEDIAN_NETWORK_LANES;
+        int const S = 2*halfsize + 1;
+        PixelT p[N][L];
+        std::vector<PixelT> vals(N);
+        for (int xb = x0; xb < x1; xb += L) {
+            int const nlane = std::min(L, x1 - xb);
+            for (int i = 0, k = 0; i < S; ++i) {
+                for (int j = -halfsize; j <= halfsize; ++j, ++k) {
+                    PixelT const* in = rows[i] + xb + j;
+                    for (int l = 0; l < nlane; ++l) {
+                        p[k][l] = in[l];
+                    }
+                    // pad a short final block with copies of its first pixel
+                    for (int l = nlane; l < L; ++l) {
+                        p[k][l] = in[0];
+                    }
+                }
+            }
+            for (int m = 0; m < M; ++m) {
+                PixelT* a = p[network[m][0]];
+                PixelT* b = p[network[m][1]];
+                for (int l = 0; l < L; ++l) {
+                    PixelT const lo = std::min(a[l], b[l]);
+                    PixelT const hi = std::max(a[l], b[l]);
+                    a[l] = lo;
+                    b[l] = hi;
+                }
+            }
+            for (int l = 0; l < nlane; ++l) {
+                PixelT med = p[N/2][l];
+                if (med == 0 && hasNegativeZero) {
+                    med = windowMedian(rows, halfsize, xb + l, vals);
+                }
+                out[xb + l] = med;
+            }
+        }
+    }
+
+    /*
+     * Sliding-window median over the pixels of one image.
+     *
+     * Every pixel is replaced by its rank in the sorted image, so the
+     * window becomes a set of distinct integers in [0, W*H) held as
+     * counts in a Fenwick tree.  Moving the window one pixel along a row
+     * swaps one column of S pixels for the next at O(log(W*H)) apiece,
+     * and the median is found by descending the tree, so each output
+     * pixel costs O(S log(W*H)) rather than the O(S^2) of copying the
+     * window.
+     *
+     * The median is the element of rank S*S/2 within the window, which
+     * is what nth_element selects, so results are the same as the brute
+     * force engine.  The one exception is the sign of a zero median when
+     * the image holds both -0 and +0 (they compare equal, so which one
+     * nth_element returns depends on its internal ordering); those
+     * pixels are recomputed by brute force if the caller says the image
+     * has any -0.  Images containing NaNs must not be passed in, as they
+     * cannot be ranked.
+     */
+    template <typename PixelT>
+    class SlidingMedian {
+    public:
+        SlidingMedian(std::vector<PixelT const*> const& allRows, int width,
+                      bool hasNegativeZero) :
+            _width(width),
+            _allRows(allRows),
+            _hasNegativeZero(hasNegativeZero)
+        {
+            int const height = allRows.size();
+            int const N = width*height;
+            _sorted.resize(N);
+            for (int i = 0; i < N; ++i) {
+                _sorted[i] = i;
+            }
+            std::sort(_sorted.begin(), _sorted.end(), PixelLess(allRows, width));
+            _rank.resize(N);
+            for (int r = 0; r < N; ++r) {
+                _rank[_sorted[r]] = r;
+            }
+            _counts.assign(N + 1, 0);
+            _top = 1;
+            while (2*_top <= N) {
+                _top *= 2;
+            }
+        }
+
         /*
-         * insert the footprints into an image, set all the pixels to the
-         * Manhattan distance from the nearest set pixel.
+         * Write the median of the window centred on (x, y) to out[x] for
+         * x in [x0, x1).  The window must lie inside the image.
          */
-        typedef std::uint16_t dtype;
-        typedef std::uint16_t itype;
+        void filterRow(int y, int halfsize, int x0, int x1, PixelT* out) {
+            if (x0 >= x1) {
+                return;
+            }
+            int const S = 2*halfsize + 1;
+            int const k = (S*S)/2;
+            for (int i = y - halfsize; i <= y + halfsize; ++i) {
+                for (int x = x0 - halfsize; x <= x0 + halfsize; ++x) {
+                    _add(_rank[i*_width + x], 1);
+                }
+            }
+            out[x0] = _median(y, halfsize, x0, k);
+            for (int x = x0 + 1; x < x1; ++x) {
+                for (int i = y - halfsize; i <= y + halfsize; ++i) {
+                    _add(_rank[i*_width + x - halfsize - 1], -1);
+                    _add(_rank[i*_width + x + halfsize], 1);
+                }
+                out[x] = _median(y, halfsize, x, k);
+            }
+            // empty the tree for the next row
+            for (int i = y - halfsize; i <= y + halfsize; ++i) {
+                for (int x = x1 - 1 - halfsize; x <= x1 - 1 + halfsize; ++x) {
+                    _add(_rank[i*_width + x], -1);
+                }
+            }
+        }
 
-        const itype nil = 0xffff;
+    private:
+        struct PixelLess {
+            PixelLess(std::vector<PixelT const*> const& rows, int width) :
+                rows(rows), width(width) {}
+            bool operator()(int a, int b) const {
+                return rows[a / width][a % width] < rows[b / width][b % width];
+            }
+            std::vector<PixelT const*> const& rows;
+            int width;
+        };
+
+        void _add(int rank, int delta) {
+            int const N = _rank.size();
+            for (int i = rank + 1; i <= N; i += i & -i) {
+                _counts[i] += delta;
+            }
+        }
+
+        // rank of the k'th (0-indexed) smallest element in the tree
+        int _select(int k) const {
+            int const N = _rank.size();
+            int pos = 0;
+            for (int step = _top; step > 0; step >>= 1) {
+                if (pos + step <= N && _counts[pos + step] <= k) {
+                    pos += step;
+                    k -= _counts[pos];
+                }
+            }
+            return pos;
+        }
 
-        *argmin = 0;
-        *dist = 0;
+        PixelT _median(int y, int halfsize, int x, int k) {
+            int const i = _sorted[_select(k)];
+            PixelT const m = _allRows[i / _width][i % _width];
+            if (m == 0 && _hasNegativeZero) {
+                return windowMedian(&_allRows[y - halfsize], halfsize, x, _vals);
+            }
+            return m;
+        }
 
+        int _width;
+        std::vector<PixelT const*> const& _allRows;
+        bool _hasNegativeZero;
+        std::vector<int> _sorted;
+        std::vector<int> _rank;
+        std::vector<int> _counts;
+        int _top;
+        std::vector<PixelT> _vals;
+    };
+
+    /*
+     * Picks and runs a median engine for the pixels of one image, given
+     * pointers to its rows: exchange networks for 3x3 and 5x5 boxes, a
+     * SlidingMedian (built on first use) for larger ones, and plain
+     * nth_element for images with NaNs.
+     */
+    template <typename PixelT>
+    class MedianEngine {
+    public:
+        MedianEngine(std::vector<PixelT const*> const& rows, int width, int halfsize) :
+            _rows(rows),
+            _width(width),
+            _halfsize(halfsize),
+            _hasNaN(false),
+            _hasNegativeZero(false),
+            _vals((2*halfsize + 1)*(2*halfsize + 1))
         {
-        int i = 0;
-        for (std::shared_ptr<det::Footprint> const & foot : foots) {
-            foot->getSpans()->setImage(*argmin, static_cast<itype>(i));
-            foot->getSpans()->setImage(*dist, static_cast<dtype>(1));
-            ++i;
-        }
-        }
-
-        int const height = dist->getHeight();
-        int const width  = dist->getWidth();
-
-        // traverse from bottom left to top right
-        for (int y = 0; y != height; ++y) {
-            image::Image<dtype>::xy_locator dim = dist->xy_at(0, y);
-            image::Image<itype>::xy_locator aim = argmin->xy_at(0, y);
-            for (int x = 0; x != width; ++x, ++dim.x(), ++aim.x()) {
-                if (dim(0, 0) == 1) {
-                    // first pass and pixel was on, it gets a zero
-                    dim(0, 0) = 0;
-                    // its argmin is already set
-                } else {
-                    // pixel was off. It is at most the sum of lengths of
-                    // the array away from a pixel that is on
-                    dim(0, 0) = width + height;
-                    aim(0, 0) = nil;
-                    // or one more than the pixel to the north
-                    if (y > 0) {
-                        dtype ndist = dim(0,-1) + 1;
-                        if (ndist < dim(0,0)) {
-                            dim(0,0) = ndist;
-                            aim(0,0) = aim(0,-1);
-                        }
-                    }
-                    // or one more than the pixel to the west
-                    if (x > 0) {
-                        dtype ndist = dim(-1,0) + 1;
-                        if (ndist < dim(0,0)) {
-                            dim(0,0) = ndist;
-                            aim(0,0) = aim(-1,0);
-                        }
+            // The fast engines need to order the pixels, which NaNs don't
+            // allow.  They also need to know about -0; see SlidingMedian.
+            for (std::size_t y = 0; y < rows.size(); ++y) {
+                for (int x = 0; x < width; ++x) {
+                    PixelT const v = rows[y][x];
+                    if (std::isnan(v)) {
+                        _hasNaN = true;
+                    } else if (v == 0 && std::signbit(v)) {
+                        _hasNegativeZero = true;
                     }
                 }
             }
         }
-        // traverse from top right to bottom left
-        for (int y = height - 1; y >= 0; --y) {
-            image::Image<dtype>::xy_locator dim = dist->xy_at(width-1, y);
-            image::Image<itype>::xy_locator aim = argmin->xy_at(width-1, y);
-            for (int x = width - 1; x >= 0; --x, --dim.x(), --aim.x()) {
-                // either what we had on the first pass or one more than
-                // the pixel to the south
-                if (y + 1 < height) {
-                    dtype ndist = dim(0,1) + 1;
-                    if (ndist < dim(0,0)) {
-                        dim(0,0) = ndist;
-                        aim(0,0) = aim(0,1);
-                    }
+
+        /*
+         * Write the median of the full window centred on (x, y) to out[x]
+         * for x in [x0, x1); all of those windows must lie inside the
+         * image.
+         */
+        void filterRow(int y, int x0, int x1, PixelT* out) {
+            int const h = _halfsize;
+            PixelT const* const* rows = &_rows[y - h];
+            if (!_hasNaN && h == 1) {
+                medianNetworkRow<PixelT, 9>(rows, h, x0, x1, out, MEDIAN9_NETWORK,
+                                            _hasNegativeZero);
+            } else if (!_hasNaN && h == 2) {
+                medianNetworkRow<PixelT, 25>(rows, h, x0, x1, out, MEDIAN25_NETWORK,
+                                             _hasNegativeZero);
+            } else if (!_hasNaN && h >= MEDIAN_SLIDING_MIN_HALFSIZE) {
+                if (!_sliding) {
+                    _sliding.reset(new SlidingMedian<PixelT>(_rows, _width, _hasNegativeZero));
                 }
-                // or one more than the pixel to the east
-                if (x + 1 < width) {
-                    dtype ndist = dim(1,0) + 1;
-                    if (ndist < dim(0,0)) {
-                        dim(0,0) = ndist;
-                        aim(0,0) = aim(1,0);
-                    }
+                _sliding->filterRow(y, h, x0, x1, out);
+            } else {
+                for (int x = x0; x < x1; ++x) {
+                    out[x] = windowMedian(rows, h, x, _vals);
                 }
             }
         }
-    }
-} // end anonymous namespace
 
-/**
- Run a spatial median filter over the given input *img*, writing the
- results to *out*.  *halfsize* is half the box size of the filter; ie,
- a halfsize of 50 means that each output ixel will be the median of
- the pixels in a 101 x 101-pixel box in the input image.
+        /*
+         * Median of the window centred on (x, y) after clipping it to the
+         * image: the element of rank n/2 of its n pixels.
+         */
+        PixelT truncatedMedian(int y, int x) {
+            int const h = _halfsize;
+            int const ylo = std::max(y - h, 0);
+            int const yhi = std::min(y + h + 1, static_cast<int>(_rows.size()));
+            int const xlo = std::max(x - h, 0);
+            int const xhi = std::min(x + h + 1, _width);
+            _vals.clear();
+            for (int i = ylo; i < yhi; ++i) {
+                _vals.insert(_vals.end(), _rows[i] + xlo, _rows[i] + xhi);
+            }
+            std::nth_element(_vals.begin(), _vals.begin() + _vals.size()/2, _vals.end());
+            return _vals[_vals.size()/2];
+        }
 
- Margins are handled horribly: the median is computed only for pixels
- more than *halfsize* away from the edges; pixels near the edges are
- simply copied from the input *img* to *out*.
+    private:
+        std::vector<PixelT const*> const& _rows;
+        int _width;
+        int _halfsize;
+        bool _hasNaN;
+        bool _hasNegativeZero;
+        std::vector<PixelT> _vals;
+        std::unique_ptr<SlidingMedian<PixelT> > _sliding;
+    };
+
+    /*
+     * makeMonotonic works out from the peak in chunks of SHADOW_CHUNK
+     * rings; each pixel shadows a cone of half-width SHADOW_SLOPE (in
+     * slope) extending SHADOW_CHUNK pixels outward.
+     */
+    int const SHADOW_CHUNK = 5;
+    double const SHADOW_SLOPE = 0.3;
+
+    /*
+     * Rings up to this half-length have their ShadowRing cached.  A ring
+     * of half-length L has 8*L pixels, each with two ints and
+     * 2*SHADOW_CHUNK int8 bounds, so costs about 144*L bytes; the full
+     * cache is about 4.7 MB.
+     */
+    int const SHADOW_CACHE_MAX_RING = 256;
+
+    /*
+     * The shadows cast by the square ring of pixels at L_inf distance L
+     * from the peak, in the order makeMonotonic visits them.  Ring pixel
+     * i is at (x[i], y[i]) relative to the peak.  If vertical[i], it lies
+     * on a vertical edge of the ring and shadows, for k = 1..SHADOW_CHUNK,
+     * column x + sign(x)*k over rows y + sign(x)*[lo, hi]; otherwise it
+     * shadows row y + sign(y)*k over columns x + sign(y)*[lo, hi], with
+     * [lo, hi] = [lo[i*SHADOW_CHUNK + k-1], hi[i*SHADOW_CHUNK + k-1]].
+     */
+    struct ShadowRing {
+        explicit ShadowRing(int L);
+
+        std::vector<int> x;
+        std::vector<int> y;
+        std::vector<bool> vertical;
+        std::vector<std::int8_t> lo;
+        std::vector<std::int8_t> hi;
+    };
+
+    ShadowRing::ShadowRing(int L) {
+        int const S = SHADOW_CHUNK;
+        double const A = SHADOW_SLOPE;
+        int const n = 8*L;
+        x.resize(n);
+        y.resize(n);
+        vertical.resize(n);
+        lo.resize(n*S);
+        hi.resize(n*S);
+        /*
+         We visit pixels in a box of "radius" L, in this order:
 
- Mask and variance planes are, likewise, simply copied from *img* to
- *out*.
- */
-template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
-void
-deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
-medianFilter(ImageT const& img,
-             ImageT & out,
-             int halfsize) {
-    int S = halfsize*2 + 1;
-    int SS = S*S;
-    typedef typename ImageT::xy_locator xy_loc;
-    xy_loc pix = img.xy_at(halfsize,halfsize);
-    std::vector<typename xy_loc::cached_location_t> locs;
-    for (int i=0; i<S; ++i) {
-        for (int j=0; j<S; ++j) {
-            locs.push_back(pix.cache_location(j-halfsize, i-halfsize));
-        }
-    }
-    int W = img.getWidth();
-    int H = img.getHeight();
-    ImagePixelT vals[S*S];
-    for (int y=halfsize; y<H-halfsize; ++y) {
-        xy_loc inpix = img.xy_at(halfsize, y), end = img.xy_at(W-halfsize, y);
-        for (typename ImageT::x_iterator optr = out.row_begin(y) + halfsize;
-             inpix != end; ++inpix.x(), ++optr) {
-            for (int i=0; i<SS; ++i)
-                vals[i] = inpix[locs[i]];
-            std::nth_element(vals, vals+SS/2, vals+SS);
-            *optr = vals[SS/2];
-        }
-    }
-
-    // grumble grumble margins
-    for (int y=0; y<2*halfsize; ++y) {
-        int iy = y;
-        if (y >= halfsize)
-            iy = H - 1 - (y-halfsize);
-        typename ImageT::x_iterator optr = out.row_begin(iy);
-        typename ImageT::x_iterator iptr = img.row_begin(iy), end=img.row_end(iy);
-        for (; iptr != end; ++iptr,++optr)
-            *optr = *iptr;
-    }
-    for (int y=halfsize; y<H-halfsize; ++y) {
-        typename ImageT::x_iterator optr = out.row_begin(y);
-        typename ImageT::x_iterator iptr = img.row_begin(y), end=img.row_begin(y)+halfsize;
-        for (; iptr != end; ++iptr,++optr)
-            *optr = *iptr;
-        iptr = img.row_begin(y) + ((W-1) - halfsize);
-        end  = img.row_begin(y) + (W-1);
-        optr = out.row_begin(y) + ((W-1) - halfsize);
-        for (; iptr != end; ++iptr,++optr)
-            *optr = *iptr;
-    }
+         L=1:
 
-}
+         4 3 2
+         5   1
+         6 7 0
 
-/**
- Given an image *mimg* and Peak location *peak*, overwrite *mimg* so
- that pixels further from the peak have values smaller than those
- close to the peak; make the profile monotonic-decreasing.
+         L=2:
 
- The exact algorithm is a little more complicated than that.  The
- basic idea is of "casting a shadow" from a pixel to pixels farther
- from the peak in the same direction.  Done naively, this results in
- very narrow "shadows" and ragged profiles.  A tweak is to make the
- shadows "fatter" -- make a pixel shadow a wedge of pixels -- but if
- one does this naively, the wedge gets wider and wider too quickly.
- The algorithm works out from the peak in square "rings" of pixels, so
- if a pixel shadows a wedge 30 degrees wide, in the next ring of
- pixels the shadowed pixel at largest angle from the shadowing pixel
- will shade a yet-larger wedge, expanding the shadowing angle.  To
- reduce this effect, we work in chunks of 5 pixels in radius, only
- copying the intermediate pixels to the "shadowing" image at the end
- of each chunk.
+         8  7  6  5  4
+         9           3
+         10          2
+         11          1
+         12 13 14 15 0
 
- Currently the mask and variance planes of the input are totally
- ignored.
+         Note that the number of pixel visited is 8*L, and that we
+         change "dx" or "dy" each "2*L" steps.
+         */
+        int px = L, py = -L;
+        int dx = 0, dy = 0;
+        for (int i = 0; i < n; i++, px += dx, py += dy) {
+            if (i % (2*L) == 0) {
+                int leg = (i/(2*L));
+                // dx = [ 0, -1,  0, 1 ][leg]
+                dx = ( leg    % 2) * (-1 + 2*(leg/2));
+                // dy = [ 1,  0, -1, 0 ][leg]
+                dy = ((leg+1) % 2) * ( 1 - 2*(leg/2));
+            }
+            x[i] = px;
+            y[i] = py;
+            vertical[i] = (dx == 0);
+            // Range of slopes (or inverse slopes) shadowed, [ds0,ds1];
+            // on a vertical edge x is +- L, so no div-by-zero.
+            double ds0 = (dx == 0 ? double(py) / double(px) : double(px) / double(py)) - A;
+            double ds1 = ds0 + 2.0 * A;
+            for (int k = 1; k <= S; k++) {
+                lo[i*S + k-1] = static_cast<std::int8_t>(lround(k * ds0));
+                hi[i*S + k-1] = static_cast<std::int8_t>(lround(k * ds1));
+            }
+        }
+    }
 
- For illustration, run tests/monotonic.py and look at im*.png
- */
-template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
-void
-deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
-makeMonotonic(
-    ImageT & img,
-    det::PeakRecord const& peak) {
+    /*
+     * The ShadowRing of half-length L, shared between calls (and
+     * threads) for L <= SHADOW_CACHE_MAX_RING.
+     */
+    std::shared_ptr<ShadowRing const> getShadowRing(int L) {
+        if (L > SHADOW_CACHE_MAX_RING) {
+            return std::make_shared<ShadowRing const>(L);
+        }
+        static std::mutex mutex;
+        static std::vector<std::shared_ptr<ShadowRing const> > cache(SHADOW_CACHE_MAX_RING + 1);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!cache[L]) {
+            cache[L] = std::make_shared<ShadowRing const>(L);
+        }
+        return cache[L];
+    }
 
-    int cx = peak.getIx();
-    int cy = peak.getIy();
-    int ix0 = img.getX0();
-    int iy0 = img.getY0();
-    int iW = img.getWidth();
-    int iH = img.getHeight();
-
-    ImagePtrT shadowingImg = ImagePtrT(new ImageT(img, true));
-
-    int DW = std::max(cx - img.getX0(), img.getX0() + img.getWidth() - cx);
-    int DH = std::max(cy - img.getY0(), img.getY0() + img.getHeight() - cy);
-
-    const int S = 5;
-
-    // Work out from the peak in chunks of "S" pixels.
-    int s;
-    for (s = 0; s < std::max(DW,DH); s += S) {
-        int p;
-        for (p=0; p<S; p++) {
-            // visit pixels with L_inf distance = s + p from the
-            // center (ie, the s+p'th square ring of pixels)
-            // L is the half-length of the ring (box).
-            int L = s+p;
-            int x = L, y = -L;
-            int dx = 0, dy = 0; // initialized here to satisfy the
-                                // compiler; initialized for real
-                                // below (first time through loop)
-            /*
-            int i;
-            int leg;
-            for (i=0; i<(8*L); i++, x += dx, y += dy) {
-                if (i % (2*L) == 0) {
-                    leg = (i/(2*L));
-                    dx = ( leg    % 2) * (-1 + 2*(leg/2));
-                    dy = ((leg+1) % 2) * ( 1 - 2*(leg/2));
-                }
-             */
-
-            /*
-             We visit pixels in a box of "radius" L, in this order:
-
-             L=1:
-
-             4 3 2
-             5   1
-             6 7 0
-
-             L=2:
-
-             8  7  6  5  4
-             9           3
-             10          2
-             11          1
-             12 13 14 15 0
-
-             Note that the number of pixel visited is 8*L, and that we
-             change "dx" or "dy" each "2*L" steps.
-             */
-            for (int i=0; i<(8*L); i++, x += dx, y += dy) {
-                // time to change directions?  (Note that this runs
-                // the first time through the loop, initializing dx,dy
-                // appropriately.)
-                if (i % (2*L) == 0) {
-                    int leg = (i/(2*L));
-                    // dx = [ 0, -1,  0, 1 ][leg]
-                    dx = ( leg    % 2) * (-1 + 2*(leg/2));
-                    // dy = [ 1,  0, -1, 0 ][leg]
-                    dy = ((leg+1) % 2) * ( 1 - 2*(leg/2));
-                }
-                //printf("  i=%i, leg=%i, dx=%i, dy=%i, x=%i, y=%i\n", i, leg, dx, dy, x, y);
-                int px = cx + x - ix0;
-                int py = cy + y - iy0;
-                // If the shadowing pixel is out of bounds, nothing to do.
-                if (px < 0 || px >= iW || py < 0 || py >= iH)
-                    continue;
-                // The pixel casting the shadow
-                ImagePixelT pix = (*shadowingImg)(px,py);
-
-                // Cast this pixel's shadow S pixels long in a cone.
-                // We compute the range of slopes (or inverse-slopes)
-                // shadowed by the pixel, [ds0,ds1]
-                double ds0, ds1;
-                // Range of slopes shadowed
-                const double A = 0.3;
-                int shx, shy;
-                int psx, psy;
-                // Are we traversing a vertical edge of the box?
-                if (dx == 0) {
-                    // (if so, then "x" is +- L, so no div-by-zero)
-                    ds0 = (double(y) / double(x)) - A;
-                    ds1 = ds0 + 2.0 * A;
-                    // cast the shadow on column x + sign(x)*shx
-                    for (shx=1; shx<=S; shx++) {
-                        int xsign = (x>0?1:-1);
-                        // the column being shadowed
-                        psx = cx + x + (xsign*shx) - ix0;
-                        if (psx < 0 || psx >= iW)
-                            continue;
-                        // shadow covers a range of y values based on slope
-                        for (shy  = lround(shx * ds0);
-                             shy <= lround(shx * ds1); shy++) {
-                            psy = cy + y + xsign*shy - iy0;
-                            if (psy < 0 || psy >= iH)
+    /*
+     * Copy the rings of pixels at L_inf distance [L0, L1] from (cx, cy)
+     * from "rows" to "dest", clipped to the W x H image.
+     */
+    template <typename PixelT>
+    void copyRings(std::vector<PixelT*> const& rows, std::vector<PixelT*> const& dest,
+                   int W, int H, int cx, int cy, int L0, int L1) {
+        int const xlo = std::max(cx - L1, 0);
+        int const xhi = std::min(cx + L1, W - 1);
+        for (int y = std::max(cy - L1, 0); y <= std::min(cy + L1, H - 1); ++y) {
+            if (std::abs(y - cy) >= L0) {
+                if (xlo <= xhi) {
+                    std::copy(rows[y] + xlo, rows[y] + xhi + 1, dest[y] + xlo);
+                }
+            } else {
+                int const xin0 = std::min(cx - L0, xhi);
+                int const xin1 = std::max(cx + L0, xlo);
+                if (xlo <= xin0) {
+                    std::copy(rows[y] + xlo, rows[y] + xin0 + 1, dest[y] + xlo);
+                }
+                if (xin1 <= xhi) {
+                    std::copy(rows[y] + xin1, rows[y] + xhi + 1, dest[y] + xin1);
+                }
+            }
+        }
+    }
+
+    /*
+     * The body of makeMonotonic, working on the rows of a W x H image
+     * with the peak at (cx, cy) relative to its origin.  "shadowing"
+     * holds the rows of a scratch image of the same size; only the rings
+     * read by the current chunk are kept up to date there.
+     */
+    template <typename PixelT>
+    void castShadows(std::vector<PixelT*> const& rows, std::vector<PixelT*> const& shadowing,
+                     int W, int H, int cx, int cy) {
+        int const S = SHADOW_CHUNK;
+        int const DW = std::max(cx, W - cx);
+        int const DH = std::max(cy, H - cy);
+
+        copyRings(rows, shadowing, W, H, cx, cy, 0, S - 1);
+        // Work out from the peak in chunks of "S" pixels.
+        for (int s = 0; s < std::max(DW,DH); s += S) {
+            for (int p = 0; p < S; p++) {
+                int const L = s + p;
+                std::shared_ptr<ShadowRing const> ring = getShadowRing(L);
+                for (int i = 0; i < 8*L; i++) {
+                    int const x = ring->x[i];
+                    int const y = ring->y[i];
+                    int const px = cx + x;
+                    int const py = cy + y;
+                    // If the shadowing pixel is out of bounds, nothing to do.
+                    if (px < 0 || px >= W || py < 0 || py >= H)
+                        continue;
+                    // The pixel casting the shadow
+                    PixelT const pix = shadowing[py][px];
+                    std::int8_t const* lo = &ring->lo[i*S];
+                    std::int8_t const* hi = &ring->hi[i*S];
+                    if (ring->vertical[i]) {
+                        // cast the shadow on column x + sign(x)*k
+                        int const xsign = (x > 0 ? 1 : -1);
+                        for (int k = 0; k < S; k++) {
+                            int const psx = px + xsign*(k + 1);
+                            if (psx < 0 || psx >= W)
                                 continue;
-                            img(psx, psy) = std::min(img(psx, psy), pix);
+                            int psy0 = py + (xsign > 0 ? lo[k] : -hi[k]);
+                            int psy1 = py + (xsign > 0 ? hi[k] : -lo[k]);
+                            psy0 = std::max(psy0, 0);
+                            psy1 = std::min(psy1, H - 1);
+                            for (int psy = psy0; psy <= psy1; psy++) {
+                                rows[psy][psx] = std::min(rows[psy][psx], pix);
+                            }
                         }
-                    }
-
-                } else {
-                    // We're traversing a horizontal edge of the box; y = +-L
-                    ds0 = (double(x) / double(y)) - A;
-                    ds1 = ds0 + 2.0 * A;
-                    // Cast shadow on row y + sign(y)*shy
-                    for (shy=1; shy<=S; shy++) {
-                        int ysign = (y>0?1:-1);
-                        psy = cy + y + (ysign*shy) - iy0;
-                        if (psy < 0 || psy >= iH)
-                            continue;
-                        // shadow covers a range of x vals based on slope
-                        for (shx  = lround(shy * ds0);
-                             shx <= lround(shy * ds1); shx++) {
-                            psx = cx + x + ysign*shx - ix0;
-                            if (psx < 0 || psx >= iW)
+                    } else {
+                        // cast the shadow on row y + sign(y)*k
+                        int const ysign = (y > 0 ? 1 : -1);
+                        for (int k = 0; k < S; k++) {
+                            int const psy = py + ysign*(k + 1);
+                            if (psy < 0 || psy >= H)
                                 continue;
-                            img(psx, psy) = std::min(img(psx, psy), pix);
+                            int psx0 = px + (ysign > 0 ? lo[k] : -hi[k]);
+                            int psx1 = px + (ysign > 0 ? hi[k] : -lo[k]);
+                            psx0 = std::max(psx0, 0);
+                            psx1 = std::min(psx1, W - 1);
+                            PixelT* row = rows[psy];
+                            for (int psx = psx0; psx <= psx1; psx++) {
+                                row[psx] = std::min(row[psx], pix);
+                            }
                         }
                     }
                 }
             }
+            // The next chunk casts shadows from the rings [s+S, s+2S-1],
+            // which are now as the old code's full copy would have left them.
+            copyRings(rows, shadowing, W, H, cx, cy, s + S, s + 2*S - 1);
         }
-        shadowingImg->assign(img);
     }
-}
 
-static double _get_contrib_r_to_footprint(int x, int y,
-                                          PTR(det::Footprint) tfoot) {
-    double minr2 = 1e12;
-    for (geom::Span const & sp : *(tfoot->getSpans())) {
-        int mindx;
-        // span is to right of pixel?
-        int dx = sp.getX0() - x;
-        if (dx >= 0) {
-            mindx = dx;
-        } else {
-            // span is to left of pixel?
-            dx = x - sp.getX1();
-            if (dx >= 0) {
-                mindx = dx;
-            } else {
-                // span contains pixel (in x direction)
-                mindx = 0;
-            }
+    /*
+     * tsum[x] += max(0, t[x]) for x in [0, n).
+     */
+    template <typename PixelT>
+    void addClippedRow(PixelT const* t, PixelT* tsum, int n) {
+        for (int x = 0; x < n; ++x) {
+            tsum[x] += std::max(PixelT(0), t[x]);
         }
-        int dy = sp.getY() - y;
-        minr2 = std::min(minr2, (double)(mindx*mindx + dy*dy));
     }
-    //printf("stray flux at (%i,%i): dist to t %i is %g\n", x, y, (int)i, sqrt(minr2));
-    return 1. / (1. + minr2);
-}
-
-
-template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
-void
-deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
-_find_stray_flux(det::Footprint const& foot,
-                 ImagePtrT tsum,
-                 MaskedImageT const& img,
-                 int strayFluxOptions,
-                 std::vector<PTR(det::Footprint)> tfoots,
-                 std::vector<bool> const& ispsf,
-                 std::vector<int>  const& pkx,
-                 std::vector<int>  const& pky,
-                 double clipStrayFluxFraction,
-                 std::vector<std::shared_ptr<typename det::HeavyFootprint<ImagePixelT,MaskPixelT,VariancePixelT> > > & strays
-                 ) {
-
-    typedef typename det::HeavyFootprint<ImagePixelT, MaskPixelT, VariancePixelT> HeavyFootprint;
-    typedef typename std::shared_ptr< HeavyFootprint > HeavyFootprintPtrT;
 
-    // when doing stray flux: the footprints and pixels, which we'll
-    // combine into the return 'strays' HeavyFootprint at the end.
-    std::vector<PTR(det::Footprint) > strayfoot;
-    std::vector<std::vector<geom::Span>> straySpans(tfoots.size());
-    std::vector<std::vector<ImagePixelT> > straypix;
-    std::vector<std::vector<MaskPixelT> > straymask;
-    std::vector<std::vector<VariancePixelT> > strayvar;
-
-    int ix0 = img.getX0();
-    int iy0 = img.getY0();
-    geom::Box2I sumbb = tsum->getBBox();
-    int sumx0 = sumbb.getMinX();
-    int sumy0 = sumbb.getMinY();
+    /*
+     * One row of apportionFlux: out = img * max(0, t) / tsum, using the
+     * precomputed rtsum = 1/tsum, and zero where tsum is zero.  Written
+     * without branches so that it vectorizes.  Where tsum is subnormal
+     * its reciprocal would overflow, so rtsum is zero there and, if the
+     * row has any ("hasTiny"), those pixels are divided directly.
+     */
+    template <typename PixelT>
+    void apportionRow(PixelT const* img, PixelT const* t, PixelT const* tsum,
+                      PixelT const* rtsum, PixelT* out, int n, bool hasTiny) {
+        for (int x = 0; x < n; ++x) {
+            PixelT const frac = std::max(PixelT(0), t[x]) * rtsum[x];
+            out[x] = (tsum[x] == 0 ? PixelT(0) : img[x] * frac);
+        }
+        if (hasTiny) {
+            for (int x = 0; x < n; ++x) {
+                if ((tsum[x] != 0) && (tsum[x] < std::numeric_limits<PixelT>::min())) {
+                    out[x] = img[x] * (std::max(PixelT(0), t[x]) / tsum[x]);
+                }
+            }
+        }
+    }
 
-    for (size_t i=0; i<tfoots.size(); ++i) {
-        strayfoot.push_back(PTR(det::Footprint)());
-        straypix.push_back(std::vector<ImagePixelT>());
-        straymask.push_back(std::vector<MaskPixelT>());
-        strayvar.push_back(std::vector<VariancePixelT>());
+    /*
+     * Copy a row of "in" to "out", except where tsum is zero.
+     */
+    template <typename PixelT, typename SumPixelT>
+    void copyRowWhereSummed(PixelT const* in, SumPixelT const* tsum, PixelT* out,
+                            int n, bool hasZero) {
+        std::copy(in, in + n, out);
+        if (hasZero) {
+            for (int x = 0; x < n; ++x) {
+                out[x] = (tsum[x] == 0 ? PixelT(0) : out[x]);
+            }
+        }
     }
 
-    bool always = (strayFluxOptions & STRAYFLUX_TO_POINT_SOURCES_ALWAYS);
+    /*
+     * Argument checks shared by apportionFlux and apportionFluxToHeavy.
+     */
+    template <typename MaskedImageT, typename ImagePtrT>
+    void checkApportionArgs(MaskedImageT const& img,
+                            det::Footprint const& foot,
+                            std::vector<ImagePtrT> const& timgs,
+                            std::vector<PTR(det::Footprint)> const& tfoots) {
+        if (timgs.size() != tfoots.size()) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                (boost::format("Template images must be the same length as template footprints (%d vs %d)")
+                    % timgs.size() % tfoots.size()).str());
+        }
 
-    typedef std::uint16_t itype;
-    PTR(image::Image<itype>) nearest;
+        for (size_t i=0; i<timgs.size(); ++i) {
+            if (!timgs[i]->getBBox().contains(tfoots[i]->getBBox())) {
+                throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+                                  "Template image MUST contain template footprint");
+            }
+            if (!img.getBBox().contains(foot.getBBox())) {
+                throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+                                  "Image bbox MUST contain parent footprint");
+            }
+            // template bounding-boxes *can* extend outside the parent
+            // footprint if we are ramping templates with significant flux
+            // at the edges.  We handle this below.
+        }
+    }
 
-    if (strayFluxOptions & STRAYFLUX_NEAREST_FOOTPRINT) {
-        // Compute the map of which footprint is closest to each
-        // pixel in the bbox.
-        typedef std::uint16_t dtype;
-        PTR(image::Image<dtype>) dist(new image::Image<dtype>(sumbb));
-        nearest = PTR(image::Image<itype>)(new image::Image<itype>(sumbb));
+    void checkStrayFluxArgs(size_t ntemplates,
+                            std::vector<bool> const& ispsf,
+                            std::vector<int> const& pkx,
+                            std::vector<int> const& pky) {
+        if ((ispsf.size() > 0) && (ispsf.size() != ntemplates)) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                (boost::format("'ispsf' must be the same length as templates (%d vs %d)")
+                     % ispsf.size() % ntemplates).str());
+        }
+        if ((pkx.size() != ntemplates) || (pky.size() != ntemplates)) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                (boost::format("'pkx' and 'pky' must be the same length as templates (%d,%d vs %d)")
+                    % pkx.size() % pky.size() % ntemplates).str());
+        }
+    }
 
-        std::vector<PTR(det::Footprint)> templist;
-        std::vector<PTR(det::Footprint)>* footlist = &tfoots;
+    /*
+     * Set "rtsum" to the reciprocal of the template sum "tsum" (which is
+     * never negative), so that the portions need only multiplies;
+     * "rowHasZero" to which rows of tsum contain zeros; and "rowHasTiny"
+     * to which contain subnormal values, whose reciprocals would overflow
+     * to infinity.  rtsum is zero at both.
+     */
+    template <typename PixelT>
+    void reciprocalSum(image::Image<PixelT> const& tsum,
+                       image::Image<PixelT> & rtsum,
+                       std::vector<bool> & rowHasZero,
+                       std::vector<bool> & rowHasTiny) {
+        int const W = tsum.getWidth();
+        int const H = tsum.getHeight();
+        PixelT const tiny = std::numeric_limits<PixelT>::min();
+        rowHasZero.assign(H, false);
+        rowHasTiny.assign(H, false);
+        for (int y = 0; y < H; ++y) {
+            PixelT const* sptr = tsum.getArray()[y].getData();
+            PixelT* rptr = rtsum.getArray()[y].getData();
+            int nzero = 0;
+            int ntiny = 0;
+            for (int x = 0; x < W; ++x) {
+                nzero += (sptr[x] == 0);
+                ntiny += ((sptr[x] != 0) & (sptr[x] < tiny));
+                rptr[x] = (sptr[x] < tiny ? PixelT(0) : PixelT(1) / sptr[x]);
+            }
+            rowHasZero[y] = (nzero > 0);
+            rowHasTiny[y] = (ntiny > 0);
+        }
+    }
 
-        if (!always && ispsf.size()) {
-            // create a temp list that has empty footprints in place
-            // of all the point sources.
-            auto empty = std::make_shared<det::Footprint>();
-            empty->setPeakSchema(foot.getPeaks().getSchema());
-            for (size_t i=0; i<tfoots.size(); ++i) {
-                if (ispsf[i]) {
-                    templist.push_back(empty);
-                } else {
-                    templist.push_back(tfoots[i]);
+    /*
+     * Lower envelope of the parabolas (x - q)^2 + dy[q]^2 over the
+     * columns q of a row with dy[q] >= 0, the row pass of the distance
+     * transform of Felzenszwalb & Huttenlocher (Theory of Computing 8,
+     * 415, 2012).  Parabola v[j] is lowest for z[j] < x <= z[j+1], with
+     * the z held as exact fractions num/den.
+     */
+    class ParabolaEnvelope {
+    public:
+        /*
+         * Build the envelope of the W values "dy"; returns false if none
+         * of them is >= 0.
+         */
+        bool build(int const* dy, int W) {
+            _v.resize(W);
+            _znum.resize(W + 1);
+            _zden.resize(W + 1);
+            _nv = 0;
+            _j = 0;
+            for (int q = 0; q < W; ++q) {
+                if (dy[q] < 0) {
+                    continue;
                 }
+                std::int64_t const fq = std::int64_t(dy[q])*dy[q] + std::int64_t(q)*q;
+                std::int64_t num = 0, den = 1;
+                while (_nv > 0) {
+                    int const p = _v[_nv - 1];
+                    std::int64_t const fp = std::int64_t(dy[p])*dy[p] + std::int64_t(p)*p;
+                    // intersection of the parabolas from p and q
+                    num = fq - fp;
+                    den = 2*std::int64_t(q - p);
+                    // does it come before parabola p starts to be lowest?
+                    if (_nv > 1 && num*_zden[_nv - 1] <= _znum[_nv - 1]*den) {
+                        --_nv;
+                    } else {
+                        break;
+                    }
+                }
+                _v[_nv] = q;
+                _znum[_nv] = num;
+                _zden[_nv] = den;
+                ++_nv;
             }
-            footlist = &templist;
+            return _nv > 0;
         }
-        nearestFootprint(*footlist, nearest, dist);
-    }
 
-    // Go through the (parent) Footprint looking for stray flux:
-    // pixels that are not claimed by any template, and positive.
-    for (geom::Span const & s : *foot.getSpans()) {
-        int y = s.getY();
-        int x0 = s.getX0();
-        int x1 = s.getX1();
-        typename ImageT::x_iterator tsum_it =
-            tsum->row_begin(y - sumy0) + (x0 - sumx0);
-        typename MaskedImageT::x_iterator in_it =
-            img.row_begin(y - iy0) + (x0 - ix0);
-        double contrib[tfoots.size()];
-
-        for (int x = x0; x <= x1; ++x, ++tsum_it, ++in_it) {
-            // Skip pixels that are covered by at least one
-            // template (*tsum_it > 0) or the input is not
-            // positive (*in_it <= 0).
-            if ((*tsum_it > 0) || (*in_it).image() <= 0) {
-                continue;
+        /*
+         * The column whose parabola is lowest at x; successive calls
+         * after a build must not decrease x.
+         */
+        int lowest(std::int64_t x) {
+            while (_j + 1 < _nv && _znum[_j + 1] < x*_zden[_j + 1]) {
+                ++_j;
             }
+            return _v[_j];
+        }
 
-            if (strayFluxOptions & STRAYFLUX_R_TO_FOOTPRINT) {
-                // we'll compute these just-in-time
-                for (size_t i=0; i<tfoots.size(); ++i) {
-                    contrib[i] = -1.0;
-                }
-            } else if (strayFluxOptions & STRAYFLUX_NEAREST_FOOTPRINT) {
-                for (size_t i=0; i<tfoots.size(); ++i) {
-                    contrib[i] = 0.0;
+    private:
+        int _nv;
+        int _j;
+        std::vector<int> _v;
+        std::vector<std::int64_t> _znum;
+        std::vector<std::int64_t> _zden;
+    };
+
+    /*
+     * Column pass of the distance transform: replace each negative
+     * entry of the W x H array "dy" by the distance in y to the nearest
+     * zero in its column, leaving -1 if the column has none.  If "label"
+     * is not NULL, copy the label of that zero along with it (the one
+     * above wins ties).
+     */
+    void columnDistance(int* dy, int* label, int W, int H,
+                        std::vector<int> & last) {
+        last.assign(W, -1);
+        for (int y = 0; y < H; ++y) {
+            int* row = dy + static_cast<std::size_t>(y)*W;
+            int* lrow = label ? label + static_cast<std::size_t>(y)*W : NULL;
+            for (int x = 0; x < W; ++x) {
+                if (row[x] == 0) {
+                    last[x] = y;
+                } else if (last[x] >= 0) {
+                    row[x] = y - last[x];
+                    if (lrow) {
+                        lrow[x] = lrow[x - W*(y - last[x])];
+                    }
                 }
-                int i = nearest->get0(x, y);
-                contrib[i] = 1.0;
-            } else {
-                // R_TO_PEAK
-                for (size_t i=0; i<tfoots.size(); ++i) {
-                    // Split the stray flux by 1/(1+r^2) to peaks
-                    int dx, dy;
-                    dx = pkx[i] - x;
-                    dy = pky[i] - y;
-                    contrib[i] = 1. / (1. + dx*dx + dy*dy);
+            }
+        }
+        last.assign(W, -1);
+        for (int y = H - 1; y >= 0; --y) {
+            int* row = dy + static_cast<std::size_t>(y)*W;
+            int* lrow = label ? label + static_cast<std::size_t>(y)*W : NULL;
+            for (int x = 0; x < W; ++x) {
+                if (row[x] == 0) {
+                    last[x] = y;
+                } else if (last[x] >= 0 && (row[x] < 0 || last[x] - y < row[x])) {
+                    row[x] = last[x] - y;
+                    if (lrow) {
+                        lrow[x] = lrow[x + W*(last[x] - y)];
+                    }
                 }
             }
+        }
+    }
 
-            // Round 1: skip point sources unless STRAYFLUX_TO_POINT_SOURCES_ALWAYS
-            // are we going to assign stray flux to ptsrcs?
-            bool ptsrcs = always;
-            double csum = 0.;
-            for (size_t i=0; i<tfoots.size(); ++i) {
-                // if we're skipping point sources and this is a point source...
-                if ((!ptsrcs) && ispsf.size() && ispsf[i]) {
-                    continue;
-                }
-                if (contrib[i] == -1.0) {
-                    contrib[i] = _get_contrib_r_to_footprint(x, y, tfoots[i]);
+    /*
+     * Squared Euclidean distance from pixels to the nearest pixel of a
+     * Footprint -- min over its spans of (distance in x to the span)^2 +
+     * dy^2 -- computed with the linear-time distance transform of
+     * Felzenszwalb & Huttenlocher: a pass down the columns of the
+     * Footprint's neighbourhood finds the distance in y to the nearest
+     * pixel in each column, then a lower envelope of parabolas along
+     * each row finds the full distance.  Everything is done in
+     * integers, so the results are exact.
+     *
+     * The scratch buffers are kept between calls so that one
+     * FootprintDistance can be used for a series of Footprints.
+     */
+    class FootprintDistance {
+    public:
+        /*
+         * Set r2[k*stride] to the squared distance from (xs[k], ys[k]) to
+         * "foot", or to "empty" if the footprint has no pixels.  The
+         * pixels must lie inside "bbox" and be sorted by y, then x.
+         */
+        void compute(det::Footprint const& foot, geom::Box2I const& bbox,
+                     std::vector<int> const& xs, std::vector<int> const& ys,
+                     double empty, double* r2, int stride) {
+            std::size_t const n = xs.size();
+            if (foot.getArea() == 0) {
+                for (std::size_t k = 0; k < n; ++k) {
+                    r2[k*stride] = empty;
                 }
-                csum += contrib[i];
+                return;
             }
-            if ((csum == 0.) &&
-                (strayFluxOptions &
-                 STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY)) {
-                // No extended sources -- assign to pt sources
-                //LOGL_DEBUG(_log, "necessary to assign stray flux to point sources");
-                ptsrcs = true;
-                for (size_t i=0; i<tfoots.size(); ++i) {
-                    if (contrib[i] == -1.0) {
-                        contrib[i] = _get_contrib_r_to_footprint(x, y, tfoots[i]);
-                    }
-                    csum += contrib[i];
+            // The nearest footprint pixel can lie outside "bbox".
+            geom::Box2I dbox(bbox);
+            dbox.include(foot.getBBox());
+            int const x0 = dbox.getMinX();
+            int const y0 = dbox.getMinY();
+            int const W = dbox.getWidth();
+            int const H = dbox.getHeight();
+
+            // Column pass: distance in y to the nearest footprint pixel in
+            // the same column, or -1 for none.
+            _dy.assign(static_cast<std::size_t>(W)*H, -1);
+            for (geom::Span const & sp : *foot.getSpans()) {
+                std::fill(_dy.begin() + (sp.getY() - y0)*W + (sp.getX0() - x0),
+                          _dy.begin() + (sp.getY() - y0)*W + (sp.getX1() - x0) + 1, 0);
+            }
+            columnDistance(&_dy[0], NULL, W, H, _last);
+
+            // Row pass, only on the rows holding the requested pixels.
+            std::size_t k = 0;
+            while (k < n) {
+                int const y = ys[k];
+                int const* row = &_dy[static_cast<std::size_t>(y - y0)*W];
+                _envelope.build(row, W);
+                for (; k < n && ys[k] == y; ++k) {
+                    std::int64_t const x = xs[k] - x0;
+                    int const q = _envelope.lowest(x);
+                    std::int64_t const dx = x - q;
+                    std::int64_t const dy = row[q];
+                    r2[k*stride] = static_cast<double>(dx*dx + dy*dy);
                 }
             }
+        }
 
-            // Drop small contributions...
-            double strayclip = (clipStrayFluxFraction * csum);
-            csum = 0.;
-            for (size_t i=0; i<tfoots.size(); ++i) {
-                // skip ptsrcs?
-                if ((!ptsrcs) && ispsf.size() && ispsf[i]) {
-                    contrib[i] = 0.;
-                    continue;
-                }
-                // skip small contributions
-                if (contrib[i] < strayclip) {
-                    contrib[i] = 0.;
+    private:
+        std::vector<int> _dy;
+        std::vector<int> _last;
+        ParabolaEnvelope _envelope;
+    };
+
+    int const NO_FOOTPRINT = -1;
+
+    /*
+     * Set nearest[k] to the index of the Footprint in "foots" nearest to
+     * (xs[k], ys[k]), or NO_FOOTPRINT if they are all empty.  A pixel in
+     * several Footprints belongs to the last one; Footprint pixels
+     * outside "bbox" are ignored.  The query pixels must lie inside
+     * "bbox" and be sorted by y.
+     *
+     * With the Manhattan metric this is the classic two-pass chamfer
+     * transform, ties included: the forward pass takes the pixel to the
+     * north, then the west, the backward pass the south, then the east,
+     * each only if strictly closer.  Each pass does the vertical step
+     * for a whole row before sweeping along it, which gives the same
+     * result, and the backward pass stops at the first query row.  With
+     * the Euclidean metric it is FootprintDistance's transform carrying
+     * labels along, with the row pass done only on the query rows.
+     */
+    void nearestFootprint(std::vector<PTR(det::Footprint)> const& foots,
+                          geom::Box2I const& bbox,
+                          std::vector<int> const& xs, std::vector<int> const& ys,
+                          bool euclidean, std::vector<int> & nearest) {
+        std::size_t const n = xs.size();
+        nearest.assign(n, NO_FOOTPRINT);
+        if (n == 0) {
+            return;
+        }
+        int const x0 = bbox.getMinX();
+        int const y0 = bbox.getMinY();
+        int const W = bbox.getWidth();
+        int const H = bbox.getHeight();
+        std::size_t const N = static_cast<std::size_t>(W)*H;
+
+        // Footprint pixels get distance zero and their own label.
+        int const far = euclidean ? -1 : W + H;
+        std::vector<int> dist(N, far);
+        std::vector<int> label(N, NO_FOOTPRINT);
+        for (std::size_t i = 0; i < foots.size(); ++i) {
+            for (geom::Span const & sp : *foots[i]->getSpans()) {
+                int const y = sp.getY() - y0;
+                int const sx0 = std::max(sp.getX0() - x0, 0);
+                int const sx1 = std::min(sp.getX1() - x0, W - 1);
+                if (y < 0 || y >= H || sx0 > sx1) {
                     continue;
                 }
-                csum += contrib[i];
+                std::size_t const off = static_cast<std::size_t>(y)*W;
+                std::fill(dist.begin() + off + sx0, dist.begin() + off + sx1 + 1, 0);
+                std::fill(label.begin() + off + sx0, label.begin() + off + sx1 + 1,
+                          static_cast<int>(i));
             }
+        }
 
-            for (size_t i=0; i<tfoots.size(); ++i) {
-                if (contrib[i] == 0.) {
+        if (euclidean) {
+            std::vector<int> last;
+            columnDistance(&dist[0], &label[0], W, H, last);
+            ParabolaEnvelope envelope;
+            std::size_t k = 0;
+            while (k < n) {
+                int const y = ys[k];
+                std::size_t const off = static_cast<std::size_t>(y - y0)*W;
+                if (!envelope.build(&dist[off], W)) {
+                    for (; k < n && ys[k] == y; ++k) {}
                     continue;
                 }
-                // the stray flux to give to template i
-                double p = (contrib[i] / csum) * (*in_it).image();
-
-                if (!strayfoot[i]) {
-                    strayfoot[i] = std::make_shared<det::Footprint>();
-                    strayfoot[i]->setPeakSchema(foot.getPeaks().getSchema());
+                for (; k < n && ys[k] == y; ++k) {
+                    nearest[k] = label[off + envelope.lowest(xs[k] - x0)];
                 }
-                straySpans[i].push_back(geom::Span(y, x, x));
-                straypix[i].push_back(p);
-                straymask[i].push_back((*in_it).mask());
-                strayvar[i].push_back((*in_it).variance());
             }
+            return;
         }
-    }
 
-    // Store the stray flux in HeavyFootprints
-    for (size_t i=0; i<tfoots.size(); ++i) {
-        if (strayfoot[i]) {
-            strayfoot[i]->setSpans(std::make_shared<geom::SpanSet>(straySpans[i]));
+        // Forward pass, from the bottom left
+        for (int y = 0; y < H; ++y) {
+            int* d = &dist[static_cast<std::size_t>(y)*W];
+            int* l = &label[static_cast<std::size_t>(y)*W];
+            if (y > 0) {
+                int const* dn = d - W;
+                int const* ln = l - W;
+                for (int x = 0; x < W; ++x) {
+                    if (dn[x] + 1 < d[x]) {
+                        d[x] = dn[x] + 1;
+                        l[x] = ln[x];
+                    }
+                }
+            }
+            for (int x = 1; x < W; ++x) {
+                if (d[x - 1] + 1 < d[x]) {
+                    d[x] = d[x - 1] + 1;
+                    l[x] = l[x - 1];
+                }
+            }
         }
-        if (!strayfoot[i]) {
-            strays.push_back(HeavyFootprintPtrT());
-        } else {
-            /// Hmm, this is a little bit dangerous: we're assuming that
-            /// the HeavyFootprint stores its pixels in the same order that
-            /// we iterate over them above (ie, lexicographic).
-            HeavyFootprintPtrT heavy(new HeavyFootprint(*strayfoot[i]));
-            ndarray::Array<ImagePixelT,1,1> himg = heavy->getImageArray();
-            typename std::vector<ImagePixelT>::const_iterator spix;
-            typename std::vector<MaskPixelT>::const_iterator smask;
-            typename std::vector<VariancePixelT>::const_iterator svar;
-            typename ndarray::Array<ImagePixelT,1,1>::Iterator hpix;
-            typename ndarray::Array<MaskPixelT,1,1>::Iterator mpix;
-            typename ndarray::Array<VariancePixelT,1,1>::Iterator vpix;
-
-            assert((size_t)strayfoot[i]->getArea() == straypix[i].size());
-
-            for (spix = straypix[i].begin(),
-                     smask = straymask[i].begin(),
-                     svar  = strayvar [i].begin(),
-                     hpix = himg.begin(),
-                     mpix = heavy->getMaskArray().begin(),
-                     vpix = heavy->getVarianceArray().begin();
-                 spix != straypix[i].end();
-                 ++spix, ++smask, ++svar, ++hpix, ++mpix, ++vpix) {
-                *hpix = *spix;
-                *mpix = *smask;
-                *vpix = *svar;
-            }
-            strays.push_back(heavy);
+        // Backward pass, from the top right down to the lowest query row
+        int const ymin = ys.front() - y0;
+        for (int y = H - 1; y >= ymin; --y) {
+            int* d = &dist[static_cast<std::size_t>(y)*W];
+            int* l = &label[static_cast<std::size_t>(y)*W];
+            if (y + 1 < H) {
+                int const* ds = d + W;
+                int const* ls = l + W;
+                for (int x = 0; x < W; ++x) {
+                    if (ds[x] + 1 < d[x]) {
+                        d[x] = ds[x] + 1;
+                        l[x] = ls[x];
+                    }
+                }
+            }
+            for (int x = W - 2; x >= 0; --x) {
+                if (d[x + 1] + 1 < d[x]) {
+                    d[x] = d[x + 1] + 1;
+                    l[x] = l[x + 1];
+                }
+            }
+        }
+        for (std::size_t k = 0; k < n; ++k) {
+            nearest[k] = label[static_cast<std::size_t>(ys[k] - y0)*W + (xs[k] - x0)];
         }
     }
-}
 
-template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
-void
-deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
-_sum_templates(std::vector<ImagePtrT> timgs,
+    /*
+     * Fewest peaks for which _find_stray_flux uses a PeakGrid to split
+     * stray flux by distance to the peaks; for fewer, it is quicker to
+     * look at them all.
+     */
+    std::size_t const PEAK_GRID_MIN_PEAKS = 64;
+
+    /*
+     * A uniform grid of cells holding the peaks, about one per cell, for
+     * the STRAYFLUX_R_TO_PEAK rule.  Each peak gets weight w = 1/(1+r^2)
+     * at a stray pixel, and weights below clip * sum(w) are dropped.  We
+     * visit square rings of cells outwards from the pixel, summing the
+     * weights, until the sum so far is large enough that no peak further
+     * out can survive.  The number of peaks in each ring beyond, and its
+     * distance, bound the rest of the sum, which usually settles whether
+     * each peak seen survives; if not, we sum all the weights in the
+     * same order as the brute-force loop does.  Either way the survivors
+     * and their weights are exactly the brute-force ones.
+     */
+    class PeakGrid {
+    public:
+        PeakGrid(std::vector<int> const& pkx, std::vector<int> const& pky,
+                 std::vector<int> const& peaks) :
+            _pkx(pkx), _pky(pky), _all(peaks), _npeaks(peaks.size()), _calls(0), _work(0)
+        {
+            int x0 = pkx[peaks[0]], x1 = x0, y0 = pky[peaks[0]], y1 = y0;
+            for (int i : peaks) {
+                x0 = std::min(x0, pkx[i]);
+                x1 = std::max(x1, pkx[i]);
+                y0 = std::min(y0, pky[i]);
+                y1 = std::max(y1, pky[i]);
+            }
+            double area = double(x1 - x0 + 1)*(y1 - y0 + 1);
+            _cell = std::max(1, static_cast<int>(std::ceil(std::sqrt(area/_npeaks))));
+            _x0 = x0;
+            _y0 = y0;
+            _nx = (x1 - x0)/_cell + 1;
+            _ny = (y1 - y0)/_cell + 1;
+            // Peaks sorted by cell, in increasing index order within each.
+            _start.assign(_nx*_ny + 1, 0);
+            for (int i : peaks) {
+                ++_start[_cellOf(i) + 1];
+            }
+            // Cumulative counts, for counting the peaks in a ring of cells.
+            _count.assign((_nx + 1)*(_ny + 1), 0);
+            for (int cy = 0; cy < _ny; ++cy) {
+                for (int cx = 0; cx < _nx; ++cx) {
+                    _count[(cy + 1)*(_nx + 1) + cx + 1] = _start[cy*_nx + cx + 1] +
+                        _count[cy*(_nx + 1) + cx + 1] + _count[(cy + 1)*(_nx + 1) + cx] -
+                        _count[cy*(_nx + 1) + cx];
+                }
+            }
+            for (int c = 0; c < _nx*_ny; ++c) {
+                _start[c + 1] += _start[c];
+            }
+            _peaks.resize(_npeaks);
+            std::vector<int> next(_start.begin(), _start.end() - 1);
+            for (int i : peaks) {
+                _peaks[next[_cellOf(i)]++] = i;
+            }
+        }
+
+        /*
+         * Whether the grid is saving work: when the peaks are crowded
+         * compared with the clipping radius, most of them have to be
+         * looked at anyway and the brute-force loop is quicker.
+         */
+        bool worthwhile() const {
+            return (_calls < 64) || (8*_work < 7*_calls*_npeaks);
+        }
+
+        /*
+         * Put the indices, in increasing order, and weights of the peaks
+         * that survive clipping at (x, y) in "index" and "weight".
+         * Returns false if the caller must look at every peak instead.
+         */
+        bool clippedWeights(int x, int y, double clip,
+                            std::vector<int> & index, std::vector<double> & weight) {
+            ++_calls;
+            int const pcx = _cellCoord(x, _x0);
+            int const pcy = _cellCoord(y, _y0);
+            int const kmax = std::max(std::max(pcx, _nx - 1 - pcx), std::max(pcy, _ny - 1 - pcy));
+
+            // _far[k]: bound on the sum of the weights in rings k and up;
+            // ring k is at least (k - 1)*cell away.
+            _far.assign(kmax + 2, 0.);
+            for (int k = kmax; k >= 0; --k) {
+                int const n = _countWithin(pcx, pcy, k) - (k > 0 ? _countWithin(pcx, pcy, k - 1) : 0);
+                double const d = std::max(k - 1, 0)*double(_cell);
+                _far[k] = _far[k + 1] + n/(1. + d*d);
+            }
+
+            double const tol = 4.*_npeaks*std::numeric_limits<double>::epsilon();
+            double lo = 0.;
+            _near.clear();
+            _w.clear();
+            int k = 0;
+            for (; k <= kmax; ++k) {
+                std::size_t const first = _near.size();
+                _ring(pcx, pcy, k, _near);
+                for (std::size_t j = first; j < _near.size(); ++j) {
+                    int const dx = _pkx[_near[j]] - x;
+                    int const dy = _pky[_near[j]] - y;
+                    _w.push_back(1. / (1. + dx*dx + dy*dy));
+                    lo += _w.back();
+                }
+                // Could a peak further out survive?
+                double const d = double(k)*_cell;
+                if (1. / (1. + d*d) < clip*lo*(1. - tol)) {
+                    break;
+                }
+            }
+            // visiting the cells costs about as much again as the weights
+            _work += 2*_near.size();
+            if (k > kmax) {
+                _work += _npeaks;
+                return false;
+            }
+            // The sum is between lo and hi, so the brute-force threshold
+            // clip*sum lies between drop and keep.
+            double const hi = lo + _far[k + 1];
+            double const drop = clip*lo*(1. - tol);
+            double const keep = clip*hi*(1. + tol);
+            _kept.clear();
+            for (std::size_t j = 0; j < _near.size(); ++j) {
+                if (_w[j] >= keep) {
+                    _kept.push_back(std::make_pair(_near[j], _w[j]));
+                } else if (_w[j] >= drop) {
+                    // Too close to call: sum all the weights, as the
+                    // brute-force loop does, and clip exactly.
+                    _work += _npeaks;
+                    double sum = 0.;
+                    for (int i : _all) {
+                        int const dx = _pkx[i] - x;
+                        int const dy = _pky[i] - y;
+                        sum += 1. / (1. + dx*dx + dy*dy);
+                    }
+                    double const clipped = clip*sum;
+                    _kept.clear();
+                    for (std::size_t jj = 0; jj < _near.size(); ++jj) {
+                        if (_w[jj] >= clipped) {
+                            _kept.push_back(std::make_pair(_near[jj], _w[jj]));
+                        }
+                    }
+                    break;
+                }
+            }
+            std::sort(_kept.begin(), _kept.end());
+            index.clear();
+            weight.clear();
+            for (std::pair<int, double> const & p : _kept) {
+                index.push_back(p.first);
+                weight.push_back(p.second);
+            }
+            return true;
+        }
+
+    private:
+        int _cellOf(int i) const {
+            return ((_pky[i] - _y0)/_cell)*_nx + (_pkx[i] - _x0)/_cell;
+        }
+
+        // cell coordinate of pixel coordinate v along an axis starting at v0
+        int _cellCoord(int v, int v0) const {
+            return (v >= v0) ? (v - v0)/_cell : -((v0 - v + _cell - 1)/_cell);
+        }
+
+        // Number of peaks in the cells within k of cell (cx, cy).
+        int _countWithin(int cx, int cy, int k) const {
+            int const cx0 = std::max(cx - k, 0), cx1 = std::min(cx + k + 1, _nx);
+            int const cy0 = std::max(cy - k, 0), cy1 = std::min(cy + k + 1, _ny);
+            if (cx0 >= cx1 || cy0 >= cy1) {
+                return 0;
+            }
+            return _count[cy1*(_nx + 1) + cx1] - _count[cy0*(_nx + 1) + cx1] -
+                _count[cy1*(_nx + 1) + cx0] + _count[cy0*(_nx + 1) + cx0];
+        }
+
+        // Append the peaks in cells [cx0, cx1] x [cy0, cy1].
+        void _cells(int cx0, int cy0, int cx1, int cy1, std::vector<int> & out) const {
+            cx0 = std::max(cx0, 0);
+            cx1 = std::min(cx1, _nx - 1);
+            cy0 = std::max(cy0, 0);
+            cy1 = std::min(cy1, _ny - 1);
+            for (int cy = cy0; cy <= cy1; ++cy) {
+                for (int cx = cx0; cx <= cx1; ++cx) {
+                    int const c = cy*_nx + cx;
+                    out.insert(out.end(), _peaks.begin() + _start[c], _peaks.begin() + _start[c + 1]);
+                }
+            }
+        }
+
+        // Append the peaks in the ring of cells at distance k from (cx, cy).
+        void _ring(int cx, int cy, int k, std::vector<int> & out) const {
+            _cells(cx - k, cy - k, cx + k, cy - k, out);
+            if (k > 0) {
+                _cells(cx - k, cy + k, cx + k, cy + k, out);
+                _cells(cx - k, cy - k + 1, cx - k, cy + k - 1, out);
+                _cells(cx + k, cy - k + 1, cx + k, cy + k - 1, out);
+            }
+        }
+
+        std::vector<int> const& _pkx;
+        std::vector<int> const& _pky;
+        std::vector<int> _all;
+        std::size_t _npeaks;
+        std::size_t _calls;
+        std::size_t _work;
+        int _cell;
+        int _x0, _y0, _nx, _ny;
+        std::vector<int> _start;
+        std::vector<int> _count;
+        std::vector<int> _peaks;
+        std::vector<int> _near;
+        std::vector<double> _w;
+        std::vector<double> _far;
+        std::vector<std::pair<int, double> > _kept;
+    };
+
+    /*
+     * The stray flux given to one template, collected pixel by pixel in
+     * raster order.  Adjacent pixels are merged into spans as they
+     * arrive, and their values are packed in the same order, which is
+     * the order a HeavyFootprint on those spans keeps its pixels in.
+     */
+    template <typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+    class StrayPixels {
+    public:
+        typedef det::HeavyFootprint<ImagePixelT, MaskPixelT, VariancePixelT> HeavyFootprintT;
+
+        bool empty() const {
+            return _image.empty();
+        }
+
+        void add(int y, int x, ImagePixelT image, MaskPixelT mask, VariancePixelT variance) {
+            if (!_spans.empty() && _spans.back().getY() == y && _spans.back().getX1() + 1 == x) {
+                _spans.back() = geom::Span(y, _spans.back().getX0(), x);
+            } else {
+                _spans.push_back(geom::Span(y, x, x));
+            }
+            _image.push_back(image);
+            _mask.push_back(mask);
+            _variance.push_back(variance);
+        }
+
+        PTR(HeavyFootprintT) makeHeavy(lsst::afw::table::Schema const& peakSchema) const {
+            // The spans are already sorted and merged.
+            auto foot = std::make_shared<det::Footprint>();
+            foot->setPeakSchema(peakSchema);
+            foot->setSpans(std::make_shared<geom::SpanSet>(_spans, false));
+            auto heavy = std::make_shared<HeavyFootprintT>(*foot);
+            std::copy(_image.begin(), _image.end(), heavy->getImageArray().getData());
+            std::copy(_mask.begin(), _mask.end(), heavy->getMaskArray().getData());
+            std::copy(_variance.begin(), _variance.end(), heavy->getVarianceArray().getData());
+            return heavy;
+        }
+
+    private:
+        std::vector<geom::Span> _spans;
+        std::vector<ImagePixelT> _image;
+        std::vector<MaskPixelT> _mask;
+        std::vector<VariancePixelT> _variance;
+    };
+
+    /*
+     * The STRAYFLUX_* options, decoded once per call of _find_stray_flux
+     * into template parameters for splitStrayFlux: how the flux of each
+     * stray pixel is split among the templates, and whether point
+     * sources get any of it.
+     */
+    enum StrayFluxRule {
+        STRAY_R_TO_PEAK,
+        STRAY_R_TO_FOOTPRINT,
+        STRAY_NEAREST_FOOTPRINT
+    };
+
+    enum StrayFluxPtsrcs {
+        STRAY_PTSRCS_NEVER,
+        STRAY_PTSRCS_WHEN_NECESSARY,
+        STRAY_PTSRCS_ALWAYS
+    };
+
+    /*
+     * What the rules need to weight the templates at the k'th stray
+     * pixel; only the members its rule uses need be set.
+     */
+    struct StrayFluxWeights {
+        std::vector<char> ispsf;               // per template
+        std::vector<int> const* pkx;           // R_TO_PEAK
+        std::vector<int> const* pky;
+        PeakGrid* peakGrid;                    // R_TO_PEAK, optional
+        std::vector<double> const* r2;         // R_TO_FOOTPRINT: [k*ntemplates + i]
+        std::vector<int> const* nearest;       // NEAREST_FOOTPRINT: [k]
+        double clip;
+    };
+
+    /*
+     * Split the flux of the "stray" pixels (see findStrayPixels) among
+     * the templates; the k'th stray pixel is the k'th pixel of "stray".  Each
+     * template i gets weight w_i; point sources drop out unless Ptsrcs
+     * is ALWAYS, or WHEN_NECESSARY and no extended source has any
+     * weight; weights below clip * sum(w) are dropped, and the rest
+     * share the pixel's flux.
+     *
+     * This runs serially, unlike the template stages (parallelFor).
+     * Each template's share is appended to its StrayPixels in raster
+     * order, so chunks of "stray" run in parallel would each need their
+     * own StrayPixels for every template, merged afterwards, and their
+     * own copy of the PeakGrid, whose scratch vectors and call counts
+     * change on every lookup.  And apportionFlux is given no thread
+     * count: it is called once per parent, and there is seldom enough
+     * stray flux in one parent to pay for starting the threads.
+     */
+    template <StrayFluxRule Rule, StrayFluxPtsrcs Ptsrcs,
+              typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+    void splitStrayFlux(geom::SpanSet const& stray,
+                        image::MaskedImage<ImagePixelT, MaskPixelT, VariancePixelT> const& img,
+                        StrayFluxWeights const& weights,
+                        std::vector<StrayPixels<ImagePixelT, MaskPixelT, VariancePixelT> > & straypix) {
+        std::size_t const n = straypix.size();
+        char const* ispsf = weights.ispsf.data();
+        std::vector<double> contrib(n);
+        std::vector<int> gridpeaks;
+        std::vector<double> gridweights;
+        int const ix0 = img.getX0();
+        int const iy0 = img.getY0();
+        std::size_t nstray = 0;
+
+        for (geom::Span const & s : stray) {
+            int const y = s.getY();
+            int const x0 = s.getX0();
+            ImagePixelT const* imrow = img.getImage()->getArray()[y - iy0].getData() + (x0 - ix0);
+            MaskPixelT const* maskrow = img.getMask()->getArray()[y - iy0].getData() + (x0 - ix0);
+            VariancePixelT const* varrow = img.getVariance()->getArray()[y - iy0].getData() + (x0 - ix0);
+
+            for (int j = 0; j < s.getWidth(); ++j) {
+                ImagePixelT const pix = imrow[j];
+                int const x = x0 + j;
+                std::size_t const k = nstray++;
+
+                if (Rule == STRAY_R_TO_PEAK) {
+                    if (weights.peakGrid && weights.peakGrid->worthwhile() &&
+                        weights.peakGrid->clippedWeights(x, y, weights.clip, gridpeaks, gridweights)) {
+                        double csum = 0.;
+                        for (double w : gridweights) {
+                            csum += w;
+                        }
+                        for (std::size_t g = 0; g < gridpeaks.size(); ++g) {
+                            double p = (gridweights[g] / csum) * pix;
+                            straypix[gridpeaks[g]].add(y, x, p, maskrow[j], varrow[j]);
+                        }
+                        continue;
+                    }
+                    // Split the stray flux by 1/(1+r^2) to peaks
+                    int const* pkx = weights.pkx->data();
+                    int const* pky = weights.pky->data();
+                    for (std::size_t i = 0; i < n; ++i) {
+                        int const dx = pkx[i] - x;
+                        int const dy = pky[i] - y;
+                        contrib[i] = 1. / (1. + dx*dx + dy*dy);
+                    }
+                } else if (Rule == STRAY_R_TO_FOOTPRINT) {
+                    double const* r2 = weights.r2->data() + k*n;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        contrib[i] = 1. / (1. + r2[i]);
+                    }
+                } else {
+                    std::fill(contrib.begin(), contrib.end(), 0.);
+                    int const i = (*weights.nearest)[k];
+                    if (i != NO_FOOTPRINT) {
+                        contrib[i] = 1.;
+                    }
+                }
+
+                // Round 1: skip point sources unless ALWAYS.  (Adding
+                // zero leaves the sums exactly as if we had skipped them.)
+                bool ptsrcs = (Ptsrcs == STRAY_PTSRCS_ALWAYS);
+                double csum = 0.;
+                if (ptsrcs) {
+                    for (std::size_t i = 0; i < n; ++i) {
+                        csum += contrib[i];
+                    }
+                } else {
+                    for (std::size_t i = 0; i < n; ++i) {
+                        csum += ispsf[i] ? 0. : contrib[i];
+                    }
+                }
+                if ((Ptsrcs == STRAY_PTSRCS_WHEN_NECESSARY) && (csum == 0.)) {
+                    // No extended sources -- assign to pt sources
+                    ptsrcs = true;
+                    for (std::size_t i = 0; i < n; ++i) {
+                        csum += contrib[i];
+                    }
+                }
+
+                // Drop small contributions...
+                double const strayclip = weights.clip * csum;
+                csum = 0.;
+                for (std::size_t i = 0; i < n; ++i) {
+                    bool const keep = (ptsrcs || !ispsf[i]) && !(contrib[i] < strayclip);
+                    contrib[i] = keep ? contrib[i] : 0.;
+                    csum += contrib[i];
+                }
+
+                for (std::size_t i = 0; i < n; ++i) {
+                    if (contrib[i] == 0.) {
+                        continue;
+                    }
+                    // the stray flux to give to template i
+                    double p = (contrib[i] / csum) * pix;
+                    straypix[i].add(y, x, p, maskrow[j], varrow[j]);
+                }
+            }
+        }
+    }
+
+    /*
+     * Call the splitStrayFlux instantiation for "ptsrcs".
+     */
+    template <StrayFluxRule Rule, typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+    void dispatchStrayFlux(StrayFluxPtsrcs ptsrcs,
+                           geom::SpanSet const& stray,
+                           image::MaskedImage<ImagePixelT, MaskPixelT, VariancePixelT> const& img,
+                           StrayFluxWeights const& weights,
+                           std::vector<StrayPixels<ImagePixelT, MaskPixelT, VariancePixelT> > & straypix) {
+        if (ptsrcs == STRAY_PTSRCS_ALWAYS) {
+            splitStrayFlux<Rule, STRAY_PTSRCS_ALWAYS>(stray, img, weights, straypix);
+        } else if (ptsrcs == STRAY_PTSRCS_WHEN_NECESSARY) {
+            splitStrayFlux<Rule, STRAY_PTSRCS_WHEN_NECESSARY>(stray, img, weights, straypix);
+        } else {
+            splitStrayFlux<Rule, STRAY_PTSRCS_NEVER>(stray, img, weights, straypix);
+        }
+    }
+
+    /*
+     * One row pair of a symmetric template.  "fwd" points to n input
+     * pixels and "back" to their mirror images, which run the other way:
+     * pixel fwd[j] pairs with back[n-1-j].  Both output rows get the
+     * pairwise min (clamped at zero if "minZero"), "bout" mirrored like
+     * "back"; they are the same row for the span through the peak.  The
+     * mirrored segment is reversed into "buf" first so the min is a
+     * straight elementwise loop that the compiler vectorizes.
+     */
+    template <typename PixelT>
+    void symmetricMinRow(PixelT const* fwd, PixelT const* back, int n, bool minZero,
+                         PixelT* fout, PixelT* bout, PixelT* buf) {
+        std::reverse_copy(back, back + n, buf);
+        if (minZero) {
+            PixelT const zero = 0;
+            for (int j = 0; j < n; ++j) {
+                buf[j] = std::max(std::min(fwd[j], buf[j]), zero);
+            }
+        } else {
+            for (int j = 0; j < n; ++j) {
+                buf[j] = std::min(fwd[j], buf[j]);
+            }
+        }
+        if (fout == bout) {
+            // The peak's own span is its own mirror: std::min keeps its
+            // first argument when the pair doesn't compare (NaN), so take
+            // each pixel's value from the right-hand one of the pair, as
+            // the pixel-by-pixel loop this replaced did.
+            for (int j = 0; j < n; ++j) {
+                fout[j] = buf[std::max(j, n - 1 - j)];
+            }
+            return;
+        }
+        std::copy(buf, buf + n, fout);
+        std::reverse_copy(buf, buf + n, bout);
+    }
+
+    /*
+     * Append to "out" the parts of [x0, x1] covered by the spans [begin,
+     * end) of one row, which are sorted and merged.
+     */
+    void appendRowOverlap(int x0, int x1,
+                          geom::SpanSet::const_iterator begin,
+                          geom::SpanSet::const_iterator end,
+                          std::vector<std::pair<int, int> > & out) {
+        if (x0 > x1) {
+            return;
+        }
+        // skip the spans that end before x0
+        geom::SpanSet::const_iterator sp =
+            std::lower_bound(begin, end, x0,
+                             [](geom::Span const & sp, int x) {
+                                 return sp.getX1() < x;
+                             });
+        for (; (sp != end) && (sp->getX0() <= x1); ++sp) {
+            out.push_back(std::make_pair(std::max(x0, sp->getX0()),
+                                         std::min(x1, sp->getX1())));
+        }
+    }
+
+    /*
+     * Do SpanSets "a" and "b", both sorted, have any pixel in common?
+     */
+    bool spansOverlap(geom::SpanSet const& a, geom::SpanSet const& b) {
+        if (!a.getBBox().overlaps(b.getBBox())) {
+            return false;
+        }
+        geom::SpanSet::const_iterator ia = a.begin();
+        geom::SpanSet::const_iterator ib = b.begin();
+        while ((ia != a.end()) && (ib != b.end())) {
+            if (ia->getY() != ib->getY()) {
+                if (ia->getY() < ib->getY()) {
+                    ++ia;
+                } else {
+                    ++ib;
+                }
+                continue;
+            }
+            if ((ia->getX0() <= ib->getX1()) && (ib->getX0() <= ia->getX1())) {
+                return true;
+            }
+            // step past whichever ends first
+            if (ia->getX1() < ib->getX1()) {
+                ++ia;
+            } else {
+                ++ib;
+            }
+        }
+        return false;
+    }
+    /*
+     * The body of the plain medianFilter, on the rows of W x H images:
+     * pixels within "halfsize" of the edges are copied unfiltered.
+     */
+    template <typename PixelT>
+    void medianFilterRows(std::vector<PixelT const*> const& inrows, std::vector<PixelT*> const& outrows,
+                          int W, int H, int halfsize) {
+        MedianEngine<PixelT> median(inrows, W, halfsize);
+        if (W > 2*halfsize) {
+            for (int y=halfsize; y<H-halfsize; ++y) {
+                median.filterRow(y, halfsize, W-halfsize, outrows[y]);
+            }
+        }
+
+        // grumble grumble margins
+        for (int y=0; y<2*halfsize; ++y) {
+            int iy = y;
+            if (y >= halfsize)
+                iy = H - 1 - (y-halfsize);
+            std::copy(inrows[iy], inrows[iy] + W, outrows[iy]);
+        }
+        for (int y=halfsize; y<H-halfsize; ++y) {
+            std::copy(inrows[y], inrows[y] + halfsize, outrows[y]);
+            std::copy(inrows[y] + ((W-1) - halfsize), inrows[y] + (W-1), outrows[y] + ((W-1) - halfsize));
+        }
+    }
+
+    /*
+     * The body of medianFilter with a footprint: filter the pixels of
+     * "spans" in W x H images with origin (x0, y0), clipping the boxes
+     * of those within "halfsize" of the edges.
+     */
+    template <typename PixelT>
+    void medianFilterSpans(std::vector<PixelT const*> const& inrows, std::vector<PixelT*> const& outrows,
+                           int W, int H, int x0, int y0, int halfsize, geom::SpanSet const& spans) {
+        MedianEngine<PixelT> median(inrows, W, halfsize);
+        for (geom::Span const & span : spans) {
+            int y = span.getY() - y0;
+            if (y < 0 || y >= H) {
+                continue;
+            }
+            int sx0 = std::max(span.getX0() - x0, 0);
+            int sx1 = std::min(span.getX1() - x0 + 1, W);
+            if (sx0 >= sx1) {
+                continue;
+            }
+            PixelT* optr = outrows[y];
+            // the part of the span whose boxes fit in the image
+            int ix0 = sx0, ix1 = sx0;
+            if (y >= halfsize && y < H-halfsize) {
+                ix0 = std::min(std::max(sx0, halfsize), sx1);
+                ix1 = std::max(std::min(sx1, W-halfsize), ix0);
+            }
+            for (int x=sx0; x<ix0; ++x) {
+                optr[x] = median.truncatedMedian(y, x);
+            }
+            median.filterRow(y, ix0, ix1, optr);
+            for (int x=ix1; x<sx1; ++x) {
+                optr[x] = median.truncatedMedian(y, x);
+            }
+        }
+    }
+
+    /*
+     * Call work(i, t) for each i in [0, n), sharing the calls among up to
+     * nThreads threads; t, in [0, nThreads), says which thread is making
+     * the call, for per-thread scratch space.  The first exception thrown
+     * stops the others, and is rethrown once they have all finished.
+     */
+    template <typename WorkT>
+    void parallelFor(std::size_t n, int nThreads, WorkT work) {
+        std::atomic<std::size_t> next(0);
+        std::exception_ptr error;
+        std::mutex errorMutex;
+        auto worker = [&](int t) {
+            for (std::size_t i = next++; i < n; i = next++) {
+                try {
+                    work(i, t);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    next = n;
+                }
+            }
+        };
+
+        int const nExtra = static_cast<int>(std::min<std::size_t>(std::max(nThreads, 1), n)) - 1;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nExtra; ++t) {
+            threads.push_back(std::thread(worker, t + 1));
+        }
+        worker(0);
+        for (std::thread & t : threads) {
+            t.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Pixels tested at a time by firstNonzero and lastNonzero
+    int const NONZERO_BLOCK = 8;
+
+    // Whether any of the NONZERO_BLOCK pixels from p is nonzero; with no
+    // branch per pixel, so the compiler can vectorize it.
+    template <typename PixelT>
+    inline bool anyNonzero(PixelT const* p) {
+        bool any = false;
+        for (int k = 0; k < NONZERO_BLOCK; ++k) {
+            any |= (p[k] != 0);
+        }
+        return any;
+    }
+
+    /*
+     * The first nonzero pixel of row[lo..hi], or hi + 1 if there is
+     * none; all-zero blocks are skipped whole.
+     */
+    template <typename PixelT>
+    int firstNonzero(PixelT const* row, int lo, int hi) {
+        int x = lo;
+        while ((x + NONZERO_BLOCK - 1 <= hi) && !anyNonzero(row + x)) {
+            x += NONZERO_BLOCK;
+        }
+        while ((x <= hi) && (row[x] == 0)) {
+            ++x;
+        }
+        return x;
+    }
+
+    /*
+     * The last nonzero pixel of row[lo..hi], or lo - 1 if there is none.
+     */
+    template <typename PixelT>
+    int lastNonzero(PixelT const* row, int lo, int hi) {
+        int x = hi;
+        while ((x - NONZERO_BLOCK + 1 >= lo) && !anyNonzero(row + x - NONZERO_BLOCK + 1)) {
+            x -= NONZERO_BLOCK;
+        }
+        while ((x >= lo) && (row[x] == 0)) {
+            --x;
+        }
+        return x;
+    }
+
+    /*
+     * Clip the spans of "foot" to the nonzero pixels of "img": spans
+     * (clipped to the image) that are all zero are dropped, and the ends
+     * of the rest are moved in to nonzero pixels; spans are not split
+     * at internal zeros.
+     */
+    template <typename PixelT>
+    void clipToNonzero(det::Footprint & foot, image::Image<PixelT> const& img) {
+        int const x0 = img.getX0();
+        int const y0 = img.getY0();
+        int const W = img.getWidth();
+        int const H = img.getHeight();
+        std::vector<geom::Span> spans;
+        spans.reserve(foot.getSpans()->size());
+        for (geom::Span const & sp : *foot.getSpans()) {
+            int const y = sp.getY() - y0;
+            if (y < 0 || y >= H) {
+                continue;
+            }
+            PixelT const* row = img.getArray()[y].getData();
+            int const xmax = std::min(sp.getX1() - x0, W - 1);
+            int const xlo = firstNonzero(row, std::max(sp.getX0() - x0, 0), xmax);
+            int const xhi = lastNonzero(row, xlo, xmax);
+            if (xlo <= xhi) {
+                spans.push_back(geom::Span(sp.getY(), x0 + xlo, x0 + xhi));
+            }
+        }
+        foot.setSpans(std::make_shared<geom::SpanSet>(std::move(spans), false));
+        foot.removeOrphanPeaks();
+    }
+
+    /*
+     * clipToNonzero, then trim the template "timg" to the clipped
+     * footprint's bbox (a copy) if that has changed and isn't empty.
+     */
+    template <typename PixelT>
+    PTR(image::Image<PixelT>) clipTemplateToNonzero(det::Footprint & tfoot,
+                                                    PTR(image::Image<PixelT>) timg) {
+        clipToNonzero(tfoot, *timg);
+        geom::Box2I const tbb = tfoot.getBBox();
+        if (!tbb.isEmpty() && (tbb != timg->getBBox(image::PARENT))) {
+            return std::make_shared<image::Image<PixelT> >(*timg, tbb, image::PARENT, true);
+        }
+        return timg;
+    }
+
+    /*
+     * Scratch space for TemplatePipeline, kept by each thread and reused
+     * from one template to the next: a copy of the template image, and
+     * the row pointers into it and the template.
+     */
+    template <typename PixelT>
+    struct TemplateScratch {
+        std::vector<PixelT> pixels;
+        std::vector<PixelT*> rows;
+        std::vector<PixelT*> scratchRows;
+        std::vector<PixelT const*> inRows;
+
+        // Point the rows at "img", and the scratch rows at a W x H buffer,
+        // holding a copy of "img" if "copy".
+        void reset(image::Image<PixelT> & img, bool copy) {
+            int const W = img.getWidth();
+            int const H = img.getHeight();
+            if (pixels.size() < static_cast<std::size_t>(W)*H) {
+                pixels.resize(static_cast<std::size_t>(W)*H);
+            }
+            rows.resize(H);
+            scratchRows.resize(H);
+            inRows.resize(H);
+            for (int y = 0; y < H; ++y) {
+                rows[y] = img.getArray()[y].getData();
+                scratchRows[y] = pixels.data() + static_cast<std::size_t>(y)*W;
+                inRows[y] = scratchRows[y];
+                if (copy) {
+                    std::copy(rows[y], rows[y] + W, scratchRows[y]);
+                }
+            }
+        }
+    };
+
+    /*
+     * The pixels of "edgeSpans" in "img" at or above "thresh", as
+     * getSignificantEdgePixels finds them.
+     */
+    template <typename PixelT>
+    std::vector<geom::Span> significantEdgeSpans(image::Image<PixelT> const& img,
+                                                 geom::SpanSet const& edgeSpans, PixelT thresh) {
+        int const x0 = img.getX0(), y0 = img.getY0();
+        std::vector<geom::Span> tmpSpans;
+        for (geom::SpanSet::const_iterator ss = edgeSpans.begin(); ss != edgeSpans.end(); ++ss) {
+            geom::Span const& span = *ss;
+            int const y = span.getY();
+            int x = span.getX0();
+            typename image::Image<PixelT>::const_x_iterator iter = img.x_at(x - x0, y - y0);
+            bool onSpan = false;            // Are we in a span of interest
+            int xSpan;                      // Starting x of span
+            for (; x <= span.getX1(); ++x, ++iter) {
+                if (*iter >= thresh) {
+                    onSpan = true;
+                    xSpan = x;
+                } else if (onSpan) {
+                    onSpan = false;
+                    tmpSpans.push_back(geom::Span(y, xSpan, x - 1));
+                }
+            }
+            if (onSpan) {
+                tmpSpans.push_back(geom::Span(y, xSpan, span.getX1()));
+            }
+        }
+        return tmpSpans;
+    }
+
+    /*
+     * Where symmetricTemplate reads its input pixels: get(x, y, n, buf)
+     * returns a pointer to the n pixels starting at (x, y), which it
+     * may write to "buf".  This one reads them straight from an image.
+     */
+    template <typename PixelT>
+    class ImageRows {
+    public:
+        explicit ImageRows(image::Image<PixelT> const& img) : _img(img) {}
+
+        PixelT const* get(int x, int y, int, PixelT*) const {
+            return _img.getArray()[y - _img.getY0()].getData() + (x - _img.getX0());
+        }
+
+    private:
+        image::Image<PixelT> const& _img;
+    };
+
+    /*
+     * The pixels rampFluxAtEdge builds its template from: those of
+     * "img" where they are in its bbox and nonzero, and elsewhere the
+     * ramp -- the largest of the "edges" pixels of template "timg",
+     * each times the "psf" image offset to it.  The ramp is only made
+     * for the pixels read, which outside the image bbox are few, rather
+     * than painted over the whole template first.
+     */
+    template <typename PixelT>
+    class RampedRows {
+    public:
+        RampedRows(image::Image<PixelT> const& img, image::Image<PixelT> const& timg,
+                   deblend::SpanIndex const& edges, image::Image<double> const& psf)
+            : _img(img), _timg(timg), _edges(edges), _psf(psf),
+              _imbb(img.getBBox(image::PARENT)), _psfbb(psf.getBBox(image::PARENT)) {}
+
+        PixelT const* get(int x, int y, int n, PixelT* buf) const {
+            bool const inRow = (y >= _imbb.getMinY()) && (y <= _imbb.getMaxY());
+            PixelT const* row = inRow ? _img.getArray()[y - _img.getY0()].getData() - _img.getX0() : nullptr;
+            for (int i = 0; i < n; ++i) {
+                int const px = x + i;
+                PixelT v = 0;
+                if (inRow && (px >= _imbb.getMinX()) && (px <= _imbb.getMaxX())) {
+                    v = row[px];
+                }
+                buf[i] = (v != 0) ? v : ramp(px, y);
+            }
+            return buf;
+        }
+
+    private:
+        PixelT ramp(int x, int y) const {
+            PixelT r = 0;
+            for (int ey = y - _psfbb.getMaxY(); ey <= y - _psfbb.getMinY(); ++ey) {
+                deblend::SpanIndex::const_iterator const end = _edges.rowEnd(ey);
+                for (deblend::SpanIndex::const_iterator sp = _edges.rowBegin(ey); sp != end; ++sp) {
+                    int const ex0 = std::max(sp->getX0(), x - _psfbb.getMaxX());
+                    int const ex1 = std::min(sp->getX1(), x - _psfbb.getMinX());
+                    if (ex0 > ex1) {
+                        continue;
+                    }
+                    PixelT const* trow = _timg.getArray()[ey - _timg.getY0()].getData() - _timg.getX0();
+                    double const* prow = _psf.getArray()[y - ey - _psfbb.getMinY()].getData()
+                        - _psfbb.getMinX();
+                    for (int ex = ex0; ex <= ex1; ++ex) {
+                        r = std::max(r, static_cast<PixelT>(trow[ex] * prow[x - ex]));
+                    }
+                }
+            }
+            return r;
+        }
+
+        image::Image<PixelT> const& _img;
+        image::Image<PixelT> const& _timg;
+        deblend::SpanIndex const& _edges;
+        image::Image<double> const& _psf;
+        geom::Box2I const _imbb;
+        geom::Box2I const _psfbb;
+    };
+
+    /*
+     * The body of buildSymmetricTemplate, given the symmetric footprint
+     * "sfoot" of parent "foot" around (cx, cy), and reading the input
+     * pixels through "rows" (an ImageRows or RampedRows).
+     */
+    template <typename PixelT, typename RowsT>
+    std::pair<PTR(image::Image<PixelT>), PTR(det::Footprint)>
+    symmetricTemplate(RowsT const& rows, det::Footprint const& foot, PTR(det::Footprint) sfoot,
+                      geom::SpanSet const& edgePixels, int cx, int cy,
+                      bool minZero, bool patchEdge, bool* patchedEdges) {
+        typedef image::Image<PixelT> ImageT;
+        typedef PTR(image::Image<PixelT>) ImagePtrT;
+
+        LOG_LOGGER _log = LOG_GET("meas.deblender.symmetricFootprint");
+
+        geom::SpanSet const & spans = *sfoot->getSpans();
+
+        // does this footprint touch an EDGE?  It is part of the parent
+        // footprint, so only the parent's EDGE pixels can be in it.
+        bool touchesEdge = false;
+        if (patchEdge && (edgePixels.size() > 0)) {
+            LOGL_DEBUG(_log, "Checking footprint for EDGE bits");
+            if (spansOverlap(spans, edgePixels)) {
+                LOGL_DEBUG(_log, "Footprint includes an EDGE pixel.");
+                touchesEdge = true;
+            }
+        }
+
+        // The result image:
+        ImagePtrT targetimg(new ImageT(sfoot->getBBox()));
+
+        geom::SpanSet::const_iterator fwd  = spans.begin();
+        geom::SpanSet::const_iterator back = spans.end()-1;
+
+        int const tx0 = targetimg->getX0();
+        int const ty0 = targetimg->getY0();
+        int const W = std::max(targetimg->getWidth(), foot.getBBox().getWidth());
+        std::vector<PixelT> buf(W), fbuf(W), bbuf(W);
+
+        for (; fwd <= back; fwd++, back--) {
+            // FIXME -- CURRENTLY WE IGNORE THE MASK PLANE!  options
+            // include ORing the mask bits, or being clever about
+            // ignoring some masked pixels, or copying the mask bits
+            // of the min pixel
+
+            // The footprint is symmetric, so mirrored spans are the same
+            // length; and we have already checked the bounding box.
+            int fy = fwd->getY();
+            int by = back->getY();
+            int n = fwd->getWidth();
+            assert(n == back->getWidth());
+            symmetricMinRow(rows.get(fwd->getX0(), fy, n, fbuf.data()),
+                            rows.get(back->getX0(), by, n, bbuf.data()),
+                            n, minZero,
+                            targetimg->getArray()[fy - ty0].getData() + (fwd->getX0() - tx0),
+                            targetimg->getArray()[by - ty0].getData() + (back->getX0() - tx0),
+                            buf.data());
+        }
+
+        if (touchesEdge) {
+            // Find spans whose mirrors fall outside the image bounds,
+            // grow the footprint to include those spans, and plug in
+            // their pixel values.
+            geom::Box2I bb = sfoot->getBBox();
+
+            // Actually, it's not necessarily the IMAGE bounds that count
+            //-- the footprint may not go right to the image edge.
+            //geom::Box2I imbb = img.getBBox();
+            geom::Box2I imbb = foot.getBBox();
+
+            LOGL_DEBUG(_log, "Footprint touches EDGE: start bbox [%i,%i],[%i,%i]",
+                       bb.getMinX(), bb.getMaxX(), bb.getMinY(), bb.getMaxY());
+            // original footprint spans
+            const geom::SpanSet & ospans = *foot.getSpans();
+            for (fwd = ospans.begin(); fwd != ospans.end(); ++fwd) {
+                int y = fwd->getY();
+                int x = fwd->getX0();
+                // mirrored coords
+                int ym = cy + (cy - y);
+                int xm = cx + (cx - x);
+                if (!imbb.contains(geom::Point2I(xm, ym))) {
+                    bb.include(geom::Point2I(x, y));
+                }
+                x = fwd->getX1();
+                xm = cx + (cx - x);
+                if (!imbb.contains(geom::Point2I(xm, ym))) {
+                    bb.include(geom::Point2I(x, y));
+                }
+            }
+            LOGL_DEBUG(_log, "Footprint touches EDGE: grown bbox [%i,%i],[%i,%i]",
+                       bb.getMinX(), bb.getMaxX(), bb.getMinY(), bb.getMaxY());
+
+            // New template image
+            ImagePtrT targetimg2(new ImageT(bb));
+            sfoot->getSpans()->copyImage(*targetimg, *targetimg2);
+
+            LOGL_DEBUG(_log, "Symmetric footprint spans:");
+            const geom::SpanSet & sspans = *sfoot->getSpans();
+            for (fwd = sspans.begin(); fwd != sspans.end(); ++fwd) {
+                LOGL_DEBUG(_log, "  %s", fwd->toString().c_str());
+            }
+
+            // copy original 'img' pixels for the portion of spans whose
+            // mirrors are out of bounds.
+            std::vector<geom::Span> newSpans(sfoot->getSpans()->begin(), sfoot->getSpans()->end());
+            for (fwd = ospans.begin(); fwd != ospans.end(); ++fwd) {
+                int y   = fwd->getY();
+                int x0  = fwd->getX0();
+                int x1 = fwd->getX1();
+                // mirrored coords
+                int ym  = cy + (cy - y);
+                int xm0 = cx + (cx - x0);
+                int xm1 = cx + (cx - x1);
+                bool in0 = imbb.contains(geom::Point2I(xm0, ym));
+                bool in1 = imbb.contains(geom::Point2I(xm1, ym));
+                if (in0 && in1) {
+                    // both endpoints of the symmetric span are in bounds; nothing to do
+                    continue;
+                }
+                // clip to the part of the span where the mirror is out of bounds
+                if (in0) {
+                    // the mirror of x0 is in-bounds; move x0 to be the first pixel
+                    // whose mirror would be out-of-bounds
+                    x0 = cx + (cx - (imbb.getMinX() - 1));
+                }
+                if (in1) {
+                    x1 = cx + (cx - (imbb.getMaxX() + 1));
+                }
+                LOGL_DEBUG(_log, "Span y=%i, x=[%i,%i] has mirror (%i,[%i,%i]) out-of-bounds; clipped to %i,[%i,%i]",
+                           y, fwd->getX0(), fwd->getX1(), ym, xm1, xm0, y, x0, x1);
+                if (x0 <= x1) {
+                    PixelT const* in = rows.get(x0, y, x1 - x0 + 1, fbuf.data());
+                    std::copy(in, in + (x1 - x0 + 1),
+                              targetimg2->getArray()[y - targetimg2->getY0()].getData() +
+                              (x0 - targetimg2->getX0()));
+                }
+                newSpans.push_back(geom::Span(y, x0, x1));
+            }
+            sfoot->setSpans(std::make_shared<geom::SpanSet>(std::move(newSpans)));
+            targetimg = targetimg2;
+        }
+
+        *patchedEdges = touchesEdge;
+        return std::pair<ImagePtrT, PTR(det::Footprint)>(targetimg, sfoot);
+    }
+
+    /*
+     * Least-squares solution "x" of the M x N system A x = b, with A
+     * stored by columns, as numpy.linalg.lstsq (with its old default
+     * rcond) finds it: singular values no more than machine precision
+     * times the largest are dropped, giving the minimum-norm solution.
+     * As numpy only returns the residual when A has full rank N < M,
+     * only then is the sum of squared residuals put in *chisq and true
+     * returned.  The SVD is by one-sided Jacobi rotations, which is
+     * accurate and simple for the few columns we have.
+     */
+    bool leastSquares(std::vector<double> const& A, std::vector<double> const& b, int M, int N,
+                      std::vector<double> & x, double* chisq) {
+        double const eps = std::numeric_limits<double>::epsilon();
+        std::vector<double> U(A);
+        std::vector<double> V(N*N, 0.);
+        for (int i = 0; i < N; ++i) {
+            V[i*N + i] = 1.;
+        }
+        for (int sweep = 0; sweep < 100; ++sweep) {
+            bool rotated = false;
+            for (int p = 0; p < N; ++p) {
+                for (int q = p + 1; q < N; ++q) {
+                    double* up = &U[p*M];
+                    double* uq = &U[q*M];
+                    double alpha = 0., beta = 0., gamma = 0.;
+                    for (int k = 0; k < M; ++k) {
+                        alpha += up[k]*up[k];
+                        beta += uq[k]*uq[k];
+                        gamma += up[k]*uq[k];
+                    }
+                    if (std::abs(gamma) <= eps*std::sqrt(alpha*beta)) {
+                        continue;
+                    }
+                    rotated = true;
+                    double const zeta = (beta - alpha)/(2.*gamma);
+                    double const t = (zeta >= 0 ? 1. : -1.)/(std::abs(zeta) + std::sqrt(1. + zeta*zeta));
+                    double const c = 1./std::sqrt(1. + t*t);
+                    double const s = c*t;
+                    for (int k = 0; k < M; ++k) {
+                        double const a = up[k];
+                        up[k] = c*a - s*uq[k];
+                        uq[k] = s*a + c*uq[k];
+                    }
+                    double* vp = &V[p*N];
+                    double* vq = &V[q*N];
+                    for (int k = 0; k < N; ++k) {
+                        double const a = vp[k];
+                        vp[k] = c*a - s*vq[k];
+                        vq[k] = s*a + c*vq[k];
+                    }
+                }
+            }
+            if (!rotated) {
+                break;
+            }
+        }
+        // the singular values are the norms of the rotated columns
+        std::vector<double> sv(N);
+        double smax = 0.;
+        for (int i = 0; i < N; ++i) {
+            double ss = 0.;
+            for (int k = 0; k < M; ++k) {
+                ss += U[i*M + k]*U[i*M + k];
+            }
+            sv[i] = std::sqrt(ss);
+            smax = std::max(smax, sv[i]);
+        }
+        // LAPACK's machine precision is half the C++ epsilon
+        double const cutoff = 0.5*eps*smax;
+        int rank = 0;
+        x.assign(N, 0.);
+        for (int i = 0; i < N; ++i) {
+            if (!(sv[i] > cutoff)) {
+                continue;
+            }
+            ++rank;
+            double ub = 0.;
+            for (int k = 0; k < M; ++k) {
+                ub += U[i*M + k]*b[k];
+            }
+            double const coef = ub/(sv[i]*sv[i]);
+            for (int j = 0; j < N; ++j) {
+                x[j] += coef*V[i*N + j];
+            }
+        }
+        if ((rank < N) || (M <= N)) {
+            return false;
+        }
+        double r2 = 0.;
+        for (int k = 0; k < M; ++k) {
+            double r = b[k];
+            for (int j = 0; j < N; ++j) {
+                r -= A[j*M + k]*x[j];
+            }
+            r2 += r*r;
+        }
+        *chisq = r2;
+        return true;
+    }
+
+    /*
+     * The PSF image at "pos", or at the PSF's default position if it
+     * cannot be computed there, as baseline.CachingPsf does.
+     */
+    std::shared_ptr<image::Image<double> const>
+    computePsfImage(deblend::PsfImageCache const& psf, geom::Point2D const& pos) {
+        try {
+            return psf.computeImage(pos);
+        } catch (lsst::pex::exceptions::Exception const&) {
+            return psf.computeImage(psf.getPsf()->getAveragePosition());
+        }
+    }
+
+    // The value of "img" at (x, y), in parent coordinates
+    inline double pixelAt(image::Image<double> const& img, int x, int y) {
+        return img.getArray()[y - img.getY0()].getData()[x - img.getX0()];
+    }
+
+    /*
+     * Call fn(y, x0, x1) for each run of pixels [x0, x1] of the spans in
+     * "index" that lies within "box".
+     */
+    template <typename Fn>
+    void forEachSpanIn(deblend::SpanIndex const& index, geom::Box2I const& box, Fn fn) {
+        for (int y = box.getMinY(); y <= box.getMaxY(); ++y) {
+            deblend::SpanIndex::const_iterator const end = index.rowEnd(y);
+            for (deblend::SpanIndex::const_iterator sp = index.rowBegin(y); sp != end; ++sp) {
+                int const x0 = std::max(sp->getX0(), box.getMinX());
+                int const x1 = std::min(sp->getX1(), box.getMaxX());
+                if (x0 <= x1) {
+                    fn(y, x0, x1);
+                }
+            }
+        }
+    }
+
+    /*
+     * Solve the symmetric N x N system M x = v by Cholesky decomposition,
+     * or, if M is not (numerically) positive definite, for the
+     * minimum-norm least-squares solution.
+     */
+    void solveSymmetric(std::vector<double> const& M, std::vector<double> const& v, int N,
+                        std::vector<double> & x) {
+        double const eps = std::numeric_limits<double>::epsilon();
+        double dmax = 0.;
+        for (int i = 0; i < N; ++i) {
+            dmax = std::max(dmax, M[i*N + i]);
+        }
+        // the lower triangle, L, with M = L L^T
+        std::vector<double> L(M);
+        bool ok = (dmax > 0.);
+        for (int j = 0; ok && (j < N); ++j) {
+            double d = L[j*N + j];
+            for (int k = 0; k < j; ++k) {
+                d -= L[j*N + k]*L[j*N + k];
+            }
+            if (!(d > N*eps*dmax)) {
+                ok = false;
+                break;
+            }
+            d = std::sqrt(d);
+            L[j*N + j] = d;
+            for (int i = j + 1; i < N; ++i) {
+                double s = L[i*N + j];
+                for (int k = 0; k < j; ++k) {
+                    s -= L[i*N + k]*L[j*N + k];
+                }
+                L[i*N + j] = s/d;
+            }
+        }
+        if (!ok) {
+            double chisq;
+            leastSquares(M, v, N, N, x, &chisq);
+            return;
+        }
+        x.assign(v.begin(), v.end());
+        for (int i = 0; i < N; ++i) {
+            for (int k = 0; k < i; ++k) {
+                x[i] -= L[i*N + k]*x[k];
+            }
+            x[i] /= L[i*N + i];
+        }
+        for (int i = N - 1; i >= 0; --i) {
+            for (int k = i + 1; k < N; ++k) {
+                x[i] -= L[k*N + i]*x[k];
+            }
+            x[i] /= L[i*N + i];
+        }
+    }
+    /*
+     * Call fn(y, x0, x1) for each run of pixels [x0, x1] that is in the
+     * spans of both "a" and "b".
+     */
+    template <typename Fn>
+    void forEachSpanOverlap(deblend::SpanIndex const& a, deblend::SpanIndex const& b, Fn fn) {
+        geom::Box2I box = a.getBBox();
+        box.clip(b.getBBox());
+        if (box.isEmpty()) {
+            return;
+        }
+        for (int y = box.getMinY(); y <= box.getMaxY(); ++y) {
+            deblend::SpanIndex::const_iterator sa = a.rowBegin(y);
+            deblend::SpanIndex::const_iterator const ea = a.rowEnd(y);
+            deblend::SpanIndex::const_iterator sb = b.rowBegin(y);
+            deblend::SpanIndex::const_iterator const eb = b.rowEnd(y);
+            while ((sa != ea) && (sb != eb)) {
+                int const x0 = std::max(sa->getX0(), sb->getX0());
+                int const x1 = std::min(sa->getX1(), sb->getX1());
+                if (x0 <= x1) {
+                    fn(y, x0, x1);
+                }
+                // advance whichever span ends first
+                if (sa->getX1() < sb->getX1()) {
+                    ++sa;
+                } else {
+                    ++sb;
+                }
+            }
+        }
+    }
+
+} // end anonymous namespace
+
+/**
+ Run a spatial median filter over the given input *img*, writing the
+ results to *out*.  *halfsize* is half the box size of the filter; ie,
+ a halfsize of 50 means that each output ixel will be the median of
+ the pixels in a 101 x 101-pixel box in the input image.
+
+ Margins are handled horribly: the median is computed only for pixels
+ more than *halfsize* away from the edges; pixels near the edges are
+ simply copied from the input *img* to *out*.
+
+ Mask and variance planes are, likewise, simply copied from *img* to
+ *out*.
+
+ 3x3 and 5x5 boxes (*halfsize* 1 and 2) use fixed min/max exchange
+ networks, several output pixels at a time.  For larger *halfsize* the
+ window is slid along each row, updating an order statistic over pixel
+ ranks, so the cost per pixel grows as *halfsize* rather than its
+ square.  The output is identical to taking the median of each box
+ independently, which is still done for images containing NaNs.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+medianFilter(ImageT const& img,
+             ImageT & out,
+             int halfsize) {
+    int W = img.getWidth();
+    int H = img.getHeight();
+
+    std::vector<ImagePixelT const*> inrows(H);
+    for (int y=0; y<H; ++y) {
+        inrows[y] = img.getArray()[y].getData();
+    }
+
+    std::vector<ImagePixelT*> outrows(H);
+    for (int y=0; y<H; ++y) {
+        outrows[y] = out.getArray()[y].getData();
+    }
+    medianFilterRows(inrows, outrows, W, H, halfsize);
+}
+
+/**
+ Run a spatial median filter over the pixels of *img* that lie in the
+ footprint *foot*, writing the results to *out*, which must have the
+ same bounding box as *img*.  Pixels of *out* outside *foot* are left
+ untouched.
+
+ Unlike the plain medianFilter, pixels within *halfsize* of the edges
+ are filtered too: their boxes are clipped to the image, and the median
+ taken over the pixels that remain.  Pixels whose boxes fit in the image
+ get exactly the values the plain medianFilter would give them.  Pixels
+ outside *foot* still contribute to the medians of those inside it.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+medianFilter(ImageT const& img,
+             ImageT & out,
+             int halfsize,
+             det::Footprint const& foot) {
+    if (out.getBBox() != img.getBBox()) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                          "Output image for medianFilter must have the same bounding box as the input");
+    }
+    int W = img.getWidth();
+    int H = img.getHeight();
+    int x0 = img.getX0();
+    int y0 = img.getY0();
+
+    std::vector<ImagePixelT const*> inrows(H);
+    for (int y=0; y<H; ++y) {
+        inrows[y] = img.getArray()[y].getData();
+    }
+
+    std::vector<ImagePixelT*> outrows(H);
+    for (int y=0; y<H; ++y) {
+        outrows[y] = out.getArray()[y].getData();
+    }
+    medianFilterSpans(inrows, outrows, W, H, x0, y0, halfsize, *foot.getSpans());
+}
+
+/**
+ Given an image *mimg* and Peak location *peak*, overwrite *mimg* so
+ that pixels further from the peak have values smaller than those
+ close to the peak; make the profile monotonic-decreasing.
+
+ The exact algorithm is a little more complicated than that.  The
+ basic idea is of "casting a shadow" from a pixel to pixels farther
+ from the peak in the same direction.  Done naively, this results in
+ very narrow "shadows" and ragged profiles.  A tweak is to make the
+ shadows "fatter" -- make a pixel shadow a wedge of pixels -- but if
+ one does this naively, the wedge gets wider and wider too quickly.
+ The algorithm works out from the peak in square "rings" of pixels, so
+ if a pixel shadows a wedge 30 degrees wide, in the next ring of
+ pixels the shadowed pixel at largest angle from the shadowing pixel
+ will shade a yet-larger wedge, expanding the shadowing angle.  To
+ reduce this effect, we work in chunks of 5 pixels in radius, only
+ copying the intermediate pixels to the "shadowing" image at the end
+ of each chunk.
+
+ The shadow cones cast by each ring are computed once and cached
+ (keyed by the ring's half-length) for reuse across calls, and only the
+ band of rings read by the next chunk is copied to the "shadowing"
+ image, so the cost is linear in the number of pixels.
+
+ Currently the mask and variance planes of the input are totally
+ ignored.
+
+ For illustration, run tests/monotonic.py and look at im*.png
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+makeMonotonic(
+    ImageT & img,
+    det::PeakRecord const& peak) {
+
+    int W = img.getWidth();
+    int H = img.getHeight();
+
+    // The chunk being processed casts shadows from the pixels as they
+    // were before it started, so keep a copy of those.
+    ImageT shadowingImg(img.getDimensions());
+    std::vector<ImagePixelT*> rows(H), shadowing(H);
+    for (int y=0; y<H; ++y) {
+        rows[y] = img.getArray()[y].getData();
+        shadowing[y] = shadowingImg.getArray()[y].getData();
+    }
+    castShadows(rows, shadowing, W, H,
+                peak.getIx() - img.getX0(), peak.getIy() - img.getY0());
+}
+
+/**
+ Given an image *img* and Peak location *peak*, overwrite *img* so that
+ it is monotonic-decreasing away from the peak, like makeMonotonic but
+ visiting each pixel just once.
+
+ Working outward from the peak in each quadrant, every pixel is clamped
+ to the minimum of its nearer neighbours along the direction to the
+ peak: the horizontal and diagonal neighbours if it is further from the
+ peak in x than in y, the vertical and diagonal neighbours if further in
+ y, and just the diagonal neighbour on the diagonals.  Those neighbours
+ are all one ring closer to the peak, so have already been clamped.
+ Neighbours outside the image are ignored.
+
+ This produces narrower "shadows" than makeMonotonic, but costs only a
+ few operations per pixel.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+makeMonotonicRadial(
+    ImageT & img,
+    det::PeakRecord const& peak) {
+
+    int W = img.getWidth();
+    int H = img.getHeight();
+    int cx = peak.getIx() - img.getX0();
+    int cy = peak.getIy() - img.getY0();
+
+    std::vector<ImagePixelT*> rows(H);
+    for (int y=0; y<H; ++y) {
+        rows[y] = img.getArray()[y].getData();
+    }
+
+    for (int ysign = 1; ysign >= -1; ysign -= 2) {
+        for (int xsign = 1; xsign >= -1; xsign -= 2) {
+            // rows and columns of this quadrant, in order of increasing
+            // distance from the peak
+            int ybegin = (ysign > 0 ? std::max(cy, 0) : std::min(cy, H-1));
+            int yend   = (ysign > 0 ? H : -1);
+            int xbegin = (xsign > 0 ? std::max(cx, 0) : std::min(cx, W-1));
+            int xend   = (xsign > 0 ? W : -1);
+            for (int y = ybegin; (yend - y)*ysign > 0; y += ysign) {
+                int ady = std::abs(y - cy);
+                // step towards the peak in y
+                int ny = y - (y > cy ? 1 : (y < cy ? -1 : 0));
+                bool nyok = (ny >= 0 && ny < H);
+                ImagePixelT* row = rows[y];
+                for (int x = xbegin; (xend - x)*xsign > 0; x += xsign) {
+                    int adx = std::abs(x - cx);
+                    if (adx == 0 && ady == 0) {
+                        continue;
+                    }
+                    int nx = x - (x > cx ? 1 : (x < cx ? -1 : 0));
+                    bool nxok = (nx >= 0 && nx < W);
+                    ImagePixelT pix = row[x];
+                    // diagonal neighbour (or the one on the axis)
+                    if (nxok && nyok) {
+                        pix = std::min(pix, rows[ny][nx]);
+                    }
+                    if (adx > ady && nxok) {
+                        pix = std::min(pix, row[nx]);
+                    } else if (ady > adx && nyok) {
+                        pix = std::min(pix, rows[ny][x]);
+                    }
+                    row[x] = pix;
+                }
+            }
+        }
+    }
+}
+
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+_find_stray_flux(det::Footprint const& foot,
+                 ImagePtrT tsum,
+                 MaskedImageT const& img,
+                 int strayFluxOptions,
+                 std::vector<PTR(det::Footprint)> tfoots,
+                 std::vector<bool> const& ispsf,
+                 std::vector<int>  const& pkx,
+                 std::vector<int>  const& pky,
+                 double clipStrayFluxFraction,
+                 std::vector<std::shared_ptr<typename det::HeavyFootprint<ImagePixelT,MaskPixelT,VariancePixelT> > > & strays
+                 ) {
+
+    // when doing stray flux: the pixels given to each template, which
+    // we'll turn into the return 'strays' HeavyFootprints at the end.
+    std::vector<StrayPixels<ImagePixelT, MaskPixelT, VariancePixelT> > straypix(tfoots.size());
+
+    geom::Box2I sumbb = tsum->getBBox();
+
+    bool always = (strayFluxOptions & STRAYFLUX_TO_POINT_SOURCES_ALWAYS);
+    bool maybePtsrcs = (always || (strayFluxOptions & STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY));
+
+    // The stray flux: pixels that are not claimed by any template, and
+    // positive.  Often there are none, and then there's nothing to do.
+    PTR(geom::SpanSet) stray = findStrayPixels(foot, *tsum, img);
+    if (stray->getArea() == 0) {
+        for (size_t i=0; i<tfoots.size(); ++i) {
+            strays.push_back(HeavyFootprintPtrT());
+        }
+        return;
+    }
+
+    // The stray pixels, in order, for the rules that need to look at
+    // them all up front.
+    std::vector<int> strayx, strayy;
+    if (strayFluxOptions & (STRAYFLUX_R_TO_FOOTPRINT | STRAYFLUX_NEAREST_FOOTPRINT)) {
+        strayx.reserve(stray->getArea());
+        strayy.reserve(stray->getArea());
+        for (geom::Span const & s : *stray) {
+            for (int x = s.getX0(); x <= s.getX1(); ++x) {
+                strayx.push_back(x);
+                strayy.push_back(s.getY());
+            }
+        }
+    }
+
+    // For STRAYFLUX_NEAREST_FOOTPRINT, the template closest to each
+    // stray pixel.
+    std::vector<int> straynearest;
+    if ((strayFluxOptions & STRAYFLUX_NEAREST_FOOTPRINT) &&
+        !(strayFluxOptions & STRAYFLUX_R_TO_FOOTPRINT) && !strayx.empty()) {
+        bool euclidean = (strayFluxOptions & STRAYFLUX_NEAREST_FOOTPRINT_EUCLIDEAN);
+        std::vector<PTR(det::Footprint)> templist;
+        std::vector<PTR(det::Footprint)>* footlist = &tfoots;
+
+        if (!always && ispsf.size()) {
+            // create a temp list that has empty footprints in place
+            // of all the point sources.
+            auto empty = std::make_shared<det::Footprint>();
+            empty->setPeakSchema(foot.getPeaks().getSchema());
+            for (size_t i=0; i<tfoots.size(); ++i) {
+                if (ispsf[i]) {
+                    templist.push_back(empty);
+                } else {
+                    templist.push_back(tfoots[i]);
+                }
+            }
+            footlist = &templist;
+        }
+        nearestFootprint(*footlist, sumbb, strayx, strayy, euclidean, straynearest);
+
+        // Pixels with no extended source to go to can go to the
+        // nearest point source, if necessary.
+        if ((footlist == &templist) &&
+            (strayFluxOptions & STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY) &&
+            std::count(straynearest.begin(), straynearest.end(), NO_FOOTPRINT) > 0) {
+            std::vector<int> nearestall;
+            nearestFootprint(tfoots, sumbb, strayx, strayy, euclidean, nearestall);
+            for (size_t k=0; k<straynearest.size(); ++k) {
+                if (straynearest[k] == NO_FOOTPRINT) {
+                    straynearest[k] = nearestall[k];
+                }
+            }
+        }
+    }
+
+    // For STRAYFLUX_R_TO_FOOTPRINT, the squared distance from each
+    // stray pixel k to each template i that might get its flux,
+    // r2[k*ntemplates + i].
+    size_t const ntemplates = tfoots.size();
+    std::vector<double> r2;
+    if ((strayFluxOptions & STRAYFLUX_R_TO_FOOTPRINT) && !strayx.empty()) {
+        r2.resize(strayx.size()*ntemplates);
+        FootprintDistance distance;
+        for (size_t i=0; i<ntemplates; ++i) {
+            // point sources' stray flux is never looked at
+            if (!maybePtsrcs && ispsf.size() && ispsf[i]) {
+                continue;
+            }
+            distance.compute(*tfoots[i], sumbb, strayx, strayy, 1e12, &r2[i], ntemplates);
+        }
+    }
+
+    // For STRAYFLUX_R_TO_PEAK, a grid of the peaks that can get stray
+    // flux, so that each stray pixel need only look at those near enough
+    // to survive clipStrayFluxFraction.
+    std::unique_ptr<PeakGrid> peakGrid;
+    if (!(strayFluxOptions & (STRAYFLUX_R_TO_FOOTPRINT | STRAYFLUX_NEAREST_FOOTPRINT)) &&
+        (clipStrayFluxFraction > 0.) && (clipStrayFluxFraction < 1.)) {
+        std::vector<int> peaks;
+        for (size_t i=0; i<ntemplates; ++i) {
+            if (always || !ispsf.size() || !ispsf[i]) {
+                peaks.push_back(i);
+            }
+        }
+        if (peaks.empty() && (strayFluxOptions & STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY)) {
+            // No extended sources -- they all go to point sources
+            for (size_t i=0; i<ntemplates; ++i) {
+                peaks.push_back(i);
+            }
+        }
+        if (peaks.size() >= PEAK_GRID_MIN_PEAKS) {
+            peakGrid.reset(new PeakGrid(pkx, pky, peaks));
+        }
+    }
+
+    StrayFluxWeights weights;
+    weights.ispsf.assign(ntemplates, 0);
+    for (size_t i=0; i<ispsf.size(); ++i) {
+        weights.ispsf[i] = ispsf[i];
+    }
+    weights.pkx = &pkx;
+    weights.pky = &pky;
+    weights.peakGrid = peakGrid.get();
+    weights.r2 = &r2;
+    weights.nearest = &straynearest;
+    weights.clip = clipStrayFluxFraction;
+
+    StrayFluxPtsrcs ptsrcs = STRAY_PTSRCS_NEVER;
+    if (always) {
+        ptsrcs = STRAY_PTSRCS_ALWAYS;
+    } else if (strayFluxOptions & STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY) {
+        ptsrcs = STRAY_PTSRCS_WHEN_NECESSARY;
+    }
+
+    // Split the stray flux among the templates
+    if (strayFluxOptions & STRAYFLUX_R_TO_FOOTPRINT) {
+        dispatchStrayFlux<STRAY_R_TO_FOOTPRINT>(ptsrcs, *stray, img, weights, straypix);
+    } else if (strayFluxOptions & STRAYFLUX_NEAREST_FOOTPRINT) {
+        dispatchStrayFlux<STRAY_NEAREST_FOOTPRINT>(ptsrcs, *stray, img, weights, straypix);
+    } else {
+        dispatchStrayFlux<STRAY_R_TO_PEAK>(ptsrcs, *stray, img, weights, straypix);
+    }
+
+    // Store the stray flux in HeavyFootprints
+    for (size_t i=0; i<tfoots.size(); ++i) {
+        if (straypix[i].empty()) {
+            strays.push_back(HeavyFootprintPtrT());
+        } else {
+            strays.push_back(straypix[i].makeHeavy(foot.getPeaks().getSchema()));
+        }
+    }
+}
+
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+_sum_templates(std::vector<ImagePtrT> timgs,
                ImagePtrT tsum) {
     geom::Box2I sumbb = tsum->getBBox();
     int sumx0 = sumbb.getMinX();
@@ -625,13 +2624,9 @@ _sum_templates(std::vector<ImagePtrT> timgs,
         // Here we iterate over the template bbox -- we could instead
         // iterate over the "tfoot"s.
         for (int y=tbb.getMinY(); y<=tbb.getMaxY(); ++y) {
-            typename ImageT::x_iterator in_it = timg->row_begin(y - ty0) + (copyx0 - tx0);
-            typename ImageT::x_iterator inend = in_it + tbb.getWidth();
-            typename ImageT::x_iterator tsum_it =
-                tsum->row_begin(y - sumy0) + (copyx0 - sumx0);
-            for (; in_it != inend; ++in_it, ++tsum_it) {
-                *tsum_it += std::max((ImagePixelT)0., static_cast<ImagePixelT>(*in_it));
-            }
+            addClippedRow(timg->getArray()[y - ty0].getData() + (copyx0 - tx0),
+                          tsum->getArray()[y - sumy0].getData() + (copyx0 - sumx0),
+                          tbb.getWidth());
         }
     }
 
@@ -701,30 +2696,110 @@ apportionFlux(MaskedImageT const& img,
               double clipStrayFluxFraction
     ) {
 
-    if (timgs.size() != tfoots.size()) {
-        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
-            (boost::format("Template images must be the same length as template footprints (%d vs %d)")
-                % timgs.size() % tfoots.size()).str());
+    checkApportionArgs(img, foot, timgs, tfoots);
+
+    // the apportioned flux return value
+    std::vector<MaskedImagePtrT> portions;
+
+    LOG_LOGGER _log = LOG_GET("meas.deblender.apportionFlux");
+    bool findStrayFlux = (strayFluxOptions & ASSIGN_STRAYFLUX);
+
+    int ix0 = img.getX0();
+    int iy0 = img.getY0();
+    geom::Box2I fbb = foot.getBBox();
+
+    if (!tsum) {
+        tsum = ImagePtrT(new ImageT(fbb.getDimensions()));
+        tsum->setXY0(fbb.getMinX(), fbb.getMinY());
     }
 
+    if (!tsum->getBBox().contains(foot.getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+                          "Template sum image MUST contain parent footprint");
+    }
+
+    geom::Box2I sumbb = tsum->getBBox();
+    int sumx0 = sumbb.getMinX();
+    int sumy0 = sumbb.getMinY();
+
+    _sum_templates(timgs, tsum);
+
+    ImageT rtsum(sumbb.getDimensions());
+    std::vector<bool> sumRowHasZero, sumRowHasTiny;
+    reciprocalSum(*tsum, rtsum, sumRowHasZero, sumRowHasTiny);
+
+    // Compute flux portions
     for (size_t i=0; i<timgs.size(); ++i) {
-        if (!timgs[i]->getBBox().contains(tfoots[i]->getBBox())) {
-            throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
-                              "Template image MUST contain template footprint");
-        }
-        if (!img.getBBox().contains(foot.getBBox())) {
-            throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
-                              "Image bbox MUST contain parent footprint");
+        ImagePtrT timg = timgs[i];
+        // Initialize return value:
+        MaskedImagePtrT port(new MaskedImageT(timg->getDimensions()));
+        port->setXY0(timg->getXY0());
+        portions.push_back(port);
+
+        // Split flux = image * template / tsum
+        geom::Box2I tbb = timg->getBBox();
+        int tx0 = tbb.getMinX();
+        int ty0 = tbb.getMinY();
+        // As above
+        tbb.clip(sumbb);
+        int copyx0 = tbb.getMinX();
+        int n = tbb.getWidth();
+        for (int y=tbb.getMinY(); y<=tbb.getMaxY(); ++y) {
+            int const iy = y - iy0, ix = copyx0 - ix0;
+            int const ty = y - ty0, tx = copyx0 - tx0;
+            int const sy = y - sumy0, sx = copyx0 - sumx0;
+            ImagePixelT const* sptr = tsum->getArray()[sy].getData() + sx;
+            apportionRow(img.getImage()->getArray()[iy].getData() + ix,
+                         timg->getArray()[ty].getData() + tx,
+                         sptr,
+                         rtsum.getArray()[sy].getData() + sx,
+                         port->getImage()->getArray()[ty].getData() + tx, n, sumRowHasTiny[sy]);
+            copyRowWhereSummed(img.getMask()->getArray()[iy].getData() + ix, sptr,
+                               port->getMask()->getArray()[ty].getData() + tx,
+                               n, sumRowHasZero[sy]);
+            copyRowWhereSummed(img.getVariance()->getArray()[iy].getData() + ix, sptr,
+                               port->getVariance()->getArray()[ty].getData() + tx,
+                               n, sumRowHasZero[sy]);
         }
-        // template bounding-boxes *can* extend outside the parent
-        // footprint if we are ramping templates with significant flux
-        // at the edges.  We handle this below.
     }
 
-    // the apportioned flux return value
-    std::vector<MaskedImagePtrT> portions;
+    if (findStrayFlux) {
+        checkStrayFluxArgs(timgs.size(), ispsf, pkx, pky);
+        _find_stray_flux(foot, tsum, img, strayFluxOptions, tfoots,
+                         ispsf, pkx, pky, clipStrayFluxFraction, strays);
+    }
+    return portions;
+}
+
+/**
+ As apportionFlux, but returning the flux assigned to each template as
+ a HeavyFootprint over its template footprint *tfoots[i]*, written
+ directly from the image rather than via a template-sized MaskedImage.
+ Pixels of a template footprint outside *tsum*, or where the template
+ sum is zero, get zero flux, as they do in apportionFlux.
+
+ Stray flux, if requested, is returned separately in *strays*; use
+ mergeHeavyFootprints to add it to the portions.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::vector<typename deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::HeavyFootprintPtrT>
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+apportionFluxToHeavy(MaskedImageT const& img,
+                     det::Footprint const& foot,
+                     std::vector<ImagePtrT> timgs,
+                     std::vector<PTR(det::Footprint)> tfoots,
+                     ImagePtrT tsum,
+                     std::vector<bool> const& ispsf,
+                     std::vector<int>  const& pkx,
+                     std::vector<int>  const& pky,
+                     std::vector<HeavyFootprintPtrT> & strays,
+                     int strayFluxOptions,
+                     double clipStrayFluxFraction
+    ) {
 
-    LOG_LOGGER _log = LOG_GET("meas.deblender.apportionFlux");
+    checkApportionArgs(img, foot, timgs, tfoots);
+
+    std::vector<HeavyFootprintPtrT> portions;
     bool findStrayFlux = (strayFluxOptions & ASSIGN_STRAYFLUX);
 
     int ix0 = img.getX0();
@@ -747,175 +2822,615 @@ apportionFlux(MaskedImageT const& img,
 
     _sum_templates(timgs, tsum);
 
-    // Compute flux portions
+    ImageT rtsum(sumbb.getDimensions());
+    std::vector<bool> sumRowHasZero, sumRowHasTiny;
+    reciprocalSum(*tsum, rtsum, sumRowHasZero, sumRowHasTiny);
+
     for (size_t i=0; i<timgs.size(); ++i) {
         ImagePtrT timg = timgs[i];
-        // Initialize return value:
-        MaskedImagePtrT port(new MaskedImageT(timg->getDimensions()));
-        port->setXY0(timg->getXY0());
-        portions.push_back(port);
-
-        // Split flux = image * template / tsum
-        geom::Box2I tbb = timg->getBBox();
-        int tx0 = tbb.getMinX();
-        int ty0 = tbb.getMinY();
-        // As above
-        tbb.clip(sumbb);
-        int copyx0 = tbb.getMinX();
-        for (int y=tbb.getMinY(); y<=tbb.getMaxY(); ++y) {
-            typename MaskedImageT::x_iterator in_it =
-                img.row_begin(y - iy0) + (copyx0 - ix0);
-            typename ImageT::x_iterator tptr =
-                timg->row_begin(y - ty0) + (copyx0 - tx0);
-            typename ImageT::x_iterator tend = tptr + tbb.getWidth();
-            typename ImageT::x_iterator tsum_it =
-                tsum->row_begin(y - sumy0) + (copyx0 - sumx0);
-            typename MaskedImageT::x_iterator out_it =
-                port->row_begin(y - ty0) + (copyx0 - tx0);
-            for (; tptr != tend; ++tptr, ++in_it, ++out_it, ++tsum_it) {
-                if (*tsum_it == 0) {
-                    continue;
-                }
-                double frac = std::max((ImagePixelT)0., static_cast<ImagePixelT>(*tptr)) / (*tsum_it);
-                //if (frac == 0) {
-                // treat mask planes differently?
-                // }
-                out_it.mask()     = (*in_it).mask();
-                out_it.variance() = (*in_it).variance();
-                out_it.image()    = (*in_it).image() * frac;
+        int tx0 = timg->getX0();
+        int ty0 = timg->getY0();
+        HeavyFootprintPtrT heavy(new HeavyFootprintT(*tfoots[i]));
+        ImagePixelT* hpix = heavy->getImageArray().getData();
+        MaskPixelT* hmask = heavy->getMaskArray().getData();
+        VariancePixelT* hvar = heavy->getVarianceArray().getData();
+
+        // Walk the spans in the order the HeavyFootprint packs them,
+        // splitting each into the parts outside and inside tsum.
+        for (geom::Span const & span : *tfoots[i]->getSpans()) {
+            int y = span.getY();
+            int n = span.getX1() - span.getX0() + 1;
+            int x0 = span.getX0(), x1 = span.getX0();
+            if (y >= sumbb.getMinY() && y <= sumbb.getMaxY()) {
+                x0 = std::min(std::max(span.getX0(), sumbb.getMinX()), span.getX1() + 1);
+                x1 = std::max(std::min(span.getX1() + 1, sumbb.getMaxX() + 1), x0);
+            }
+            int nin = x1 - x0;
+            int nlo = x0 - span.getX0();
+            int nhi = n - nlo - nin;
+            std::fill(hpix, hpix + nlo, ImagePixelT(0));
+            std::fill(hmask, hmask + nlo, MaskPixelT(0));
+            std::fill(hvar, hvar + nlo, VariancePixelT(0));
+            hpix += nlo;
+            hmask += nlo;
+            hvar += nlo;
+            if (nin > 0) {
+                int const sy = y - sumy0, sx = x0 - sumx0;
+                ImagePixelT const* sptr = tsum->getArray()[sy].getData() + sx;
+                apportionRow(img.getImage()->getArray()[y - iy0].getData() + (x0 - ix0),
+                             timg->getArray()[y - ty0].getData() + (x0 - tx0),
+                             sptr,
+                             rtsum.getArray()[sy].getData() + sx,
+                             hpix, nin, sumRowHasTiny[sy]);
+                copyRowWhereSummed(img.getMask()->getArray()[y - iy0].getData() + (x0 - ix0),
+                                   sptr, hmask, nin, sumRowHasZero[sy]);
+                copyRowWhereSummed(img.getVariance()->getArray()[y - iy0].getData() + (x0 - ix0),
+                                   sptr, hvar, nin, sumRowHasZero[sy]);
+                hpix += nin;
+                hmask += nin;
+                hvar += nin;
             }
+            std::fill(hpix, hpix + nhi, ImagePixelT(0));
+            std::fill(hmask, hmask + nhi, MaskPixelT(0));
+            std::fill(hvar, hvar + nhi, VariancePixelT(0));
+            hpix += nhi;
+            hmask += nhi;
+            hvar += nhi;
         }
+        portions.push_back(heavy);
     }
 
     if (findStrayFlux) {
-        if ((ispsf.size() > 0) && (ispsf.size() != timgs.size())) {
-            throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
-                (boost::format("'ispsf' must be the same length as templates (%d vs %d)")
-                     % ispsf.size() % timgs.size()).str());
-        }
-        if ((pkx.size() != timgs.size()) || (pky.size() != timgs.size())) {
-            throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
-                (boost::format("'pkx' and 'pky' must be the same length as templates (%d,%d vs %d)")
-                    % pkx.size() % pky.size() % timgs.size()).str());
-        }
+        checkStrayFluxArgs(timgs.size(), ispsf, pkx, pky);
         _find_stray_flux(foot, tsum, img, strayFluxOptions, tfoots,
                          ispsf, pkx, pky, clipStrayFluxFraction, strays);
     }
     return portions;
 }
 
-
 /**
- This is a convenience class used in symmetrizeFootprint, wrapping the
- idea of iterating through a SpanList either forward or backward, and
- looking at dx,dy coordinates relative to a center cx,cy coordinate.
- This makes the symmetrizeFootprint code much tidier and more
- symmetric-looking; the operations on the forward and backward
- iterators are mostly the same.
+ Merge two HeavyFootprints *h1* and *h2*, as
+ lsst::afw::detection::mergeHeavyFootprints does -- the result covers
+ the union of their spans, with images and variances added and masks
+ OR-ed where they overlap, and has the peaks of *h1* followed by those of
+ *h2* -- but working span by span, without making images covering
+ their bounding box.
  */
-class RelativeSpanIterator {
-public:
-    using SpanSet = geom::SpanSet;
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+typename deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::HeavyFootprintPtrT
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+mergeHeavyFootprints(HeavyFootprintT const& h1,
+                     HeavyFootprintT const& h2) {
+    std::shared_ptr<geom::SpanSet> spans = h1.getSpans()->union_(*h2.getSpans());
+    // the peaks keep h1's schema, which may have more than the minimal fields
+    det::Footprint foot(spans, h1.getPeaks().getSchema());
+    for (det::PeakRecord const& pk : h1.getPeaks()) {
+        foot.getPeaks().push_back(foot.getPeaks().getTable()->copyRecord(pk));
+    }
+    for (det::PeakRecord const& pk : h2.getPeaks()) {
+        foot.getPeaks().push_back(foot.getPeaks().getTable()->copyRecord(pk));
+    }
+    HeavyFootprintPtrT merged(new HeavyFootprintT(foot));
+    ImagePixelT* mpix = merged->getImageArray().getData();
+    MaskPixelT* mmask = merged->getMaskArray().getData();
+    VariancePixelT* mvar = merged->getVarianceArray().getData();
+    std::size_t const area = merged->getArea();
+    std::fill(mpix, mpix + area, ImagePixelT(0));
+    std::fill(mmask, mmask + area, MaskPixelT(0));
+    std::fill(mvar, mvar + area, VariancePixelT(0));
+
+    // Both inputs' spans are sorted and each lies inside one span of the
+    // union, so a single forward walk of the union finds them all.
+    HeavyFootprintT const* inputs[2] = {&h1, &h2};
+    for (HeavyFootprintT const* h : inputs) {
+        ImagePixelT const* hpix = h->getImageArray().getData();
+        MaskPixelT const* hmask = h->getMaskArray().getData();
+        VariancePixelT const* hvar = h->getVarianceArray().getData();
+        geom::SpanSet::const_iterator u = spans->begin();
+        std::size_t uoffset = 0;
+        for (geom::Span const & span : *h->getSpans()) {
+            while (u->getY() < span.getY() ||
+                   (u->getY() == span.getY() && u->getX1() < span.getX0())) {
+                uoffset += u->getWidth();
+                ++u;
+            }
+            std::size_t k = uoffset + (span.getX0() - u->getX0());
+            for (int x = span.getX0(); x <= span.getX1(); ++x, ++k) {
+                mpix[k] += *hpix++;
+                mmask[k] |= *hmask++;
+                mvar[k] += *hvar++;
+            }
+        }
+    }
+    return merged;
+}
 
-    RelativeSpanIterator() {}
+/**
+ Find the stray pixels of footprint *foot*: those that no template
+ covers (*tsum* is not positive) and where the image *img* is positive.
+ These are the pixels whose flux apportionFlux treats as stray.
+
+ Each span is scanned in two passes.  The first flags every pixel, with
+ no branches, so that the comparisons vectorize.  The second turns the
+ runs of flags into spans.  The result is in the order of *foot*'s
+ spans, which is the order the stray flux is assigned in.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::shared_ptr<geom::SpanSet>
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+findStrayPixels(det::Footprint const& foot,
+                ImageT const& tsum,
+                MaskedImageT const& img) {
+    if (!tsum.getBBox().contains(foot.getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+                          "Template sum image MUST contain parent footprint");
+    }
+    if (!img.getBBox().contains(foot.getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::RuntimeError,
+                          "Image bbox MUST contain parent footprint");
+    }
+    int const ix0 = img.getX0();
+    int const iy0 = img.getY0();
+    int const sumx0 = tsum.getX0();
+    int const sumy0 = tsum.getY0();
 
-    RelativeSpanIterator(SpanSet::const_iterator const& real,
-                         SpanSet const& arr,
-                         int cx, int cy, bool forward=true)
-        : _real(real), _cx(cx), _cy(cy), _forward(forward)
-        {
-            if (_forward) {
-                _end = arr.end();
+    std::vector<geom::Span> spans;
+    std::vector<unsigned char> flag(foot.getBBox().getWidth());
+    for (geom::Span const & s : *foot.getSpans()) {
+        int const y = s.getY();
+        int const x0 = s.getX0();
+        int const n = s.getWidth();
+        ImagePixelT const* sumrow = tsum.getArray()[y - sumy0].getData() + (x0 - sumx0);
+        ImagePixelT const* imrow = img.getImage()->getArray()[y - iy0].getData() + (x0 - ix0);
+        for (int j = 0; j < n; ++j) {
+            flag[j] = !(sumrow[j] > 0) & !(imrow[j] <= 0);
+        }
+        int j = 0;
+        while (j < n) {
+            if (!flag[j]) {
+                ++j;
+                continue;
+            }
+            int const start = j;
+            while (j < n && flag[j]) {
+                ++j;
+            }
+            if (!spans.empty() && spans.back().getY() == y && spans.back().getX1() + 1 == x0 + start) {
+                spans.back() = geom::Span(y, spans.back().getX0(), x0 + j - 1);
             } else {
-                _end = arr.begin();
+                spans.push_back(geom::Span(y, x0 + start, x0 + j - 1));
             }
         }
+    }
+    // already sorted and merged, as long as foot's spans are
+    return std::make_shared<geom::SpanSet>(std::move(spans), false);
+}
 
-    bool operator==(const SpanSet::const_iterator & other) {
-        return _real == other;
+/**
+ Find the pixels of footprint *foot* that have the EDGE bit set in the
+ mask of *img*.  buildSymmetricTemplate with *patchEdge* checks each
+ peak's template footprint against these; finding them once per parent
+ saves scanning the mask again for every peak.  For most parents the
+ result is empty.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::shared_ptr<geom::SpanSet>
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+findEdgeMaskPixels(MaskedImageT const& img,
+                   det::Footprint const& foot) {
+    if (!img.getBBox(image::PARENT).contains(foot.getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Image too small for footprint");
     }
-    bool operator!=(const SpanSet::const_iterator & other) {
-        return _real != other;
+    MaskPtrT mask = img.getMask();
+    MaskPixelT const edgebit = mask->getPlaneBitMask("EDGE");
+    int const mx0 = mask->getX0();
+    int const my0 = mask->getY0();
+
+    std::vector<geom::Span> spans;
+    for (geom::Span const & s : *foot.getSpans()) {
+        int const y = s.getY();
+        int const x0 = s.getX0();
+        int const n = s.getWidth();
+        MaskPixelT const* mrow = mask->getArray()[y - my0].getData() + (x0 - mx0);
+        int j = 0;
+        while (j < n) {
+            if (!(mrow[j] & edgebit)) {
+                ++j;
+                continue;
+            }
+            int const start = j;
+            while (j < n && (mrow[j] & edgebit)) {
+                ++j;
+            }
+            if (!spans.empty() && spans.back().getY() == y && spans.back().getX1() + 1 == x0 + start) {
+                spans.back() = geom::Span(y, spans.back().getX0(), x0 + j - 1);
+            } else {
+                spans.push_back(geom::Span(y, x0 + start, x0 + j - 1));
+            }
+        }
     }
-    bool operator<=(const SpanSet::const_iterator & other) {
-        return _real <= other;
+    // already sorted and merged, as long as foot's spans are
+    return std::make_shared<geom::SpanSet>(std::move(spans), false);
+}
+
+
+/**
+ Index the spans of *spans* by row.  The spans must be sorted and
+ merged, as they are in a normalized SpanSet.
+ */
+deblend::SpanIndex::SpanIndex(std::shared_ptr<geom::SpanSet const> spans)
+    : _spans(spans), _y0(0), _rows(1, 0) {
+    if (_spans->size() == 0) {
+        return;
     }
-    bool operator<(const SpanSet::const_iterator & other) {
-        return _real < other;
+    geom::Box2I const bb = _spans->getBBox();
+    _y0 = bb.getMinY();
+    // count the spans in each row, then accumulate
+    _rows.assign(bb.getHeight() + 1, 0);
+    for (geom::Span const & sp : *_spans) {
+        ++_rows[sp.getY() - _y0 + 1];
     }
-    bool operator>=(const SpanSet::const_iterator & other) {
-        return _real >= other;
+    std::partial_sum(_rows.begin(), _rows.end(), _rows.begin());
+}
+
+deblend::SpanIndex::const_iterator
+deblend::SpanIndex::rowBegin(int y) const {
+    if ((y < _y0) || (y >= _y0 + static_cast<int>(_rows.size()) - 1)) {
+        return _spans->end();
     }
-    bool operator>(const SpanSet::const_iterator & other) {
-        return _real > other;
+    return _spans->begin() + _rows[y - _y0];
+}
+
+deblend::SpanIndex::const_iterator
+deblend::SpanIndex::rowEnd(int y) const {
+    if ((y < _y0) || (y >= _y0 + static_cast<int>(_rows.size()) - 1)) {
+        return _spans->end();
     }
+    return _spans->begin() + _rows[y - _y0 + 1];
+}
 
-    bool operator==(RelativeSpanIterator & other) {
-        return (_real == other._real) &&
-            (_cx == other._cx) && (_cy == other._cy) &&
-            (_forward == other._forward);
+deblend::SpanIndex::const_iterator
+deblend::SpanIndex::findSpan(int x, int y) const {
+    const_iterator end = rowEnd(y);
+    // the last span in the row starting at or before x
+    const_iterator sp = std::upper_bound(rowBegin(y), end, x,
+                                         [](int x, geom::Span const & sp) {
+                                             return x < sp.getX0();
+                                         });
+    if ((sp == rowBegin(y)) || ((sp - 1)->getX1() < x)) {
+        return _spans->end();
     }
-    bool operator!=(RelativeSpanIterator & other) {
-        return !(*this == other);
+    return sp - 1;
+}
+
+/**
+ Find the edge pixels: those with a neighbour above, below, left or
+ right that is not in the SpanSet.  This gives the same pixels as
+ SpanSet::findEdgePixels, without eroding the whole SpanSet.
+ */
+std::shared_ptr<geom::SpanSet>
+deblend::SpanIndex::findEdgePixels() const {
+    std::vector<geom::Span> edges;
+    std::vector<std::pair<int, int> > above, inside;
+    for (geom::Span const & sp : *_spans) {
+        int const y = sp.getY();
+        // The interior pixels: not at either end of the span (which is
+        // merged), and covered by the rows above and below.
+        above.clear();
+        inside.clear();
+        appendRowOverlap(sp.getX0() + 1, sp.getX1() - 1, rowBegin(y - 1), rowEnd(y - 1), above);
+        for (std::pair<int, int> const & a : above) {
+            appendRowOverlap(a.first, a.second, rowBegin(y + 1), rowEnd(y + 1), inside);
+        }
+        // The edge pixels are the rest.
+        int x = sp.getX0();
+        for (std::pair<int, int> const & in : inside) {
+            edges.push_back(geom::Span(y, x, in.first - 1));
+            x = in.second + 1;
+        }
+        edges.push_back(geom::Span(y, x, sp.getX1()));
     }
+    return std::make_shared<geom::SpanSet>(std::move(edges), false);
+}
 
-    RelativeSpanIterator operator++() {
-        if (_forward) {
-            _real++;
-        } else {
-            _real--;
+/**
+ Bin the non-empty *boxes* on a grid of square cells covering them all,
+ *cellSize* pixels on a side; if it is zero, the mean width and height
+ of the boxes, made coarser if need be so there are not many more cells
+ than boxes.
+ */
+deblend::BoxIndex::BoxIndex(std::vector<geom::Box2I> const& boxes, int cellSize)
+    : _boxes(boxes), _cellSize(cellSize), _x0(0), _y0(0), _nx(0), _ny(0) {
+    if (cellSize < 0) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "BoxIndex cellSize must not be negative");
+    }
+    geom::Box2I all;
+    double extent = 0.;
+    int n = 0;
+    for (geom::Box2I const & box : _boxes) {
+        if (box.isEmpty()) {
+            continue;
+        }
+        all.include(box);
+        extent += box.getWidth() + box.getHeight();
+        ++n;
+    }
+    if (_cellSize == 0) {
+        _cellSize = (n == 0) ? 1 : std::max(1, static_cast<int>(std::ceil(extent/(2*n))));
+        while ((n > 0) &&
+               (static_cast<double>((all.getWidth() + _cellSize - 1)/_cellSize)*
+                ((all.getHeight() + _cellSize - 1)/_cellSize) > 4*n + 16)) {
+            _cellSize *= 2;
         }
-        return *this;
     }
-    RelativeSpanIterator operator++(int dummy) {
-        RelativeSpanIterator result = *this;
-        ++(*this);
-        return result;
+    if (n == 0) {
+        return;
+    }
+    _x0 = all.getMinX();
+    _y0 = all.getMinY();
+    _nx = (all.getWidth() + _cellSize - 1)/_cellSize;
+    _ny = (all.getHeight() + _cellSize - 1)/_cellSize;
+    _cells.resize(static_cast<std::size_t>(_nx)*_ny);
+    for (int i = 0; i < static_cast<int>(_boxes.size()); ++i) {
+        geom::Box2I const range = _cellRange(_boxes[i]);
+        for (int cy = range.getMinY(); cy <= range.getMaxY(); ++cy) {
+            for (int cx = range.getMinX(); cx <= range.getMaxX(); ++cx) {
+                _cells[cy*_nx + cx].push_back(i);
+            }
+        }
     }
+}
 
-    bool notDone() {
-        if (_forward) {
-            return _real < _end;
-        } else {
-            return _real >= _end;
+/**
+ The cells, as a box of cell indices, that *box* covers; empty if it
+ misses the grid.
+ */
+geom::Box2I
+deblend::BoxIndex::_cellRange(geom::Box2I const& box) const {
+    if (box.isEmpty() || (_nx == 0)) {
+        return geom::Box2I();
+    }
+    int const x0 = std::max(box.getMinX() - _x0, 0);
+    int const y0 = std::max(box.getMinY() - _y0, 0);
+    int const x1 = std::min(box.getMaxX() - _x0, _nx*_cellSize - 1);
+    int const y1 = std::min(box.getMaxY() - _y0, _ny*_cellSize - 1);
+    if ((x0 > x1) || (y0 > y1)) {
+        return geom::Box2I();
+    }
+    return geom::Box2I(geom::Point2I(x0/_cellSize, y0/_cellSize),
+                       geom::Point2I(x1/_cellSize, y1/_cellSize));
+}
+
+std::vector<int>
+deblend::BoxIndex::query(geom::Box2I const& box) const {
+    std::vector<int> found;
+    geom::Box2I const range = _cellRange(box);
+    for (int cy = range.getMinY(); cy <= range.getMaxY(); ++cy) {
+        for (int cx = range.getMinX(); cx <= range.getMaxX(); ++cx) {
+            for (int i : _cells[cy*_nx + cx]) {
+                if (_boxes[i].overlaps(box)) {
+                    found.push_back(i);
+                }
+            }
         }
     }
+    // a box may be in several of the cells
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+}
 
-    int dxlo() {
-        if (_forward) {
-            return _real->getX0() - _cx;
-        } else {
-            return _cx - _real->getX1();
+/**
+ Find the pairs of overlapping boxes.  Two boxes that overlap share all
+ the cells their overlap covers; the pair is taken from just one of
+ them, the cell holding the overlap's first corner.
+ */
+std::vector<std::pair<int, int> >
+deblend::BoxIndex::getOverlappingPairs() const {
+    std::vector<std::pair<int, int> > pairs;
+    for (int cy = 0; cy < _ny; ++cy) {
+        for (int cx = 0; cx < _nx; ++cx) {
+            std::vector<int> const & cell = _cells[cy*_nx + cx];
+            for (std::size_t a = 0; a < cell.size(); ++a) {
+                geom::Box2I const & bi = _boxes[cell[a]];
+                for (std::size_t b = a + 1; b < cell.size(); ++b) {
+                    geom::Box2I const & bj = _boxes[cell[b]];
+                    if (!bi.overlaps(bj)) {
+                        continue;
+                    }
+                    int const x = std::max(bi.getMinX(), bj.getMinX()) - _x0;
+                    int const y = std::max(bi.getMinY(), bj.getMinY()) - _y0;
+                    if ((x/_cellSize == cx) && (y/_cellSize == cy)) {
+                        pairs.push_back(std::make_pair(cell[a], cell[b]));
+                    }
+                }
+            }
         }
     }
-    int dxhi() {
-        if (_forward) {
-            return _real->getX1() - _cx;
-        } else {
-            return _cx - _real->getX0();
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+}
+
+/**
+ Cache the images of *psf*: by the position, snapped to a grid of
+ *gridSize* pixels if it is positive (and interpolated between the grid
+ points if *interpolate*), keeping the most recently used images within
+ *maxBytes*.
+ */
+deblend::PsfImageCache::PsfImageCache(std::shared_ptr<det::Psf const> psf,
+                                      double gridSize, std::size_t maxBytes,
+                                      bool interpolate)
+    : _psf(psf), _gridSize(gridSize), _maxBytes(maxBytes), _interpolate(interpolate),
+      _bytes(0), _hits(0), _misses(0) {
+    if (!_psf) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError, "PsfImageCache needs a PSF");
+    }
+    if (!(_gridSize >= 0.)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "PsfImageCache gridSize must not be negative");
+    }
+    if (_interpolate && (_gridSize == 0.)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                          "PsfImageCache can only interpolate on a grid");
+    }
+}
+
+std::shared_ptr<deblend::PsfImageCache::Image const>
+deblend::PsfImageCache::_lookup(Key const& key) const {
+    std::map<Key, LruList::iterator>::iterator const found = _index.find(key);
+    if (found != _index.end()) {
+        ++_hits;
+        _lru.splice(_lru.begin(), _lru, found->second);
+        return found->second->second;
+    }
+    ++_misses;
+    std::shared_ptr<Image const> img = _psf->computeImage(geom::Point2D(key.first, key.second));
+    _lru.emplace_front(key, img);
+    _index[key] = _lru.begin();
+    _bytes += sizeof(double)*img->getWidth()*img->getHeight();
+    // drop the least recently used, always keeping this one
+    while ((_bytes > _maxBytes) && (_lru.size() > 1)) {
+        Image const& old = *_lru.back().second;
+        _bytes -= sizeof(double)*old.getWidth()*old.getHeight();
+        _index.erase(_lru.back().first);
+        _lru.pop_back();
+    }
+    return img;
+}
+
+/**
+ The PSF image at *position*: computed there, or at the nearest grid
+ point, or interpolated between the four grid points around it.
+
+ A grid point's image is moved by the whole number of pixels nearest
+ to the offset from the grid point to *position*, so that it is centred
+ within half a pixel of *position* however coarse the grid; on grids
+ coarser than a pixel that sub-pixel error is accepted.  Interpolation
+ blends the grid points' images so moved, and the result is placed as
+ the PSF's own image at *position* would be: on the pixel containing
+ it.
+ */
+std::shared_ptr<deblend::PsfImageCache::Image const>
+deblend::PsfImageCache::computeImage(geom::Point2D const& position) const {
+    double x = position.getX();
+    double y = position.getY();
+    // as Psf::computeImage, for the null point
+    if (std::isnan(x) || std::isnan(y)) {
+        geom::Point2D const avg = _psf->getAveragePosition();
+        x = avg.getX();
+        y = avg.getY();
+    }
+    if (_gridSize == 0.) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _lookup(Key(x, y));
+    }
+    // the whole-pixel move taking a grid point's image towards position
+    auto shiftFrom = [x, y](Key const& node) {
+        return geom::Extent2I(static_cast<int>(std::round(x - node.first)),
+                              static_cast<int>(std::round(y - node.second)));
+    };
+    double const gx = x/_gridSize;
+    double const gy = y/_gridSize;
+    if (!_interpolate) {
+        Key const node(std::round(gx)*_gridSize, std::round(gy)*_gridSize);
+        std::shared_ptr<Image const> img;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            img = _lookup(node);
+        }
+        geom::Extent2I const shift = shiftFrom(node);
+        if ((shift.getX() == 0) && (shift.getY() == 0)) {
+            return img;
         }
+        // shares the cached pixels
+        std::shared_ptr<Image> moved = std::make_shared<Image>(*img, false);
+        moved->setXY0(img->getXY0() + shift);
+        return moved;
     }
-    int dy() {
-        return std::abs(_real->getY() - _cy);
+
+    double const fx = std::floor(gx);
+    double const fy = std::floor(gy);
+    double const tx = gx - fx;
+    double const ty = gy - fy;
+    Key nodes[4];
+    double weights[4];
+    std::shared_ptr<Image const> imgs[4];
+    int n = 0;
+    for (int j = 0; j < 2; ++j) {
+        for (int i = 0; i < 2; ++i) {
+            double const w = (i ? tx : 1. - tx)*(j ? ty : 1. - ty);
+            if (w > 0.) {
+                nodes[n] = Key((fx + i)*_gridSize, (fy + j)*_gridSize);
+                weights[n] = w;
+                ++n;
+            }
+        }
     }
-    int x0() {
-        return _real->getX0();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (int k = 0; k < n; ++k) {
+            imgs[k] = _lookup(nodes[k]);
+        }
     }
-    int x1() {
-        return _real->getX1();
+    int const nearest = std::max_element(weights, weights + n) - weights;
+    // Psf images are centred on the pixel containing the position
+    geom::Extent2I const shift(
+        static_cast<int>(std::floor(x + 0.5)) - static_cast<int>(std::floor(nodes[nearest].first + 0.5)),
+        static_cast<int>(std::floor(y + 0.5)) - static_cast<int>(std::floor(nodes[nearest].second + 0.5)));
+    if ((n == 1) && (shift.getX() == 0) && (shift.getY() == 0)) {
+        return imgs[0];
     }
-    int y() {
-        return _real->getY();
+    geom::Box2I const bbox(imgs[nearest]->getBBox(image::PARENT).getMin() + shift,
+                           imgs[nearest]->getDimensions());
+    std::shared_ptr<Image> result = std::make_shared<Image>(bbox);
+    *result = 0.;
+    for (int k = 0; k < n; ++k) {
+        Image const& img = *imgs[k];
+        geom::Extent2I const ks = shiftFrom(nodes[k]);
+        // img's pixel (xx - ks.x, yy - ks.y) lands on result's (xx, yy)
+        geom::Box2I overlap(img.getBBox(image::PARENT).getMin() + ks, img.getDimensions());
+        overlap.clip(bbox);
+        if (overlap.isEmpty()) {
+            continue;
+        }
+        for (int yy = overlap.getMinY(); yy <= overlap.getMaxY(); ++yy) {
+            double const* in = img.getArray()[yy - ks.getY() - img.getY0()].getData()
+                - img.getX0() - ks.getX();
+            double* out = result->getArray()[yy - bbox.getMinY()].getData() - bbox.getMinX();
+            for (int xx = overlap.getMinX(); xx <= overlap.getMaxX(); ++xx) {
+                out[xx] += weights[k]*in[xx];
+            }
+        }
     }
+    return result;
+}
+
+std::size_t
+deblend::PsfImageCache::getBytes() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _bytes;
+}
 
-private:
-    SpanSet::const_iterator _real;
-    SpanSet::const_iterator _end;
-    int _cx;
-    int _cy;
-    bool _forward;
-};
+std::size_t
+deblend::PsfImageCache::getHits() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _hits;
+}
+
+std::size_t
+deblend::PsfImageCache::getMisses() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _misses;
+}
 
+void
+deblend::PsfImageCache::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _lru.clear();
+    _index.clear();
+    _bytes = 0;
+}
 
 /*
  // Check symmetrizeFootprint by computing truth naively.
@@ -973,197 +3488,84 @@ deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
 symmetrizeFootprint(
     det::Footprint const& foot,
     int cx, int cy) {
+    return symmetrizeFootprint(foot, SpanIndex(foot.getSpans()), cx, cy);
+}
+
+/**
+ As above, with the spans of *foot* already indexed in *index*.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+PTR(lsst::afw::detection::Footprint)
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+symmetrizeFootprint(
+    det::Footprint const& foot,
+    SpanIndex const& index,
+    int cx, int cy) {
 
     auto sfoot = std::make_shared<det::Footprint>();
     sfoot->setPeakSchema(foot.getPeaks().getSchema());
-    geom::SpanSet const & spans = *foot.getSpans();
 
     LOG_LOGGER _log = LOG_GET("meas.deblender.symmetrizeFootprint");
 
     // Find the Span containing the peak.
-    geom::Span target(cy, cx, cx);
-    geom::SpanSet::const_iterator peakspan =
-        std::upper_bound(spans.begin(), spans.end(), target, span_compare);
-    // upper_bound returns the last position where "target" could be inserted;
-    // ie, the first Span larger than "target".  The Span containing "target"
-    // should be peakspan-1 or (if the peak is on the first pixel in the span,
-    // peakspan.
-    geom::Span sp;
-    if (peakspan == spans.begin()) {
-        sp = *peakspan;
-        if (!sp.contains(cx, cy)) {
-            LOGL_WARN(_log,
-                "Failed to find span containing (%i,%i): before the beginning of this footprint", cx, cy);
-            return PTR(det::Footprint)();
-        }
-    } else {
-        --peakspan;
-        sp = *peakspan;
-
-        if (!sp.contains(cx, cy)) {
-            ++peakspan;
-            sp = *peakspan;
-            if (!sp.contains(cx, cy)) {
-                geom::Box2I fbb = foot.getBBox();
-                LOGL_WARN(_log, "Failed to find span containing (%i,%i): nearest is %i, [%i,%i].  "
-                          "Footprint bbox is [%i,%i],[%i,%i]",
-                          cx, cy, sp.getY(), sp.getX0(), sp.getX1(),
-                          fbb.getMinX(), fbb.getMaxX(), fbb.getMinY(), fbb.getMaxY());
-                return PTR(det::Footprint)();
-            }
-        }
+    geom::SpanSet::const_iterator peakspan = index.findSpan(cx, cy);
+    if (peakspan == index.getSpans().end()) {
+        geom::Box2I fbb = foot.getBBox();
+        LOGL_WARN(_log, "Failed to find span containing (%i,%i).  "
+                  "Footprint bbox is [%i,%i],[%i,%i]",
+                  cx, cy, fbb.getMinX(), fbb.getMaxX(), fbb.getMinY(), fbb.getMaxY());
+        return PTR(det::Footprint)();
     }
     LOGL_DEBUG(_log, "Span containing (%i,%i): (x=[%i,%i], y=%i)",
-               cx, cy, sp.getX0(), sp.getX1(), sp.getY());
+               cx, cy, peakspan->getX0(), peakspan->getX1(), peakspan->getY());
 
     // The symmetric templates are essentially an AND of the footprint
     // pixels and its 180-degree-rotated self, rotated around the
     // peak (cx,cy).
     //
-    // We iterate forward and backward simultaneously, starting from
-    // the span containing the peak and moving out, row by row.
-    //
-    // In the loop below, we search for the next pair of Spans that
-    // overlap (in "dx" from the center), output the overlapping
-    // portion of the Spans, and advance either the "fwd" or "back"
-    // iterator.  When we fail to find an overlapping pair of Spans,
-    // we move on to the next row.
-    //
-    // [The following paragraph is somewhat obsoleted by the
-    // RelativeSpanIterator class, which performs some of the renaming
-    // and the dx,dy coords.]
-    //
-    // '''In reading the code, "forward", "advancing", etc, are all
-    // from the perspective of the "fwd" iterator (the one going
-    // forward through the Span list, from low to high Y and then low
-    // to high X).  It will help to imagine making a copy of the
-    // footprint and rotating it around the center pixel by 180
-    // degrees, so that "fwd" and "back" are both iterating the same
-    // direction; we're then just finding the AND of those two
-    // iterators, except we have to work in dx,dy coordinates rather
-    // than original x,y coords, and the accessors for "back" are
-    // opposite.'''
-
-    RelativeSpanIterator fwd (peakspan, spans, cx, cy, true);
-    RelativeSpanIterator back(peakspan, spans, cx, cy, false);
-
-    int dy = 0;
+    // For each dy, we fetch the "forward" row cy + dy and the
+    // "backward" row cy - dy from the index.  In "dx" coordinates
+    // from the center, the forward row's spans run left to right and
+    // the backward row's spans run right to left, so walking the
+    // forward row forward and the backward row backward visits both
+    // in increasing dx.  We output the overlapping portion of each
+    // pair of Spans, and advance whichever ends first.
+    geom::Box2I const bb = index.getBBox();
+    int const maxdy = std::min(bb.getMaxY() - cy, cy - bb.getMinY());
     std::vector<geom::Span> tmpSpans;
-    while (fwd.notDone() && back.notDone()) {
+    for (int dy = 0; dy <= maxdy; ++dy) {
         // forward and backward "y"; just symmetric around cy
-        int fy = cy + dy;
-        int by = cy - dy;
-        // delta-x of the beginnings of the spans, for "fwd" and "back"
-        int fdxlo =  fwd.dxlo();
-        int bdxlo = back.dxlo();
-
-        // First find:
-        //    fend -- first span in the next row, or end(); ie,
-        //            the end of this row in the forward direction
-        //    bend -- the end of this row in the backward direction
-        RelativeSpanIterator fend, bend;
-        for (fend = fwd; fend.notDone(); ++fend) {
-            if (fend.dy() != dy)
-                break;
-        }
-        for (bend = back; bend.notDone(); ++bend) {
-            if (bend.dy() != dy)
-                break;
-        }
-
-        LOGL_DEBUG(_log, "dy=%i, fy=%i, fx=[%i, %i],   by=%i, fx=[%i, %i],  fdx=%i, bdx=%i",
-                   dy, fy, fwd.x0(), fwd.x1(), by, back.x0(), back.x1(),
-                   fdxlo, bdxlo);
-
-        // Find possibly-overlapping span
-        if (bdxlo > fdxlo) {
-            LOGL_DEBUG(_log, "Advancing forward.");
-            // While the "forward" span is entirely to the "left" of the "backward" span,
-            // (in dx coords), ie, |---fwd---X   X---back---|
-            // and we are comparing the edges marked X
-            while ((fwd != fend) && (fwd.dxhi() < bdxlo)) {
-                fwd++;
-                if (fwd == fend) {
-                    LOGL_DEBUG(_log, "Reached fend");
-                } else {
-                    LOGL_DEBUG(_log, "Advanced to forward span %i, [%i, %i]",
-                               fy, fwd.x0(), fwd.x1());
-                }
-            }
-        } else if (fdxlo > bdxlo) {
-            LOGL_DEBUG(_log, "Advancing backward.");
-            // While the "backward" span is entirely to the "left" of the "foreward" span,
-            // (in dx coords), ie, |---back---X   X---fwd---|
-            // and we are comparing the edges marked X
-            while ((back != bend) && (back.dxhi() < fdxlo)) {
-                back++;
-                if (back == bend) {
-                    LOGL_DEBUG(_log, "Reached bend");
-                } else {
-                    LOGL_DEBUG(_log, "Advanced to backward span %i, [%i, %i]",
-                               by, back.x0(), back.x1());
+        int const fy = cy + dy;
+        int const by = cy - dy;
+        geom::SpanSet::const_iterator fwd  = index.rowBegin(fy);
+        geom::SpanSet::const_iterator fend = index.rowEnd(fy);
+        // "back" is one past the backward span being looked at
+        geom::SpanSet::const_iterator back = index.rowEnd(by);
+        geom::SpanSet::const_iterator bend = index.rowBegin(by);
+        while ((fwd != fend) && (back != bend)) {
+            geom::Span const & bsp = *(back - 1);
+            int const fdxlo = fwd->getX0() - cx;
+            int const fdxhi = fwd->getX1() - cx;
+            int const bdxlo = cx - bsp.getX1();
+            int const bdxhi = cx - bsp.getX0();
+            int const dxlo = std::max(fdxlo, bdxlo);
+            int const dxhi = std::min(fdxhi, bdxhi);
+            if (dxlo <= dxhi) {
+                LOGL_DEBUG(_log, "Adding span fwd %i, [%i, %i],  back %i, [%i, %i]",
+                           fy, cx+dxlo, cx+dxhi, by, cx-dxhi, cx-dxlo);
+                tmpSpans.push_back(geom::Span(fy, cx + dxlo, cx + dxhi));
+                // in the peak's row, the mirror is found from the other side too
+                if (dy > 0) {
+                    tmpSpans.push_back(geom::Span(by, cx - dxhi, cx - dxlo));
                 }
             }
-        }
-
-        if ((back == bend) || (fwd == fend)) {
-            // We reached the end of the row without finding spans that could
-            // overlap.  Move onto the next dy.
-            if (back == bend) {
-                LOGL_DEBUG(_log, "Reached bend");
-            }
-            if (fwd == fend) {
-                LOGL_DEBUG(_log, "Reached fend");
-            }
-            back = bend;
-            fwd  = fend;
-            dy++;
-            continue;
-        }
-
-        // Spans may overlap -- find the overlapping part.
-        int dxlo = std::max(fwd.dxlo(), back.dxlo());
-        int dxhi = std::min(fwd.dxhi(), back.dxhi());
-        if (dxlo <= dxhi) {
-            LOGL_DEBUG(_log, "Adding span fwd %i, [%i, %i],  back %i, [%i, %i]",
-                       fy, cx+dxlo, cx+dxhi, by, cx-dxhi, cx-dxlo);
-            tmpSpans.push_back(geom::Span(fy, cx + dxlo, cx + dxhi));
-            tmpSpans.push_back(geom::Span(by, cx - dxhi, cx - dxlo));
-        }
-
-        // Advance the one whose "hi" edge is smallest
-        if (fwd.dxhi() < back.dxhi()) {
-            fwd++;
-            if (fwd == fend) {
-                LOGL_DEBUG(_log, "Stepped to fend");
-            } else {
-                LOGL_DEBUG(_log, "Stepped forward to span %i, [%i, %i]",
-                           fwd.y(), fwd.x0(), fwd.x1());
-            }
-        } else {
-            back++;
-            if (back == bend) {
-                LOGL_DEBUG(_log, "Stepped to bend");
+            // Advance the one whose "hi" edge is smallest
+            if (fdxhi < bdxhi) {
+                ++fwd;
             } else {
-                LOGL_DEBUG(_log, "Stepped backward to span %i, [%i, %i]",
-                           back.y(), back.x0(), back.x1());
-            }
-        }
-
-        if ((back == bend) || (fwd == fend)) {
-            // Reached the end of the row.  On to the next dy!
-            if (back == bend) {
-                LOGL_DEBUG(_log, "Reached bend");
-            }
-            if (fwd == fend) {
-                LOGL_DEBUG(_log, "Reached fend");
+                --back;
             }
-            back = bend;
-            fwd  = fend;
-            dy++;
-            continue;
         }
-
     }
     sfoot->setSpans(std::make_shared<geom::SpanSet>(std::move(tmpSpans)));
     return sfoot;
@@ -1193,185 +3595,319 @@ buildSymmetricTemplate(
     bool minZero,
     bool patchEdge,
     bool* patchedEdges) {
+    PTR(geom::SpanSet) edgePixels = std::make_shared<geom::SpanSet>();
+    if (patchEdge) {
+        edgePixels = findEdgeMaskPixels(img, foot);
+    }
+    return buildSymmetricTemplate(img, foot, SpanIndex(foot.getSpans()), *edgePixels, peak, sigma1,
+                                  minZero, patchEdge, patchedEdges);
+}
 
-    typedef typename MaskedImageT::const_xy_locator xy_loc;
+/**
+ As above, with the per-parent work done once for all its peaks: the
+ spans of *foot* indexed in *index*, and its pixels with the EDGE
+ mask bit set in *edgePixels* (see findEdgeMaskPixels; only used if
+ *patchEdge* is true).
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::pair<typename PTR(lsst::afw::image::Image<ImagePixelT>),
+          typename PTR(lsst::afw::detection::Footprint) >
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+buildSymmetricTemplate(
+    MaskedImageT const& img,
+    det::Footprint const& foot,
+    SpanIndex const& index,
+    geom::SpanSet const& edgePixels,
+    det::PeakRecord const& peak,
+    double sigma1,
+    bool minZero,
+    bool patchEdge,
+    bool* patchedEdges) {
 
     *patchedEdges = false;
 
     int cx = peak.getIx();
     int cy = peak.getIy();
 
-    LOG_LOGGER _log = LOG_GET("meas.deblender.symmetricFootprint");
+    if (!img.getBBox(image::PARENT).contains(foot.getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Image too small for footprint");
+    }
+
+    FootprintPtrT sfoot = symmetrizeFootprint(foot, index, cx, cy);
+
+    if (!sfoot) {
+        return std::pair<ImagePtrT, FootprintPtrT>(ImagePtrT(), sfoot);
+    }
+
+    if (!img.getBBox(image::PARENT).contains(sfoot->getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                          "Image too small for symmetrized footprint");
+    }
+
+    ImagePtrT theimg = img.getImage();
+    return symmetricTemplate(ImageRows<ImagePixelT>(*theimg), foot, sfoot, edgePixels, cx, cy,
+                             minZero, patchEdge, patchedEdges);
+}
+
+/**
+ Build the symmetric templates (see buildSymmetricTemplate) for all the
+ *peaks* of parent footprint *foot* in one call, sharing the per-parent
+ work between them.  Peaks with *skip* set are passed over; *skip* may
+ be empty, or else MUST be the same length as *peaks*.
+
+ On return, *templates*, *tfoots* and *patchedEdges* have one entry
+ per peak; the template and footprint are null if the peak was skipped
+ or its template could not be built.
+
+ With *nThreads* > 1, the peaks are shared among that many threads.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+buildSymmetricTemplates(
+    MaskedImageT const& img,
+    det::Footprint const& foot,
+    det::PeakCatalog const& peaks,
+    std::vector<bool> const& skip,
+    double sigma1,
+    bool minZero,
+    bool patchEdge,
+    std::vector<ImagePtrT> & templates,
+    std::vector<FootprintPtrT> & tfoots,
+    std::vector<bool> & patchedEdges,
+    int nThreads) {
+
+    std::size_t const npeaks = peaks.size();
+    if (skip.size() && (skip.size() != npeaks)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                          "skip must be empty or the same length as peaks");
+    }
+    if (!img.getBBox(image::PARENT).contains(foot.getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Image too small for footprint");
+    }
+
+    SpanIndex const index(foot.getSpans());
+    PTR(geom::SpanSet) edgePixels = std::make_shared<geom::SpanSet>();
+    if (patchEdge) {
+        edgePixels = findEdgeMaskPixels(img, foot);
+    }
+
+    templates.assign(npeaks, ImagePtrT());
+    tfoots.assign(npeaks, FootprintPtrT());
+    // not vector<bool>, whose elements can't be written from different threads
+    std::vector<char> patched(npeaks, 0);
 
+    parallelFor(npeaks, nThreads, [&](std::size_t i, int) {
+        if (skip.size() && skip[i]) {
+            return;
+        }
+        bool p = false;
+        std::pair<ImagePtrT, FootprintPtrT> result =
+            buildSymmetricTemplate(img, foot, index, *edgePixels, peaks[i], sigma1,
+                                   minZero, patchEdge, &p);
+        templates[i] = result.first;
+        tfoots[i] = result.second;
+        patched[i] = p;
+    });
+    patchedEdges.assign(patched.begin(), patched.end());
+}
+
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+deblend::TemplatePipeline<ImagePixelT,MaskPixelT,VariancePixelT>::
+TemplatePipeline()
+    : patchEdges(false),
+      rampFluxAtEdge(false),
+      medianSmoothTemplate(true),
+      medianFilterHalfsize(2),
+      medianFilterFootprint(false),
+      monotonicTemplate(true),
+      monotonicRadial(false),
+      clipFootprintToNonzero(true),
+      nThreads(1) {}
+
+/**
+ Build the templates for the *peaks* of parent footprint *foot* in
+ image *img*, running each through the stages that are switched on:
+ the symmetric template (see BaselineUtils::buildSymmetricTemplate),
+ ramping it if it has flux above 3 *sigma1* at its edge (see
+ BaselineUtils::rampFluxAtEdge; *psf* and *psffwhm* are only used
+ for this), median smoothing, making it monotonic, and clipping its
+ footprint to its nonzero pixels.  This gives the same templates as
+ the separate plugins, but each template stays in the one image
+ throughout, and the scratch space the stages need is reused from one
+ peak to the next.
+
+ Peaks with *skip* set are passed over; *skip* may be empty, or else
+ MUST be the same length as *peaks*.  On return, *templates*, *tfoots*,
+ *patchedEdges* and *rampedEdges* have one entry per peak; the template
+ and footprint are null if the peak was skipped or its symmetric
+ template could not be built.  They are also null, with *rampedEdges*
+ set, if the template needed ramping but a CoaddPsf could not be
+ evaluated at the parent, as plugins.rampFluxAtEdge marks such peaks
+ out of bounds.  If *symmetricTemplates* is given, it gets a copy of
+ each symmetric template as it was before the later stages, and
+ *symmetricFootprints*, if given, a copy of its footprint.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::TemplatePipeline<ImagePixelT,MaskPixelT,VariancePixelT>::
+run(MaskedImageT const& img,
+    det::Footprint const& foot,
+    det::PeakCatalog const& peaks,
+    std::vector<bool> const& skip,
+    double sigma1,
+    PTR(PsfImageCache const) psf,
+    double psffwhm,
+    std::vector<ImagePtrT> & templates,
+    std::vector<FootprintPtrT> & tfoots,
+    std::vector<bool> & patchedEdges,
+    std::vector<bool> & rampedEdges,
+    std::vector<ImagePtrT> * symmetricTemplates,
+    std::vector<FootprintPtrT> * symmetricFootprints) const {
+
+    std::size_t const npeaks = peaks.size();
+    if (skip.size() && (skip.size() != npeaks)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                          "skip must be empty or the same length as peaks");
+    }
     if (!img.getBBox(image::PARENT).contains(foot.getBBox())) {
         throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Image too small for footprint");
     }
 
-    FootprintPtrT sfoot = symmetrizeFootprint(foot, cx, cy);
-
-    if (!sfoot) {
-        return std::pair<ImagePtrT, FootprintPtrT>(ImagePtrT(), sfoot);
+    SpanIndex const index(foot.getSpans());
+    PTR(geom::SpanSet) edgePixels = std::make_shared<geom::SpanSet>();
+    if (patchEdges) {
+        edgePixels = Utils::findEdgeMaskPixels(img, foot);
     }
 
-    if (!img.getBBox(image::PARENT).contains(sfoot->getBBox())) {
-        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
-                          "Image too small for symmetrized footprint");
+    templates.assign(npeaks, ImagePtrT());
+    tfoots.assign(npeaks, FootprintPtrT());
+    if (symmetricTemplates) {
+        symmetricTemplates->assign(npeaks, ImagePtrT());
     }
-    geom::SpanSet const & spans = *sfoot->getSpans();
-
-    // does this footprint touch an EDGE?
-    bool touchesEdge = false;
-    if (patchEdge) {
-        LOGL_DEBUG(_log, "Checking footprint for EDGE bits");
-        MaskPtrT mask = img.getMask();
-        bool edge = false;
-        MaskPixelT edgebit = mask->getPlaneBitMask("EDGE");
-        for (geom::SpanSet::const_iterator fwd=spans.begin();
-             fwd != spans.end(); ++fwd) {
-            int x0 = fwd->getX0();
-            int x1 = fwd->getX1();
-            typename MaskT::x_iterator xiter =
-                mask->x_at(x0 - mask->getX0(), fwd->getY() - mask->getY0());
-            for (int x=x0; x<=x1; ++x, ++xiter) {
-                if ((*xiter) & edgebit) {
-                    edge = true;
-                    break;
-                }
+    if (symmetricFootprints) {
+        symmetricFootprints->assign(npeaks, FootprintPtrT());
+    }
+    std::vector<char> patched(npeaks, 0);
+    std::vector<char> ramped(npeaks, 0);
+    std::vector<TemplateScratch<ImagePixelT> > scratch(std::max(nThreads, 1));
+    int const filtsize = 2*medianFilterHalfsize + 1;
+
+    // What ramping needs from the parent, made when a template first needs it.
+    int const S = Utils::getRampSize(psffwhm);
+    std::mutex rampMutex;
+    bool rampReady = false;
+    PTR(image::Image<double>) rampPsf;
+    PTR(det::Footprint) grownFoot;
+    PTR(geom::SpanSet) grownEdgePixels = std::make_shared<geom::SpanSet>();
+    auto prepareRamp = [&]() {
+        std::lock_guard<std::mutex> lock(rampMutex);
+        if (rampReady) {
+            return;
+        }
+        rampReady = true;
+        if (!psf) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+                              "A PSF is needed to ramp templates");
+        }
+        try {
+            rampPsf = Utils::getRampPsf(*psf, foot.getBBox(), S);
+        } catch (lsst::pex::exceptions::InvalidParameterError const& e) {
+            if (std::string(e.what()).find("CoaddPsf") == std::string::npos) {
+                throw;
             }
-            if (edge)
-                break;
+            return;
         }
-        if (edge) {
-            LOGL_DEBUG(_log, "Footprint includes an EDGE pixel.");
-            touchesEdge = true;
+        grownFoot = std::make_shared<det::Footprint>(foot.getSpans()->dilated(S),
+                                                     foot.getPeaks().getSchema());
+        if (patchEdges) {
+            det::Footprint inImage(grownFoot->getSpans()->clippedTo(img.getBBox(image::PARENT)));
+            grownEdgePixels = Utils::findEdgeMaskPixels(img, inImage);
         }
-    }
-
-    // The result image:
-    ImagePtrT targetimg(new ImageT(sfoot->getBBox()));
-
-    geom::SpanSet::const_iterator fwd  = spans.begin();
-    geom::SpanSet::const_iterator back = spans.end()-1;
-
-    ImagePtrT theimg = img.getImage();
+    };
 
-    for (; fwd <= back; fwd++, back--) {
-        int fy = fwd->getY();
-        int by = back->getY();
-
-        for (int fx=fwd->getX0(), bx=back->getX1();
-             fx <= fwd->getX1();
-             fx++, bx--) {
-            // FIXME -- CURRENTLY WE IGNORE THE MASK PLANE!  options
-            // include ORing the mask bits, or being clever about
-            // ignoring some masked pixels, or copying the mask bits
-            // of the min pixel
+    parallelFor(npeaks, nThreads, [&](std::size_t i, int t) {
+        if (skip.size() && skip[i]) {
+            return;
+        }
+        det::PeakRecord const& peak = peaks[i];
+        bool p = false;
+        std::pair<ImagePtrT, FootprintPtrT> result =
+            Utils::buildSymmetricTemplate(img, foot, index, *edgePixels, peak, sigma1,
+                                          true, patchEdges, &p);
+        if (!result.first) {
+            return;
+        }
+        ImagePtrT timg = result.first;
+        FootprintPtrT tfoot = result.second;
+        if (symmetricTemplates) {
+            (*symmetricTemplates)[i] = std::make_shared<ImageT>(*timg, true);
+        }
+        if (symmetricFootprints) {
+            // clipping changes the footprint in place
+            (*symmetricFootprints)[i] = std::make_shared<det::Footprint>(*tfoot);
+        }
 
-            // We have already checked the bounding box, so this should always be satisfied
-            assert(theimg->getBBox(image::PARENT).contains(geom::Point2I(fx, fy)));
-            assert(theimg->getBBox(image::PARENT).contains(geom::Point2I(bx, by)));
-
-            // FIXME -- we could do this with image iterators instead.
-            // But first profile to show that it's necessary and an
-            // improvement.
-            ImagePixelT pixf = theimg->get0(fx, fy);
-            ImagePixelT pixb = theimg->get0(bx, by);
-            ImagePixelT pix = std::min(pixf, pixb);
-            if (minZero) {
-                pix = std::max(pix, static_cast<ImagePixelT>(0));
-            }
-            targetimg->set0(fx, fy, pix);
-            targetimg->set0(bx, by, pix);
-
-        }
-    }
-
-    if (touchesEdge) {
-        // Find spans whose mirrors fall outside the image bounds,
-        // grow the footprint to include those spans, and plug in
-        // their pixel values.
-        geom::Box2I bb = sfoot->getBBox();
-
-        // Actually, it's not necessarily the IMAGE bounds that count
-        //-- the footprint may not go right to the image edge.
-        //geom::Box2I imbb = img.getBBox();
-        geom::Box2I imbb = foot.getBBox();
-
-        LOGL_DEBUG(_log, "Footprint touches EDGE: start bbox [%i,%i],[%i,%i]",
-                   bb.getMinX(), bb.getMaxX(), bb.getMinY(), bb.getMaxY());
-        // original footprint spans
-        const geom::SpanSet & ospans = *foot.getSpans();
-        for (fwd = ospans.begin(); fwd != ospans.end(); ++fwd) {
-            int y = fwd->getY();
-            int x = fwd->getX0();
-            // mirrored coords
-            int ym = cy + (cy - y);
-            int xm = cx + (cx - x);
-            if (!imbb.contains(geom::Point2I(xm, ym))) {
-                bb.include(geom::Point2I(x, y));
-            }
-            x = fwd->getX1();
-            xm = cx + (cx - x);
-            if (!imbb.contains(geom::Point2I(xm, ym))) {
-                bb.include(geom::Point2I(x, y));
-            }
-        }
-        LOGL_DEBUG(_log, "Footprint touches EDGE: grown bbox [%i,%i],[%i,%i]",
-                   bb.getMinX(), bb.getMaxX(), bb.getMinY(), bb.getMaxY());
-
-        // New template image
-        ImagePtrT targetimg2(new ImageT(bb));
-        sfoot->getSpans()->copyImage(*targetimg, *targetimg2);
-
-        LOGL_DEBUG(_log, "Symmetric footprint spans:");
-        const geom::SpanSet & sspans = *sfoot->getSpans();
-        for (fwd = sspans.begin(); fwd != sspans.end(); ++fwd) {
-            LOGL_DEBUG(_log, "  %s", fwd->toString().c_str());
-        }
-
-        // copy original 'img' pixels for the portion of spans whose
-        // mirrors are out of bounds.
-        std::vector<geom::Span> newSpans(sfoot->getSpans()->begin(), sfoot->getSpans()->end());
-        for (fwd = ospans.begin(); fwd != ospans.end(); ++fwd) {
-            int y   = fwd->getY();
-            int x0  = fwd->getX0();
-            int x1 = fwd->getX1();
-            // mirrored coords
-            int ym  = cy + (cy - y);
-            int xm0 = cx + (cx - x0);
-            int xm1 = cx + (cx - x1);
-            bool in0 = imbb.contains(geom::Point2I(xm0, ym));
-            bool in1 = imbb.contains(geom::Point2I(xm1, ym));
-            if (in0 && in1) {
-                // both endpoints of the symmetric span are in bounds; nothing to do
-                continue;
-            }
-            // clip to the part of the span where the mirror is out of bounds
-            if (in0) {
-                // the mirror of x0 is in-bounds; move x0 to be the first pixel
-                // whose mirror would be out-of-bounds
-                x0 = cx + (cx - (imbb.getMinX() - 1));
+        if (rampFluxAtEdge) {
+            // one search for the edge pixels, both to look for flux there
+            // and to ramp down from
+            std::shared_ptr<geom::SpanSet> tedge = SpanIndex(tfoot->getSpans()).findEdgePixels();
+            if (!significantEdgeSpans(*timg, *tedge, ImagePixelT(3*sigma1)).empty()) {
+                ramped[i] = 1;
+                prepareRamp();
+                if (!rampPsf) {
+                    return;
+                }
+                SpanIndex const rampFrom(std::make_shared<geom::SpanSet>(
+                    significantEdgeSpans(*timg, *tedge, ImagePixelT(-1e6))));
+                bool p2 = false;
+                result = Utils::rampFluxAtEdge(img, *grownFoot, *grownEdgePixels, *timg, *tfoot, rampFrom,
+                                               peak, *rampPsf, S, patchEdges, &p2);
+                if (!result.first) {
+                    return;
+                }
+                timg = result.first;
+                tfoot = result.second;
+                p = p || p2;
             }
-            if (in1) {
-                x1 = cx + (cx - (imbb.getMaxX() + 1));
+        }
+
+        int const W = timg->getWidth();
+        int const H = timg->getHeight();
+        TemplateScratch<ImagePixelT> & buf = scratch[t];
+
+        if (medianSmoothTemplate) {
+            // the filter reads a copy of the template, and writes the template
+            if (medianFilterFootprint) {
+                buf.reset(*timg, true);
+                medianFilterSpans(buf.inRows, buf.rows, W, H, timg->getX0(), timg->getY0(),
+                                  medianFilterHalfsize, *tfoot->getSpans());
+            } else if (W >= filtsize && H >= filtsize) {
+                buf.reset(*timg, true);
+                medianFilterRows(buf.inRows, buf.rows, W, H, medianFilterHalfsize);
             }
-            LOGL_DEBUG(_log, "Span y=%i, x=[%i,%i] has mirror (%i,[%i,%i]) out-of-bounds; clipped to %i,[%i,%i]",
-                       y, fwd->getX0(), fwd->getX1(), ym, xm1, xm0, y, x0, x1);
-            typename MaskedImageT::x_iterator initer =
-                img.x_at(x0 - img.getX0(), y - img.getY0());
-            typename ImageT::x_iterator outiter =
-                targetimg2->x_at(x0 - targetimg2->getX0(), y - targetimg2->getY0());
-            for (int x=x0; x<=x1; ++x, ++outiter, ++initer) {
-                *outiter = initer.image();
+        }
+
+        if (monotonicTemplate) {
+            if (monotonicRadial) {
+                Utils::makeMonotonicRadial(*timg, peak);
+            } else {
+                buf.reset(*timg, false);
+                castShadows(buf.rows, buf.scratchRows, W, H,
+                            peak.getIx() - timg->getX0(), peak.getIy() - timg->getY0());
             }
-            newSpans.push_back(geom::Span(y, x0, x1));
         }
-        sfoot->setSpans(std::make_shared<geom::SpanSet>(std::move(newSpans)));
-        targetimg = targetimg2;
-    }
 
-    *patchedEdges = touchesEdge;
-    return std::pair<ImagePtrT, FootprintPtrT>(targetimg, sfoot);
+        if (clipFootprintToNonzero) {
+            timg = clipTemplateToNonzero(*tfoot, timg);
+        }
+
+        templates[i] = timg;
+        tfoots[i] = tfoot;
+        patched[i] = p;
+    });
+    patchedEdges.assign(patched.begin(), patched.end());
+    rampedEdges.assign(ramped.begin(), ramped.end());
 }
 
 /**
@@ -1390,7 +3926,7 @@ hasSignificantFluxAtEdge(ImagePtrT img,
     // Find edge template pixels with significant flux -- perhaps
     // because their symmetric pixels were outside the footprint?
     // (clipped by an image edge, etc)
-    std::shared_ptr<geom::SpanSet> spans = sfoot->getSpans()->findEdgePixels();
+    std::shared_ptr<geom::SpanSet> spans = SpanIndex(sfoot->getSpans()).findEdgePixels();
 
     for (geom::SpanSet::const_iterator sp = spans->begin(); sp != spans->end(); ++sp) {
         int const y  = sp->getY();
@@ -1423,33 +3959,771 @@ getSignificantEdgePixels(ImagePtrT img,
     auto significant = std::make_shared<det::Footprint>();
     significant->setPeakSchema(sfoot->getPeaks().getSchema());
 
-    int const x0 = img->getX0(), y0 = img->getY0();
-    std::shared_ptr<geom::SpanSet> edgeSpans = sfoot->getSpans()->findEdgePixels();
-    std::vector<geom::Span> tmpSpans;
-    for (geom::SpanSet::const_iterator ss = edgeSpans->begin(); ss != edgeSpans->end(); ++ss) {
-        geom::Span const& span = *ss;
-        int const y = span.getY();
-        int x = span.getX0();
-        typename ImageT::const_x_iterator iter = img->x_at(x - x0, y - y0);
-        bool onSpan = false;            // Are we in a span of interest
-        int xSpan;                      // Starting x of span
-        for (; x <= span.getX1(); ++x, ++iter) {
-            if (*iter >= thresh) {
-                onSpan = true;
-                xSpan = x;
-            } else if (onSpan) {
-                onSpan = false;
-                tmpSpans.push_back(geom::Span(y, xSpan, x - 1));
-            }
-        }
-        if (onSpan) {
-            tmpSpans.push_back(geom::Span(y, xSpan, span.getX1()));
-        }
-    }
-    significant->setSpans(std::make_shared<geom::SpanSet>(std::move(tmpSpans)));
+    std::shared_ptr<geom::SpanSet> edgeSpans = SpanIndex(sfoot->getSpans()).findEdgePixels();
+    significant->setSpans(std::make_shared<geom::SpanSet>(significantEdgeSpans(*img, *edgeSpans, thresh)));
     return significant;
 }
 
 
+/**
+ The size, in pixels, by which rampFluxAtEdge grows templates, for a
+ PSF of FWHM *psffwhm*: 1.5 FWHM, made an odd number.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+int
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+getRampSize(double psffwhm) {
+    return static_cast<int>((psffwhm*1.5 + 0.5)/2)*2 + 1;
+}
+
+/**
+ The PSF image rampFluxAtEdge ramps templates down with: that of *psf*
+ at the centre of parent bbox *bbox*, with its origin moved to the
+ centre, clipped to within *S* pixels of it, and scaled to a peak value
+ of 1.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+PTR(image::Image<double>)
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+getRampPsf(PsfImageCache const& psf,
+           geom::Box2I const& bbox,
+           int S) {
+    int const xc = (bbox.getMinX() + bbox.getMaxX())/2;
+    int const yc = (bbox.getMinY() + bbox.getMaxY())/2;
+    PTR(image::Image<double>) psfim =
+        std::make_shared<image::Image<double> >(*psf.computeImage(geom::Point2D(xc, yc)), true);
+    // shift PSF image to be centered on zero
+    psfim->setXY0(psfim->getX0() - xc, psfim->getY0() - yc);
+    // clip PSF to S, if necessary
+    geom::Box2I const Sbox(geom::Point2I(-S, -S), geom::Extent2I(2*S+1, 2*S+1));
+    if (!Sbox.contains(psfim->getBBox(image::PARENT))) {
+        psfim = std::make_shared<image::Image<double> >(*psfim, Sbox, image::PARENT, true);
+    }
+    double pmax = -std::numeric_limits<double>::infinity();
+    for (int y = 0; y < psfim->getHeight(); ++y) {
+        double const* row = psfim->getArray()[y].getData();
+        pmax = std::max(pmax, *std::max_element(row, row + psfim->getWidth()));
+    }
+    *psfim /= pmax;
+    return psfim;
+}
+
+/**
+ Given the symmetric template *timg*, *tfoot* for *peak* in parent
+ footprint *foot*, which has significant flux at its edge, build a new
+ symmetric template from the image with the pixels beyond the parent
+ footprint filled in by ramping down the template's edge pixels with
+ the PSF (*psf*, from getRampPsf, with *S* from getRampSize).  The new
+ template is clipped to the image, so may not be symmetric.  See
+ plugins.rampFluxAtEdge; *patchEdge* and *patchedEdges* are as for
+ buildSymmetricTemplate.
+
+ The ramped pixels are worked out as they are needed, rather than
+ painted into a padded copy of the image first.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::pair<typename PTR(lsst::afw::image::Image<ImagePixelT>),
+          typename PTR(lsst::afw::detection::Footprint) >
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+rampFluxAtEdge(MaskedImageT const& img,
+               det::Footprint const& foot,
+               ImageT const& timg,
+               det::Footprint const& tfoot,
+               det::PeakRecord const& peak,
+               image::Image<double> const& psf,
+               int S,
+               bool patchEdge,
+               bool* patchedEdges) {
+    det::Footprint grownFoot(foot.getSpans()->dilated(S), foot.getPeaks().getSchema());
+    PTR(geom::SpanSet) grownEdgePixels = std::make_shared<geom::SpanSet>();
+    if (patchEdge) {
+        det::Footprint inImage(grownFoot.getSpans()->clippedTo(img.getBBox(image::PARENT)));
+        grownEdgePixels = findEdgeMaskPixels(img, inImage);
+    }
+    SpanIndex const edgePixels(std::make_shared<geom::SpanSet>(
+        significantEdgeSpans(timg, *SpanIndex(tfoot.getSpans()).findEdgePixels(), ImagePixelT(-1e6))));
+    return rampFluxAtEdge(img, grownFoot, *grownEdgePixels, timg, tfoot, edgePixels, peak, psf, S,
+                          patchEdge, patchedEdges);
+}
+
+/**
+ As above, with the per-parent work done once for all its peaks: the
+ parent footprint grown by *S* in *grownFoot*, and its pixels in the
+ image with the EDGE mask bit set in *grownEdgePixels* (only used if
+ *patchEdge* is true).  The template's pixels to ramp down from are
+ given, indexed, in *edgePixels*: its edge pixels, as selected by
+ getSignificantEdgePixels.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::pair<typename PTR(lsst::afw::image::Image<ImagePixelT>),
+          typename PTR(lsst::afw::detection::Footprint) >
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+rampFluxAtEdge(MaskedImageT const& img,
+               det::Footprint const& grownFoot,
+               geom::SpanSet const& grownEdgePixels,
+               ImageT const& timg,
+               det::Footprint const& tfoot,
+               SpanIndex const& edgePixels,
+               det::PeakRecord const& peak,
+               image::Image<double> const& psf,
+               int S,
+               bool patchEdge,
+               bool* patchedEdges) {
+    *patchedEdges = false;
+
+    int const cx = peak.getIx();
+    int const cy = peak.getIy();
+
+    // The parent footprint, grown by the ramp, around this template
+    geom::Box2I tbb = tfoot.getBBox();
+    tbb.grow(S);
+    det::Footprint fpcopy(grownFoot.getSpans()->clippedTo(tbb), grownFoot.getPeaks().getSchema());
+
+    FootprintPtrT sfoot = symmetrizeFootprint(fpcopy, cx, cy);
+    if (!sfoot) {
+        return std::pair<ImagePtrT, FootprintPtrT>(ImagePtrT(), sfoot);
+    }
+
+    ImagePtrT theimg = img.getImage();
+    std::pair<ImagePtrT, FootprintPtrT> result =
+        symmetricTemplate(RampedRows<ImagePixelT>(*theimg, timg, edgePixels, psf), fpcopy, sfoot,
+                          grownEdgePixels, cx, cy, true, patchEdge, patchedEdges);
+
+    // This template footprint may extend outside the parent
+    // footprint -- or the image.  Clip it.
+    // NOTE that this may make it asymmetric, unlike normal templates.
+    result.second->clipTo(img.getBBox(image::PARENT));
+    result.first = std::make_shared<ImageT>(*result.first, result.second->getBBox(), image::PARENT, true);
+    return result;
+}
+
+/**
+ Weight the templates *timgs* so that their sum best fits, in the
+ least-squares sense, the image *img* within the parent footprint
+ *foot*, using only the template pixels within *foot*.  Returns the
+ weights.
+
+ Rather than building the pixels-by-templates design matrix, the normal
+ equations are accumulated directly -- each template pair over the
+ footprint pixels where both templates have pixels, for just the pairs
+ a BoxIndex finds overlapping -- and solved by
+ Cholesky decomposition (or, if they are singular, for the
+ minimum-norm solution), so memory goes with the number of templates
+ squared.  A null template is given weight zero.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::vector<double>
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+weightTemplates(MaskedImageT const& img,
+                det::Footprint const& foot,
+                std::vector<ImagePtrT> const& timgs) {
+    if (!img.getBBox(image::PARENT).contains(foot.getBBox())) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Image too small for footprint");
+    }
+    int const N = timgs.size();
+    SpanIndex const index(foot.getSpans());
+    ImagePtrT const theimg = img.getImage();
+    auto rowOf = [](ImageT const& im, int y) {
+        return im.getArray()[y - im.getY0()].getData() - im.getX0();
+    };
+
+    // the sum over the footprint pixels in "box" of the product of two images
+    auto dotIn = [&](ImageT const& a, ImageT const& b, geom::Box2I const& box) {
+        double sum = 0.;
+        forEachSpanIn(index, box, [&](int y, int x0, int x1) {
+            ImagePixelT const* pa = rowOf(a, y);
+            ImagePixelT const* pb = rowOf(b, y);
+            for (int x = x0; x <= x1; ++x) {
+                sum += static_cast<double>(pa[x])*pb[x];
+            }
+        });
+        return sum;
+    };
+
+    // A^T A and A^T b; only templates whose bounding boxes overlap (within
+    // the footprint's) have a cross term
+    std::vector<double> AtA(static_cast<std::size_t>(N)*N, 0.);
+    std::vector<double> Atb(N, 0.);
+    std::vector<geom::Box2I> boxes(N);
+    for (int i = 0; i < N; ++i) {
+        if (!timgs[i]) {
+            continue;
+        }
+        boxes[i] = timgs[i]->getBBox(image::PARENT);
+        boxes[i].clip(foot.getBBox());
+        Atb[i] = dotIn(*timgs[i], *theimg, boxes[i]);
+        AtA[i*N + i] = dotIn(*timgs[i], *timgs[i], boxes[i]);
+    }
+    for (std::pair<int, int> const & ij : BoxIndex(boxes).getOverlappingPairs()) {
+        int const i = ij.first;
+        int const j = ij.second;
+        geom::Box2I overlap = boxes[i];
+        overlap.clip(boxes[j]);
+        AtA[i*N + j] = AtA[j*N + i] = dotIn(*timgs[i], *timgs[j], overlap);
+    }
+    std::vector<double> weights;
+    solveSymmetric(AtA, Atb, N, weights);
+    return weights;
+}
+
+/**
+ Clip the spans of footprint *foot* to the nonzero pixels of image
+ *img*: spans (clipped to the image) that are all zero are dropped, and
+ the ends of the rest are moved in to nonzero pixels; spans are not
+ split at internal zeros.  Peaks left outside the footprint are
+ removed.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+clipFootprintToNonzero(FootprintT & foot,
+                       ImageT const& img) {
+    clipToNonzero(foot, img);
+}
+
+/**
+ Clip each template footprint of *tfoots* to the nonzero pixels of its
+ template in *timgs*, as clipFootprintToNonzero, and return the
+ templates trimmed to their clipped footprints' bounding boxes: copies
+ where the box changes (and isn't empty), otherwise the templates
+ themselves.  Entries with a null footprint or template are passed
+ through.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::vector<typename deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::ImagePtrT>
+deblend::BaselineUtils<ImagePixelT,MaskPixelT,VariancePixelT>::
+clipFootprintsToNonzero(std::vector<FootprintPtrT> const& tfoots,
+                        std::vector<ImagePtrT> const& timgs) {
+    if (tfoots.size() != timgs.size()) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                          "tfoots and timgs must be the same length");
+    }
+    std::vector<ImagePtrT> clipped(timgs);
+    for (std::size_t i = 0; i < tfoots.size(); ++i) {
+        if (!tfoots[i] || !timgs[i]) {
+            continue;
+        }
+        clipped[i] = clipTemplateToNonzero(*tfoots[i], timgs[i]);
+    }
+    return clipped;
+}
+
+deblend::PsfFit::PsfFit()
+    : outOfBounds(false), tinyFootprint(false), noValidPixels(false), failed(false), badDof(false),
+      chisq1(0.), dof1(0.), chisq2(0.), dof2(0.), chisq3(0.), dof3(0.), hasFit3(false),
+      bigDecenter(false), withDecenter(false), isPsf(false),
+      R0(0), R1(0), xlo(0), xhi(-1), ylo(0), yhi(-1), cx(0.), cy(0.), chisq(0.), dof(0.),
+      flux(0.), nOthers(0) {}
+
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+deblend::PsfFitter<ImagePixelT,MaskPixelT,VariancePixelT>::
+PsfFitter()
+    : psfChisqCut1(1.5),
+      psfChisqCut2(1.5),
+      psfChisqCut2b(1.5),
+      tinyFootprintSize(2) {}
+
+/**
+ Fit a PSF + smooth background model (linear) to a small region around
+ each of the first *npeaks* peaks of parent footprint *foot* in *img*,
+ as plugins.fitPsfs does, making the same decisions; see there for the
+ model and the cuts.  Each fit is weighted least squares over the
+ footprint pixels within 1.5 *psffwhm* of the peak, with terms for the
+ peak's PSF, a constant and linear sky, the PSFs of neighbouring peaks
+ and (in the second fit) the PSF's x and y derivatives.
+
+ The design matrix is filled straight from the image and PSF pixels,
+ and each PSF image, from the cache *psf*, is shared by all the fits
+ that need it.  Returns one PsfFit per peak.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+std::vector<deblend::PsfFit>
+deblend::PsfFitter<ImagePixelT,MaskPixelT,VariancePixelT>::
+fit(MaskedImageT const& img,
+    det::Footprint const& foot,
+    PsfImageCache const& psf,
+    double psffwhm,
+    int npeaks) const {
+
+    det::PeakCatalog const& peaks = foot.getPeaks();
+    int const nall = peaks.size();
+    if ((npeaks < 0) || (npeaks > nall)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                          "npeaks must be between 0 and the number of peaks");
+    }
+    geom::Box2I const fbb = foot.getBBox();
+    if (!img.getBBox(image::PARENT).contains(fbb)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Image too small for footprint");
+    }
+    typename MaskedImageT::ImagePtr const theimg = img.getImage();
+    typename MaskedImageT::VariancePtr const varimg = img.getVariance();
+
+    // the footprint's pixels, over its bbox
+    int const FW = fbb.getWidth();
+    std::vector<char> inFoot(static_cast<std::size_t>(FW)*fbb.getHeight(), 0);
+    for (geom::Span const & sp : *foot.getSpans()) {
+        char* row = inFoot.data() + static_cast<std::size_t>(sp.getY() - fbb.getMinY())*FW - fbb.getMinX();
+        std::fill(row + sp.getX0(), row + sp.getX1() + 1, 1);
+    }
+
+    std::vector<geom::Point2D> peakF(nall);
+    // the pixels the peaks are in, to find each one's neighbours
+    std::vector<geom::Box2I> peakBoxes(nall);
+    for (int i = 0; i < nall; ++i) {
+        peakF[i] = peaks[i].getF();
+        peakBoxes[i] = geom::Box2I(geom::Point2I(static_cast<int>(std::floor(peakF[i].getX())),
+                                                 static_cast<int>(std::floor(peakF[i].getY()))),
+                                   geom::Extent2I(1, 1));
+    }
+    BoxIndex const peakIndex(peakBoxes);
+    // PSF images at the peaks, made as they are first needed
+    std::vector<PTR(image::Image<double> const)> psfims(nall);
+    auto psfAt = [&](int i) {
+        if (!psfims[i]) {
+            psfims[i] = computePsfImage(psf, peakF[i]);
+        }
+        return psfims[i];
+    };
+
+    // The small region is a disk out to R0, plus a ramp with
+    // decreasing weight down to R1.
+    int const R0 = static_cast<int>(std::ceil(psffwhm*1.));
+    int const R1 = static_cast<int>(std::ceil(psffwhm*1.5));
+
+    // indices of columns in the "A" matrix.
+    int const I_psf = 0;
+    int const I_sky = 1;
+    int const I_sky_ramp_x = 2;
+    int const I_sky_ramp_y = 3;
+    int const I_opsf = 4;
+
+    std::vector<PsfFit> fits(npeaks);
+    for (int i = 0; i < npeaks; ++i) {
+        PsfFit & res = fits[i];
+        double cx = peakF[i].getX();
+        double cy = peakF[i].getY();
+        PTR(image::Image<double> const) psfimg = psfAt(i);
+        // R2: distance to neighbouring peak in order to put it into the model
+        double const R2 = R1 + std::min(psfimg->getWidth(), psfimg->getHeight())/2.;
+
+        geom::Box2I pbb = psfimg->getBBox(image::PARENT);
+        pbb.clip(fbb);
+        // Make sure we haven't been given a substitute PSF that's nowhere near where we want
+        if (!pbb.contains(geom::Point2I(static_cast<int>(cx), static_cast<int>(cy)))) {
+            res.outOfBounds = true;
+            continue;
+        }
+
+        // The bounding-box of the local region we are going to fit ("stamp")
+        geom::Box2I stampbb(geom::Point2I(static_cast<int>(std::floor(cx - R1)),
+                                          static_cast<int>(std::floor(cy - R1))),
+                            geom::Point2I(static_cast<int>(std::ceil(cx + R1)),
+                                          static_cast<int>(std::ceil(cy + R1))));
+        stampbb.clip(fbb);
+        if (stampbb.isEmpty()) {
+            res.outOfBounds = true;
+            continue;
+        }
+        int const xlo = stampbb.getMinX(), xhi = stampbb.getMaxX();
+        int const ylo = stampbb.getMinY(), yhi = stampbb.getMaxY();
+
+        // drop tiny footprints too; the PSF dx term needs at least 3 pixels
+        if (std::min(stampbb.getWidth(), stampbb.getHeight()) <= std::max(tinyFootprintSize, 2)) {
+            res.tinyFootprint = true;
+            continue;
+        }
+
+        // find other peaks within range...
+        std::vector<PTR(image::Image<double> const)> others;
+        geom::Box2I const near(geom::Point2I(static_cast<int>(std::floor(cx - R2)),
+                                             static_cast<int>(std::floor(cy - R2))),
+                               geom::Point2I(static_cast<int>(std::ceil(cx + R2)),
+                                             static_cast<int>(std::ceil(cy + R2))));
+        for (int j : peakIndex.query(near)) {
+            if (j == i) {
+                continue;
+            }
+            double const ddx = peakF[j].getX() - cx;
+            double const ddy = peakF[j].getY() - cy;
+            if (ddx*ddx + ddy*ddy > R2*R2) {
+                continue;
+            }
+            PTR(image::Image<double> const) opsf = psfAt(j);
+            if (!opsf->getBBox(image::PARENT).overlaps(stampbb)) {
+                continue;
+            }
+            others.push_back(opsf);
+        }
+        int const NT1 = 4 + others.size();
+        int const NT2 = NT1 + 2;
+        int const I_dx = NT1;
+        int const I_dy = NT1 + 1;
+
+        // The valid pixels: in the footprint, within R1 of the peak, and
+        // with positive variance; in row order, as numpy would take them.
+        std::vector<int> vx, vy;
+        std::vector<double> vrr;
+        for (int y = ylo; y <= yhi; ++y) {
+            char const* frow = inFoot.data() + static_cast<std::size_t>(y - fbb.getMinY())*FW - fbb.getMinX();
+            VariancePixelT const* varrow = varimg->getArray()[y - varimg->getY0()].getData() - varimg->getX0();
+            for (int x = xlo; x <= xhi; ++x) {
+                double const RR = (x - cx)*(x - cx) + (y - cy)*(y - cy);
+                if (frow[x] && (RR <= R1*R1) && (varrow[x] > 0)) {
+                    vx.push_back(x);
+                    vy.push_back(y);
+                    vrr.push_back(RR);
+                }
+            }
+        }
+        int const NP = vx.size();
+        if (NP == 0) {
+            res.noValidPixels = true;
+            continue;
+        }
+
+        // Build the matrix "A" (by columns), rhs "b" and weight "w"; the
+        // weights ramp from 1 at R0 down to 0 at R1.
+        std::vector<double> A(static_cast<std::size_t>(NP)*NT2, 0.);
+        std::vector<double> b(NP), w(NP);
+        double sumr = 0.;
+        for (int k = 0; k < NP; ++k) {
+            int const x = vx[k];
+            int const y = vy[k];
+            A[I_sky*NP + k] = 1.;
+            A[I_sky_ramp_x*NP + k] = (x - xlo) + (xlo - cx);
+            A[I_sky_ramp_y*NP + k] = (y - ylo) + (ylo - cy);
+            bool const inx = (x >= pbb.getMinX()) && (x <= pbb.getMaxX());
+            bool const iny = (y >= pbb.getMinY()) && (y <= pbb.getMaxY());
+            if (inx && iny) {
+                A[I_psf*NP + k] = pixelAt(*psfimg, x, y);
+            }
+            // PSF dx and dy -- the half-difference of the pixels either side
+            if (iny && (x > pbb.getMinX()) && (x < pbb.getMaxX())) {
+                A[I_dx*NP + k] = (pixelAt(*psfimg, x + 1, y) - pixelAt(*psfimg, x - 1, y))/2.;
+            }
+            if (inx && (y > pbb.getMinY()) && (y < pbb.getMaxY())) {
+                A[I_dy*NP + k] = (pixelAt(*psfimg, x, y + 1) - pixelAt(*psfimg, x, y - 1))/2.;
+            }
+            for (std::size_t j = 0; j < others.size(); ++j) {
+                if (others[j]->getBBox(image::PARENT).contains(geom::Point2I(x, y))) {
+                    A[(I_opsf + j)*NP + k] = pixelAt(*others[j], x, y);
+                }
+            }
+            b[k] = theimg->getArray()[y - theimg->getY0()].getData()[x - theimg->getX0()];
+            double rw = 1.;
+            if (vrr[k] > R0*R0) {
+                rw = std::max(0., 1. - ((std::sqrt(vrr[k]) - R0)/(R1 - R0)));
+            }
+            double const var = varimg->getArray()[y - varimg->getY0()].getData()[x - varimg->getX0()];
+            w[k] = std::sqrt(rw/var);
+            sumr += rw;
+        }
+
+        std::vector<double> Aw(A.size()), bw(NP);
+        bool finite = true;
+        for (int j = 0; j < NT2; ++j) {
+            for (int k = 0; k < NP; ++k) {
+                Aw[j*NP + k] = A[j*NP + k]*w[k];
+                finite = finite && std::isfinite(Aw[j*NP + k]);
+            }
+        }
+        for (int k = 0; k < NP; ++k) {
+            bw[k] = b[k]*w[k];
+        }
+        // numpy's SVD fails on NaNs in the matrix
+        if (!finite) {
+            res.failed = true;
+            continue;
+        }
+
+        // We do fits with and without the decenter (dx,dy) terms, which
+        // are the last columns of the matrix.
+        std::vector<double> X1, X2;
+        double chisq1 = 1e30, chisq2 = 1e30;
+        std::vector<double> const Aw1(Aw.begin(), Aw.begin() + static_cast<std::size_t>(NP)*NT1);
+        leastSquares(Aw1, bw, NP, NT1, X1, &chisq1);
+        leastSquares(Aw, bw, NP, NT2, X2, &chisq2);
+        double const dof1 = sumr - NT1;
+        double const dof2 = sumr - NT2;
+
+        // This can happen if we're very close to the edge (?)
+        if (dof1 <= 0 || dof2 <= 0) {
+            res.badDof = true;
+            continue;
+        }
+
+        double const q1 = chisq1/dof1;
+        double q2 = chisq2/dof2;
+        bool const ispsf1 = (q1 < psfChisqCut1);
+        bool ispsf2 = (q2 < psfChisqCut2);
+        res.chisq1 = chisq1;
+        res.dof1 = dof1;
+        res.chisq2 = chisq2;
+        res.dof2 = dof2;
+
+        // check that the fit PSF spatial derivative terms aren't too big
+        double dx = 0., dy = 0.;
+        if (ispsf2) {
+            double const f0 = X2[I_psf];
+            // as a fraction of the PSF flux
+            dx = X2[I_dx]/f0;
+            dy = X2[I_dy]/f0;
+            ispsf2 = (std::abs(dx) < 1. && std::abs(dy) < 1.);
+            if (!ispsf2) {
+                res.bigDecenter = true;
+            }
+        }
+
+        // Looks like a shifted PSF: try actually shifting the PSF by that
+        // amount and re-evaluate the fit.
+        if (ispsf2) {
+            PTR(image::Image<double> const) psfimg2 = computePsfImage(psf, geom::Point2D(cx + dx, cy + dy));
+            geom::Box2I pbb2 = psfimg2->getBBox(image::PARENT);
+            pbb2.clip(fbb);
+            if (!pbb2.contains(geom::Point2I(static_cast<int>(cx + dx), static_cast<int>(cy + dy)))) {
+                ispsf2 = false;
+            } else {
+                // Update the PSF column where the shifted PSF covers it;
+                // elsewhere it keeps the unshifted PSF, as fitPsfs has it.
+                std::vector<double> Ab(A.begin(), A.begin() + static_cast<std::size_t>(NP)*NT1);
+                for (int k = 0; k < NP; ++k) {
+                    if (pbb2.contains(geom::Point2I(vx[k], vy[k]))) {
+                        Ab[I_psf*NP + k] = pixelAt(*psfimg2, vx[k], vy[k]);
+                    }
+                }
+                for (int j = 0; j < NT1; ++j) {
+                    for (int k = 0; k < NP; ++k) {
+                        Ab[j*NP + k] *= w[k];
+                    }
+                }
+                std::vector<double> Xb;
+                double chisqb = 1e30;
+                leastSquares(Ab, bw, NP, NT1, Xb, &chisqb);
+                double const dofb = sumr - NT1;
+                double const qb = chisqb/dofb;
+                ispsf2 = (qb < psfChisqCut2b);
+                q2 = qb;
+                X2 = Xb;
+                res.hasFit3 = true;
+                res.chisq3 = chisqb;
+                res.dof3 = dofb;
+            }
+        }
+
+        // Which one do we keep?
+        if (((ispsf1 && ispsf2) && (q2 < q1)) || (ispsf2 && !ispsf1)) {
+            res.params = X2;
+            res.chisq = chisq2;
+            res.dof = dof2;
+            cx += dx;
+            cy += dy;
+            res.withDecenter = true;
+        } else {
+            // (arbitrarily set to X1 when neither fits well)
+            res.params = X1;
+            res.chisq = chisq1;
+            res.dof = dof1;
+        }
+        res.isPsf = (ispsf1 || ispsf2);
+        res.R0 = R0;
+        res.R1 = R1;
+        res.xlo = xlo;
+        res.xhi = xhi;
+        res.ylo = ylo;
+        res.yhi = yhi;
+        res.cx = cx;
+        res.cy = cy;
+        res.flux = res.params[I_psf];
+        res.nOthers = others.size();
+    }
+    return fits;
+}
+
+/**
+ Compute the dot products of all pairs of templates *timgs*, each over
+ the pixels of its footprint in *tfoots* that are also in the other's,
+ as HeavyFootprint::dot of the templates' HeavyFootprints.  Only the
+ pairs whose footprints' bounding boxes overlap, found with a BoxIndex,
+ are looked at.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+TemplateGram(std::vector<ImagePtrT> const& timgs,
+             std::vector<FootprintPtrT> const& tfoots)
+    : _n(timgs.size()),
+      _dots(static_cast<std::size_t>(_n)*_n, 0.),
+      _active(_n, false),
+      _rowMax(_n, 0.),
+      _rowArg(_n, -1),
+      _rowValid(_n, false) {
+    if (tfoots.size() != timgs.size()) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError,
+                          "timgs and tfoots must be the same length");
+    }
+    std::vector<PTR(SpanIndex)> index(_n);
+    for (int i = 0; i < _n; ++i) {
+        if (!timgs[i] || !tfoots[i]) {
+            continue;
+        }
+        if (!timgs[i]->getBBox(image::PARENT).contains(tfoots[i]->getBBox())) {
+            throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Template too small for footprint");
+        }
+        index[i] = std::make_shared<SpanIndex>(tfoots[i]->getSpans());
+        _active[i] = true;
+    }
+    auto rowOf = [](ImageT const& im, int y) {
+        return im.getArray()[y - im.getY0()].getData() - im.getX0();
+    };
+    auto dotOf = [&](int i, int j) {
+        double sum = 0.;
+        forEachSpanOverlap(*index[i], *index[j], [&](int y, int x0, int x1) {
+            ImagePixelT const* a = rowOf(*timgs[i], y);
+            ImagePixelT const* b = rowOf(*timgs[j], y);
+            for (int x = x0; x <= x1; ++x) {
+                sum += static_cast<double>(a[x])*b[x];
+            }
+        });
+        return sum;
+    };
+    std::vector<geom::Box2I> boxes(_n);
+    for (int i = 0; i < _n; ++i) {
+        if (index[i]) {
+            boxes[i] = index[i]->getBBox();
+            _dots[i*_n + i] = dotOf(i, i);
+        }
+    }
+    for (std::pair<int, int> const & ij : BoxIndex(boxes).getOverlappingPairs()) {
+        _dots[ij.first*_n + ij.second] = _dots[ij.second*_n + ij.first] = dotOf(ij.first, ij.second);
+    }
+}
+
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+_check(int i) const {
+    if ((i < 0) || (i >= _n)) {
+        throw LSST_EXCEPT(lsst::pex::exceptions::LengthError, "Template index out of range");
+    }
+}
+
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+bool
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+isActive(int i) const {
+    _check(i);
+    return _active[i];
+}
+
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+double
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+dot(int i, int j) const {
+    _check(i);
+    _check(j);
+    return _dots[i*_n + j];
+}
+
+/**
+ The dot product of templates *i* and *j* normalized by their norms --
+ the cosine of the angle between them -- or zero if either is zero.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+double
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+_cosine(int i, int j) const {
+    double const norm = _dots[i*_n + i]*_dots[j*_n + j];
+    if (norm <= 0) {
+        return 0.;
+    }
+    return _dots[i*_n + j]/std::sqrt(norm);
+}
+
+/**
+ Drop template *i*; only the later templates whose closest earlier
+ template it was need to be looked at again.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+remove(int i) {
+    _check(i);
+    _active[i] = false;
+    for (int k = i + 1; k < _n; ++k) {
+        if (_rowArg[k] == i) {
+            _rowValid[k] = false;
+        }
+    }
+}
+
+/**
+ Update the dot products for template *i* having been multiplied by
+ *factor*.  A positive factor leaves the cosines as they were.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+void
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+scale(int i, double factor) {
+    _check(i);
+    // (the diagonal element is scaled twice, by factor squared)
+    for (int k = 0; k < _n; ++k) {
+        _dots[i*_n + k] *= factor;
+        _dots[k*_n + i] *= factor;
+    }
+    if (factor > 0) {
+        return;
+    }
+    for (int k = i; k < _n; ++k) {
+        _rowValid[k] = false;
+    }
+}
+
+/**
+ Find the pair of templates that reconstructTemplates would reject one
+ of, making the same choice as its scan of the normalized dot products:
+ the first template *i* with a cosine greater than *maxTempDotProd*
+ with any earlier template, paired with the (first) earlier template
+ *j* it has the largest cosine with, which is returned in *cosine*.
+ Each template's largest cosine is remembered until a removal or
+ rescaling may change it, so repeated calls between removals cost
+ little more than a pass over the templates.
+ */
+template<typename ImagePixelT, typename MaskPixelT, typename VariancePixelT>
+bool
+deblend::TemplateGram<ImagePixelT,MaskPixelT,VariancePixelT>::
+findDegenerate(double maxTempDotProd, int & i, int & j, double & cosine) const {
+    for (int k = 0; k < _n; ++k) {
+        if (!_active[k]) {
+            continue;
+        }
+        if (!_rowValid[k]) {
+            double best = 0.;
+            int arg = -1;
+            for (int l = 0; l < k; ++l) {
+                if (!_active[l]) {
+                    continue;
+                }
+                double const c = _cosine(k, l);
+                if (c > best) {
+                    best = c;
+                    arg = l;
+                }
+            }
+            _rowMax[k] = best;
+            _rowArg[k] = arg;
+            _rowValid[k] = true;
+        }
+        if ((_rowArg[k] >= 0) && (_rowMax[k] > maxTempDotProd)) {
+            i = k;
+            j = _rowArg[k];
+            cosine = _rowMax[k];
+            return true;
+        }
+    }
+    return false;
+}
+
 // Instantiate
 template class deblend::BaselineUtils<float>;
+template class deblend::TemplatePipeline<float>;
+template class deblend::PsfFitter<float>;
+template class deblend::TemplateGram<float>;
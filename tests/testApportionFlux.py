@@ -0,0 +1,310 @@
+
+
+#!/usr/bin/env python
+#
+# LSST Data Management System
+#
+# Copyright 2008-2017  AURA/LSST.
+#
+# This product includes software developed by the
+# LSST Project (http://www.lsst.org/).
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the LSST License Statement and
+# the GNU General Public License along with this program.  If not,
+# see <https://www.lsstcorp.org/LegalNotices/>.
+#
+from __future__ import print_function
+import unittest
+
+import numpy as np
+
+import lsst.utils.tests
+import lsst.afw.detection as afwDet
+import lsst.afw.geom as afwGeom
+import lsst.afw.image as afwImage
+from lsst.meas.deblender import BaselineUtilsF as butils
+
+
+class ApportionFluxTestCase(lsst.utils.tests.TestCase):
+    """Check that apportionFluxToHeavy and mergeHeavyFootprints give the same
+    HeavyFootprints as apportionFlux followed by the afw functions."""
+
+    def setUp(self):
+        np.random.seed(7)
+        W, H = 40, 30
+        bbox = afwGeom.Box2I(afwGeom.Point2I(5, -5), afwGeom.Extent2I(W, H))
+        self.mimg = afwImage.MaskedImageF(bbox)
+        self.mimg.getImage().getArray()[:, :] = np.random.uniform(-1, 10, size=(H, W))
+        self.mimg.getVariance().getArray()[:, :] = np.random.uniform(1, 2, size=(H, W))
+        self.mimg.getMask().getArray()[:, :] = np.random.randint(0, 4, size=(H, W))
+
+        # parent footprint: most of the image, with a hole for stray flux to fill
+        self.foot = afwDet.Footprint(afwGeom.SpanSet.fromShape(13, afwGeom.Stencil.CIRCLE, (25, 10)))
+        self.foot.clipTo(bbox)
+
+        self.timgs = []
+        self.tfoots = []
+        self.pkx = []
+        self.pky = []
+        for (cx, cy, r) in [(20, 8, 6), (31, 14, 7), (24, 20, 4)]:
+            tfoot = afwDet.Footprint(afwGeom.SpanSet.fromShape(r, afwGeom.Stencil.CIRCLE, (cx, cy)))
+            tbb = tfoot.getBBox()
+            tbb.grow(2)
+            timg = afwImage.ImageF(tbb)
+            timg.getArray()[:, :] = np.random.uniform(-1, 5, size=timg.getArray().shape)
+            self.timgs.append(timg)
+            self.tfoots.append(tfoot)
+            self.pkx.append(cx)
+            self.pky.append(cy)
+            peak = tfoot.getPeaks().addNew()
+            peak.setFx(cx)
+            peak.setFy(cy)
+            peak.setIx(cx)
+            peak.setIy(cy)
+
+    def assertHeaviesEqual(self, h1, h2):
+        self.assertEqual(h1.getSpans(), h2.getSpans())
+        self.assertFloatsAlmostEqual(h1.getImageArray(), h2.getImageArray(), rtol=1e-6)
+        self.assertFloatsEqual(h1.getMaskArray(), h2.getMaskArray())
+        self.assertFloatsEqual(h1.getVarianceArray(), h2.getVarianceArray())
+
+    def testHeavyPortions(self):
+        opts = (butils.ASSIGN_STRAYFLUX | butils.STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY)
+        ispsf = [False]*len(self.timgs)
+        args = [self.pkx, self.pky, opts, 0.001]
+        tsum1 = afwImage.ImageF(self.foot.getBBox())
+        portions, strays1 = butils.apportionFlux(self.mimg, self.foot, self.timgs, self.tfoots, tsum1,
+                                                 ispsf, *args)
+        tsum2 = afwImage.ImageF(self.foot.getBBox())
+        heavies, strays2 = butils.apportionFluxToHeavy(self.mimg, self.foot, self.timgs, self.tfoots,
+                                                       tsum2, ispsf, *args)
+        self.assertFloatsEqual(tsum1.getArray(), tsum2.getArray())
+        self.assertEqual(len(heavies), len(portions))
+        for portion, heavy, tfoot, stray1, stray2 in zip(portions, heavies, self.tfoots,
+                                                         strays1, strays2):
+            expected = afwDet.makeHeavyFootprint(tfoot, portion)
+            self.assertHeaviesEqual(heavy, expected)
+            self.assertEqual(len(heavy.getPeaks()), 1)
+            if stray1 is None:
+                self.assertIsNone(stray2)
+                continue
+            self.assertHeaviesEqual(stray2, stray1)
+            merged = butils.mergeHeavyFootprints(heavy, stray2)
+            self.assertHeaviesEqual(merged, afwDet.mergeHeavyFootprints(expected, stray1))
+            self.assertEqual(len(merged.getPeaks()), len(heavy.getPeaks()) + len(stray2.getPeaks()))
+
+    def testSubnormalTail(self):
+        """Portions stay finite where the template sum is subnormal, as in far PSF tails"""
+        bbox = self.foot.getBBox()
+        timgs = []
+        tfoots = []
+        for k, tail in enumerate([1e-40, 3e-40]):
+            tfoot = afwDet.Footprint(self.foot.getSpans())
+            timg = afwImage.ImageF(bbox)
+            arr = timg.getArray()
+            arr[:, :] = np.random.uniform(0.5, 1, size=arr.shape)
+            # a tail of subnormal values, and one template zero where the other isn't
+            arr[:, :10] = tail
+            arr[:3, :10] = 0. if k == 0 else tail
+            timgs.append(timg)
+            tfoots.append(tfoot)
+        tarrs = [timg.getArray().astype(np.float64) for timg in timgs]
+        self.assertTrue(np.all(tarrs[0][:, :10] < np.finfo(np.float32).tiny))
+        tsumArr = tarrs[0] + tarrs[1]
+        imgArr = self.mimg.getImage().Factory(self.mimg.getImage(), bbox).getArray()
+        args = [[False]*2, [0, 0], [0, 0], 0, 0.]
+        portions, strays = butils.apportionFlux(self.mimg, self.foot, timgs, tfoots,
+                                                afwImage.ImageF(bbox), *args)
+        heavies, strays = butils.apportionFluxToHeavy(self.mimg, self.foot, timgs, tfoots,
+                                                      afwImage.ImageF(bbox), *args)
+        for portion, heavy, tarr, tfoot in zip(portions, heavies, tarrs, tfoots):
+            got = portion.getImage().getArray()
+            self.assertTrue(np.all(np.isfinite(got)))
+            self.assertTrue(np.all(np.isfinite(heavy.getImageArray())))
+            expected = afwImage.ImageF(bbox)
+            expected.getArray()[:, :] = imgArr*tarr/tsumArr
+            # compare over the footprint, where the portions are set
+            heavyExpected = afwDet.makeHeavyFootprint(tfoot, afwImage.MaskedImageF(expected))
+            self.assertFloatsAlmostEqual(afwDet.makeHeavyFootprint(tfoot, portion).getImageArray(),
+                                         heavyExpected.getImageArray(), rtol=1e-5)
+            self.assertFloatsAlmostEqual(heavy.getImageArray(), heavyExpected.getImageArray(), rtol=1e-5)
+
+    def testMergePeakSchema(self):
+        """Merged HeavyFootprints keep the first one's peak schema, extra fields and all"""
+        schema = afwDet.PeakTable.makeMinimalSchema()
+        flagKey = schema.addField("merge_peak_test", type="Flag", doc="an extra peak field")
+        heavies = []
+        for (cx, cy, r) in [(20, 8, 6), (24, 12, 7)]:
+            foot = afwDet.Footprint(afwGeom.SpanSet.fromShape(r, afwGeom.Stencil.CIRCLE, (cx, cy)),
+                                    schema)
+            peak = foot.getPeaks().addNew()
+            peak.setFx(cx)
+            peak.setFy(cy)
+            peak.setIx(cx)
+            peak.setIy(cy)
+            peak.set(flagKey, cx == 20)
+            heavies.append(afwDet.makeHeavyFootprint(foot, self.mimg))
+        merged = butils.mergeHeavyFootprints(*heavies)
+        expected = afwDet.mergeHeavyFootprints(*heavies)
+        self.assertHeaviesEqual(merged, expected)
+        self.assertEqual(merged.getPeaks().getSchema(), schema)
+        self.assertEqual([pk.get(flagKey) for pk in merged.getPeaks()], [True, False])
+
+    def testFindStrayPixels(self):
+        tsum = afwImage.ImageF(self.foot.getBBox())
+        butils.apportionFlux(self.mimg, self.foot, self.timgs, self.tfoots, tsum,
+                             [False]*len(self.timgs), self.pkx, self.pky, 0, 0.)
+        stray = butils.findStrayPixels(self.foot, tsum, self.mimg)
+        expected = set()
+        sumArr = tsum.getArray()
+        imgArr = self.mimg.getImage().getArray()
+        for span in self.foot.getSpans():
+            y = span.getY()
+            for x in range(span.getX0(), span.getX1() + 1):
+                if (sumArr[y - tsum.getY0(), x - tsum.getX0()] <= 0 and
+                        imgArr[y - self.mimg.getY0(), x - self.mimg.getX0()] > 0):
+                    expected.add((x, y))
+        got = set()
+        for span in stray:
+            for x in range(span.getX0(), span.getX1() + 1):
+                got.add((x, span.getY()))
+        self.assertGreater(len(got), 0)
+        self.assertEqual(got, expected)
+        self.assertEqual(stray.getArea(), len(expected))
+
+    def testNearestFootprint(self):
+        """Each stray pixel goes, whole, to a template at the least distance."""
+        ispsf = [False]*len(self.timgs)
+        fbb = self.foot.getBBox()
+        imgArr = self.mimg.getImage().getArray()
+        ix0, iy0 = self.mimg.getX0(), self.mimg.getY0()
+        for euclidean in (False, True):
+            opts = (butils.ASSIGN_STRAYFLUX | butils.STRAYFLUX_NEAREST_FOOTPRINT)
+            if euclidean:
+                opts |= butils.STRAYFLUX_NEAREST_FOOTPRINT_EUCLIDEAN
+            tsum = afwImage.ImageF(fbb)
+            portions, strays = butils.apportionFlux(self.mimg, self.foot, self.timgs, self.tfoots, tsum,
+                                                    ispsf, self.pkx, self.pky, opts, 0.001)
+            owner = {}
+            for i, stray in enumerate(strays):
+                if stray is None:
+                    continue
+                values = iter(stray.getImageArray())
+                for span in stray.getSpans():
+                    y = span.getY()
+                    for x in range(span.getX0(), span.getX1() + 1):
+                        self.assertNotIn((x, y), owner)
+                        owner[(x, y)] = i
+                        self.assertFloatsAlmostEqual(next(values), imgArr[y - iy0, x - ix0], rtol=1e-6)
+            self.assertGreater(len(owner), 0)
+
+            def dist(tfoot, x, y):
+                # template pixels outside the parent's bbox are ignored
+                d = []
+                for span in tfoot.getSpans():
+                    x0 = max(span.getX0(), fbb.getMinX())
+                    x1 = min(span.getX1(), fbb.getMaxX())
+                    if span.getY() < fbb.getMinY() or span.getY() > fbb.getMaxY() or x0 > x1:
+                        continue
+                    dx = max(x0 - x, 0, x - x1)
+                    dy = abs(span.getY() - y)
+                    d.append(np.hypot(dx, dy) if euclidean else dx + dy)
+                return min(d)
+            for (x, y), i in owner.items():
+                dists = [dist(tfoot, x, y) for tfoot in self.tfoots]
+                self.assertAlmostEqual(dists[i], min(dists))
+
+    def testManyPeaks(self):
+        """Stray flux split by distance among enough peaks to use a spatial index."""
+        bbox = self.mimg.getBBox()
+        foot = afwDet.Footprint(afwGeom.SpanSet(bbox))
+        timgs, tfoots, pkx, pky = [], [], [], []
+        for k in range(100):
+            cx = np.random.randint(bbox.getMinX(), bbox.getMaxX() + 1)
+            cy = np.random.randint(bbox.getMinY(), bbox.getMaxY() + 1)
+            tfoot = afwDet.Footprint(afwGeom.SpanSet.fromShape(0, afwGeom.Stencil.BOX, (cx, cy)))
+            timg = afwImage.ImageF(tfoot.getBBox())
+            timg.set(1.)
+            timgs.append(timg)
+            tfoots.append(tfoot)
+            pkx.append(cx)
+            pky.append(cy)
+        ispsf = [k % 3 == 0 for k in range(len(timgs))]
+        clip = 0.05
+        opts = (butils.ASSIGN_STRAYFLUX | butils.STRAYFLUX_TO_POINT_SOURCES_WHEN_NECESSARY)
+        tsum = afwImage.ImageF(bbox)
+        portions, strays = butils.apportionFlux(self.mimg, foot, timgs, tfoots, tsum,
+                                                ispsf, pkx, pky, opts, clip)
+
+        expected = np.zeros((len(timgs),) + tsum.getArray().shape)
+        imgArr = self.mimg.getImage().getArray()
+        sumArr = tsum.getArray()
+        use = ~np.array(ispsf)
+        pkx = np.array(pkx)[use]
+        pky = np.array(pky)[use]
+        for (j, i), v in np.ndenumerate(imgArr):
+            if v <= 0 or sumArr[j, i] > 0:
+                continue
+            x = i + bbox.getMinX()
+            y = j + bbox.getMinY()
+            w = 1./(1. + (pkx - x)**2 + (pky - y)**2)
+            w[w < clip*w.sum()] = 0.
+            expected[use, j, i] = v*w/w.sum()
+        for i, stray in enumerate(strays):
+            got = np.zeros(tsum.getArray().shape)
+            if stray is not None:
+                img = afwImage.ImageF(bbox)
+                stray.insert(img)
+                got = img.getArray()
+            self.assertFloatsAlmostEqual(got, expected[i], rtol=1e-5, atol=1e-5)
+
+    def testWeightTemplates(self):
+        """Template weights from the normal equations match a dense least-squares fit"""
+        timgs = list(self.timgs)
+        # a template with no pixels in the parent footprint gets no weight
+        outside = afwImage.ImageF(afwGeom.Box2I(afwGeom.Point2I(42, 21), afwGeom.Extent2I(3, 3)))
+        outside.set(1.)
+        timgs.append(outside)
+        weights = butils.weightTemplates(self.mimg, self.foot, timgs)
+
+        fbb = self.foot.getBBox()
+        infoot = np.zeros((fbb.getHeight(), fbb.getWidth()), dtype=bool)
+        x0, y0 = fbb.getMinX(), fbb.getMinY()
+        for span in self.foot.getSpans():
+            infoot[span.getY() - y0, span.getX0() - x0:span.getX1() + 1 - x0] = True
+        A = np.zeros((infoot.sum(), len(timgs)))
+        for i, timg in enumerate(timgs):
+            full = np.zeros(infoot.shape)
+            tbb = timg.getBBox()
+            tbb.clip(fbb)
+            if not tbb.isEmpty():
+                full[tbb.getMinY() - y0:tbb.getMaxY() + 1 - y0,
+                     tbb.getMinX() - x0:tbb.getMaxX() + 1 - x0] = timg.Factory(timg, tbb).getArray()
+            A[:, i] = full[infoot]
+        img = self.mimg.getImage().Factory(self.mimg.getImage(), fbb).getArray()
+        expected = np.linalg.lstsq(A, img[infoot].astype(float), rcond=-1)[0]
+        self.assertFloatsAlmostEqual(np.array(weights), expected, rtol=1e-6, atol=1e-10)
+        self.assertEqual(weights[-1], 0.)
+
+
+class TestMemory(lsst.utils.tests.MemoryTestCase):
+    pass
+
+
+def setup_module(module):
+    lsst.utils.tests.init()
+
+
+if __name__ == "__main__":
+    lsst.utils.tests.init()
+    unittest.main()
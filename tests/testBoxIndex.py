@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+#
+# LSST Data Management System
+#
+# Copyright 2008-2017  AURA/LSST.
+#
+# This product includes software developed by the
+# LSST Project (http://www.lsst.org/).
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the LSST License Statement and
+# the GNU General Public License along with this program.  If not,
+# see <https://www.lsstcorp.org/LegalNotices/>.
+#
+from __future__ import print_function
+import unittest
+
+import numpy as np
+
+import lsst.utils.tests
+import lsst.afw.geom as afwGeom
+from lsst.meas.deblender import BoxIndex
+
+
+class BoxIndexTestCase(lsst.utils.tests.TestCase):
+
+    def setUp(self):
+        np.random.seed(11)
+        self.boxes = []
+        for k in range(200):
+            x, y = np.random.randint(-50, 250, size=2)
+            w, h = np.random.randint(1, 30, size=2)
+            self.boxes.append(afwGeom.Box2I(afwGeom.Point2I(int(x), int(y)),
+                                            afwGeom.Extent2I(int(w), int(h))))
+        # a big one, and empty ones, which overlap nothing
+        self.boxes[3] = afwGeom.Box2I(afwGeom.Point2I(0, 0), afwGeom.Extent2I(150, 120))
+        self.boxes[10] = afwGeom.Box2I()
+        self.boxes[50] = afwGeom.Box2I()
+
+    def testPairs(self):
+        expected = [(i, j) for i in range(len(self.boxes)) for j in range(i + 1, len(self.boxes))
+                    if self.boxes[i].overlaps(self.boxes[j])]
+        self.assertGreater(len(expected), 0)
+        for cellSize in (0, 1, 7, 1000):
+            index = BoxIndex(self.boxes, cellSize)
+            self.assertEqual(index.size(), len(self.boxes))
+            self.assertEqual([tuple(p) for p in index.getOverlappingPairs()], expected)
+
+    def testQuery(self):
+        index = BoxIndex(self.boxes)
+        for box in [afwGeom.Box2I(afwGeom.Point2I(20, 30), afwGeom.Extent2I(5, 40)),
+                    afwGeom.Box2I(afwGeom.Point2I(-100, -100), afwGeom.Extent2I(500, 500)),
+                    afwGeom.Box2I(afwGeom.Point2I(1000, 1000), afwGeom.Extent2I(3, 3)),
+                    afwGeom.Box2I()]:
+            expected = [i for i, b in enumerate(self.boxes) if b.overlaps(box)]
+            self.assertEqual(list(index.query(box)), expected)
+
+    def testEmpty(self):
+        index = BoxIndex([afwGeom.Box2I()])
+        self.assertEqual(list(index.getOverlappingPairs()), [])
+        self.assertEqual(list(index.query(afwGeom.Box2I(afwGeom.Point2I(0, 0), afwGeom.Extent2I(3, 3)))), [])
+        with self.assertRaises(Exception):
+            BoxIndex(self.boxes, -1)
+
+
+class TestMemory(lsst.utils.tests.MemoryTestCase):
+    pass
+
+
+def setup_module(module):
+    lsst.utils.tests.init()
+
+
+if __name__ == "__main__":
+    lsst.utils.tests.init()
+    unittest.main()
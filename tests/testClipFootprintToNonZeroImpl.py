@@ -26,10 +26,13 @@
 from __future__ import print_function
 import unittest
 
+import numpy as np
+
 import lsst.utils.tests
 import lsst.afw.detection as afwDet
 import lsst.afw.geom as afwGeom
 import lsst.afw.image as afwImage
+from lsst.meas.deblender import BaselineUtilsF as butils
 from lsst.meas.deblender.plugins import clipFootprintToNonzeroImpl
 
 
@@ -60,6 +63,42 @@ class ClipFootprintTestCase(lsst.utils.tests.TestCase):
 
         self.assertEqual(foot.spans, span1)
 
+    def testClipF(self):
+        """The C++ clipping of float templates, singly and in a batch, matches the
+        python version on an integer image; the footprints hang over the image's edges."""
+        np.random.seed(5)
+        bbox = afwGeom.Box2I(afwGeom.Point2I(3, -4), afwGeom.Extent2I(37, 25))
+        imgs = []
+        for k in range(3):
+            im = afwImage.ImageF(bbox)
+            arr = im.getArray()
+            arr[:, :] = np.random.uniform(-1, 1, size=arr.shape)
+            # long runs of zeros, and a few stray pixels
+            arr[np.random.uniform(size=arr.shape) < 0.8] = 0.
+            arr[:, 20:] = 0.
+            arr[5, :] = 0.
+            arr[7, 18] = -0.5
+            imgs.append(im)
+        spans = afwGeom.SpanSet.fromShape(14, afwGeom.Stencil.CIRCLE, (12, 8))
+        for im in imgs:
+            foot = afwDet.Footprint(spans)
+            expected = afwDet.Footprint(spans)
+            imI = afwImage.ImageI(bbox)
+            imI.getArray()[:, :] = np.sign(im.getArray())
+            clipFootprintToNonzeroImpl(expected, imI)
+            butils.clipFootprintToNonzero(foot, im)
+            self.assertEqual(foot.spans, expected.spans)
+
+        tfoots = [afwDet.Footprint(spans) for im in imgs] + [None]
+        timgs = butils.clipFootprintsToNonzero(tfoots, imgs + [None])
+        self.assertIsNone(timgs[-1])
+        for im, tfoot, timg in zip(imgs, tfoots, timgs):
+            expected = afwDet.Footprint(spans)
+            butils.clipFootprintToNonzero(expected, im)
+            self.assertEqual(tfoot.spans, expected.spans)
+            self.assertEqual(timg.getBBox(), tfoot.getBBox())
+            self.assertFloatsEqual(timg.getArray(), im.Factory(im, tfoot.getBBox()).getArray())
+
 
 class TestMemory(lsst.utils.tests.MemoryTestCase):
     pass
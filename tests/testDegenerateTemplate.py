@@ -30,6 +30,7 @@ import lsst.afw.detection as afwDet
 import lsst.afw.geom as afwGeom
 import lsst.afw.image as afwImage
 from lsst.meas.deblender.baseline import deblend
+from lsst.meas.deblender import TemplateGramF
 import lsst.meas.algorithms as measAlg
 
 def imExt(img):
@@ -104,6 +105,75 @@ class DegenerateTemplateTestCase(lsst.utils.tests.TestCase):
         self.assertTrue(deb.deblendedParents[0].peaks[4].degenerate)
         self.assertTrue(deb.deblendedParents[0].peaks[5].degenerate)
 
+    def testTemplateGram(self):
+        """TemplateGram dot products and rejections match HeavyFootprint.dot and a brute-force scan"""
+        np.random.seed(3)
+        timgs, tfoots, heavies = [], [], []
+        for k in range(12):
+            cx, cy = np.random.randint(10, 40, size=2)
+            tfoot = afwDet.Footprint(afwGeom.SpanSet.fromShape(int(np.random.randint(2, 8)),
+                                                               afwGeom.Stencil.CIRCLE, (cx, cy)))
+            tbb = tfoot.getBBox()
+            tbb.grow(1)
+            timg = afwImage.ImageF(tbb)
+            timg.getArray()[:, :] = np.random.uniform(-0.2, 1, size=timg.getArray().shape)
+            timgs.append(timg)
+            tfoots.append(tfoot)
+            heavies.append(afwDet.makeHeavyFootprint(tfoot, afwImage.MaskedImageF(timg)))
+        # a template that was skipped
+        timgs[4] = tfoots[4] = None
+        gram = TemplateGramF(timgs, tfoots)
+        self.assertEqual(gram.size(), len(timgs))
+        self.assertFalse(gram.isActive(4))
+        use = [i for i, timg in enumerate(timgs) if timg is not None]
+        got = np.array([[gram.dot(i, j) for j in use] for i in use])
+        expected = np.array([[heavies[i].dot(heavies[j]) for j in use] for i in use])
+        self.assertFloatsAlmostEqual(got, expected, rtol=1e-6, atol=1e-8)
+
+        weights = np.ones(len(timgs))
+        active = [timg is not None for timg in timgs]
+
+        def bruteForce(maxTempDotProd):
+            # the scan reconstructTemplates made over the dense matrix
+            for i in range(len(timgs)):
+                if not active[i]:
+                    continue
+                currentMax, found = 0., None
+                for j in range(i):
+                    if not active[j]:
+                        continue
+                    norm = heavies[i].dot(heavies[i])*heavies[j].dot(heavies[j])
+                    c = 0.
+                    if norm > 0:
+                        c = np.sign(weights[i]*weights[j])*heavies[i].dot(heavies[j])/np.sqrt(norm)
+                    if c > currentMax:
+                        currentMax = c
+                        if currentMax > maxTempDotProd:
+                            found = (i, j)
+                if found is not None:
+                    return found + (currentMax,)
+            return None
+
+        gram.scale(2, -0.5)
+        weights[2] = -0.5
+        gram.scale(7, 3.)
+        weights[7] = 3.
+        removed = 0
+        while True:
+            expected = bruteForce(0.1)
+            got = gram.findDegenerate(0.1)
+            if expected is None:
+                self.assertIsNone(got)
+                break
+            self.assertEqual(got[:2], expected[:2])
+            self.assertAlmostEqual(got[2], expected[2], places=5)
+            # remove either of the pair
+            reject = got[removed % 2]
+            gram.remove(reject)
+            active[reject] = False
+            removed += 1
+        self.assertGreater(removed, 0)
+
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 
@@ -32,7 +32,8 @@ import lsst.afw.geom as afwGeom
 import lsst.afw.image as afwImage
 from lsst.log import Log
 import lsst.meas.algorithms as measAlg
-from lsst.meas.deblender.plugins import _fitPsf
+from lsst.meas.deblender.plugins import _fitPsf, _applyPsfFit
+from lsst.meas.deblender import PsfFitterF
 from lsst.meas.deblender.baseline import DeblendedPeak, CachingPsf
 
 doPlot = False
@@ -171,6 +172,72 @@ class FitPsfTestCase(unittest.TestCase):
                 continue
             print('  ', k, getattr(pkres, k))
 
+    def testFitter(self):
+        """PsfFitterF fits all peaks at once, with the results of _fitPsf"""
+        np.random.seed(42)
+        fp = afwDet.Footprint(afwGeom.SpanSet.fromShape(45, offset=(50, 50)))
+        fbb = fp.getBBox()
+        psfsig = 1.5
+        psffwhm = psfsig * 2.35
+        psf = measAlg.DoubleGaussianPsf(11, 11, psfsig)
+        sig1 = 10.
+
+        mimg = afwImage.MaskedImageF(fbb)
+        img = mimg.getImage()
+        img.getArray()[:, :] = np.random.normal(0, sig1, size=(fbb.getHeight(), fbb.getWidth()))
+        mimg.getVariance().set(sig1**2)
+        # a patch of masked-out (zero-variance) pixels
+        mimg.getVariance().getArray()[60:70, 20:30] = 0.
+
+        peaks = fp.getPeaks()
+        # isolated, blended, shifted, faint, near the edge, extended, masked
+        for x, y, flux, sigma in [(20., 30., 10000., psfsig), (23., 33., 5000., psfsig),
+                                  (70.4, 70., 8000., psfsig), (50., 50., 100., psfsig),
+                                  (6., 50., 8000., psfsig), (60., 30., 20000., 4.),
+                                  (25., 65., 5000., psfsig)]:
+            pk = peaks.addNew()
+            pk.setFx(x)
+            pk.setFy(y)
+            pk.setIx(int(x))
+            pk.setIy(int(y))
+            yy, xx = np.mgrid[fbb.getMinY():fbb.getMaxY()+1, fbb.getMinX():fbb.getMaxX()+1]
+            xc = x + (0.3 if x == 70.4 else 0.)
+            img.getArray()[:, :] += (flux/(2.*np.pi*sigma**2) *
+                                     np.exp(-0.5*((xx - xc)**2 + (yy - y)**2)/sigma**2))
+
+        fmask = afwImage.Mask(fbb)
+        fmask.setXY0(fbb.getMinX(), fbb.getMinY())
+        fp.spans.setMask(fmask, 1)
+        peaksF = [pk.getF() for pk in peaks]
+        log = Log.getLogger('tests.fit_psf')
+        cpsf = CachingPsf(psf)
+
+        fitter = PsfFitterF()
+        fits = fitter.fit(mimg, fp, psf, psffwhm, len(peaks))
+        self.assertEqual(len(fits), len(peaks))
+        nPsf = 0
+        for pki, (pk, fit) in enumerate(zip(peaks, fits)):
+            expected = DeblendedPeak(pk, pki, None)
+            ispsf = _fitPsf(fp, fmask, pk, peaksF[pki], expected, fbb, peaks, peaksF, log, cpsf, psffwhm,
+                            img, mimg.getVariance(), 1.5, 1.5, 1.5)
+            got = DeblendedPeak(pk, pki, None)
+            self.assertEqual(_applyPsfFit(fit, fp, got, log, cpsf), ispsf)
+            nPsf += bool(ispsf)
+            for k in ['outOfBounds', 'tinyFootprint', 'noValidPixels', 'psfFitFailed', 'psfFitBadDof',
+                      'deblendedAsPsf', 'psfFitBigDecenter', 'psfFitWithDecenter', 'psfFitR0', 'psfFitR1',
+                      'psfFitStampExtent', 'psfFitNOthers']:
+                self.assertEqual(getattr(got, k), getattr(expected, k), k)
+            for k in ['psfFit1', 'psfFit2', 'psfFit3', 'psfFitCenter', 'psfFitBest', 'psfFitParams']:
+                if getattr(expected, k) is None:
+                    self.assertIsNone(getattr(got, k), k)
+                else:
+                    np.testing.assert_allclose(getattr(got, k), getattr(expected, k),
+                                               rtol=1e-6, atol=1e-8, err_msg=k)
+            if ispsf:
+                self.assertEqual(got.templateFootprint.getSpans(), expected.templateFootprint.getSpans())
+                np.testing.assert_allclose(got.templateImage.getArray(), expected.templateImage.getArray(),
+                                           rtol=1e-6)
+        self.assertGreater(nPsf, 0)
 
 #-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -0,0 +1,126 @@
+
+
+#!/usr/bin/env python
+#
+# LSST Data Management System
+#
+# Copyright 2008-2017  AURA/LSST.
+#
+# This product includes software developed by the
+# LSST Project (http://www.lsst.org/).
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the LSST License Statement and
+# the GNU General Public License along with this program.  If not,
+# see <https://www.lsstcorp.org/LegalNotices/>.
+#
+from __future__ import print_function
+import unittest
+
+import numpy as np
+
+import lsst.utils.tests
+import lsst.afw.detection as afwDet
+import lsst.afw.geom as afwGeom
+import lsst.afw.image as afwImage
+from lsst.meas.deblender import BaselineUtilsF as butils
+
+
+def bruteForceMedian(arr, halfsize, outarr):
+    """Median filter as medianFilter does it into outarr: pixels within
+    halfsize of the edge are copied, and the rightmost median column is
+    overwritten too -- except that the last column of the rows that are
+    filtered is never written, so keeps the value in outarr."""
+    H, W = arr.shape
+    out = arr.copy()
+    S = 2*halfsize + 1
+    for y in range(halfsize, H - halfsize):
+        for x in range(halfsize, W - halfsize - 1):
+            box = arr[y - halfsize:y + halfsize + 1, x - halfsize:x + halfsize + 1]
+            out[y, x] = np.sort(box, axis=None)[(S*S)//2]
+    if halfsize > 0:
+        out[halfsize:H - halfsize, W - 1] = outarr[halfsize:H - halfsize, W - 1]
+    return out
+
+
+def bruteForceTruncatedMedian(arr, halfsize, y, x):
+    """Median of the box around (y, x) clipped to the array."""
+    H, W = arr.shape
+    box = arr[max(y - halfsize, 0):min(y + halfsize + 1, H),
+              max(x - halfsize, 0):min(x + halfsize + 1, W)]
+    vals = np.sort(box, axis=None)
+    return vals[len(vals)//2]
+
+
+class MedianFilterTestCase(lsst.utils.tests.TestCase):
+    """Check that medianFilter matches a brute-force median for every
+    halfsize, covering both the nth_element and sliding-window engines."""
+
+    def setUp(self):
+        np.random.seed(42)
+
+    def checkMedian(self, arr):
+        H, W = arr.shape
+        img = afwImage.ImageF(afwGeom.Box2I(afwGeom.Point2I(3, -4), afwGeom.Extent2I(W, H)))
+        img.getArray()[:, :] = arr
+        for halfsize in range(0, 6):
+            out = afwImage.ImageF(img.getBBox())
+            out.set(-100)
+            expected = bruteForceMedian(img.getArray(), halfsize, out.getArray())
+            butils.medianFilter(img, out, halfsize)
+            self.assertFloatsEqual(out.getArray(), expected)
+
+    def testRandom(self):
+        self.checkMedian(np.random.normal(size=(23, 31)).astype(np.float32))
+
+    def testTies(self):
+        # lots of repeated values, including zeros
+        self.checkMedian(np.random.randint(-2, 3, size=(19, 17)).astype(np.float32))
+
+    def testFootprint(self):
+        W, H = 21, 18
+        x0, y0 = -5, 7
+        img = afwImage.ImageF(afwGeom.Box2I(afwGeom.Point2I(x0, y0), afwGeom.Extent2I(W, H)))
+        img.getArray()[:, :] = np.random.normal(size=(H, W))
+        # a footprint running off the corner of the image
+        spans = afwGeom.SpanSet.fromShape(7, afwGeom.Stencil.CIRCLE, (x0 + 3, y0 + 12))
+        foot = afwDet.Footprint(spans)
+        infoot = np.zeros((H, W), dtype=bool)
+        for span in spans:
+            for x in range(span.getX0(), span.getX1() + 1):
+                if 0 <= x - x0 < W and 0 <= span.getY() - y0 < H:
+                    infoot[span.getY() - y0, x - x0] = True
+        for halfsize in range(0, 6):
+            out = afwImage.ImageF(img.getBBox())
+            out.set(-100)
+            butils.medianFilter(img, out, halfsize, foot)
+            arr = img.getArray()
+            outarr = out.getArray()
+            for y in range(H):
+                for x in range(W):
+                    if infoot[y, x]:
+                        self.assertEqual(outarr[y, x], bruteForceTruncatedMedian(arr, halfsize, y, x))
+                    else:
+                        self.assertEqual(outarr[y, x], -100)
+
+
+class TestMemory(lsst.utils.tests.MemoryTestCase):
+    pass
+
+
+def setup_module(module):
+    lsst.utils.tests.init()
+
+
+if __name__ == "__main__":
+    lsst.utils.tests.init()
+    unittest.main()
@@ -0,0 +1,114 @@
+
+
+#!/usr/bin/env python
+#
+# LSST Data Management System
+#
+# Copyright 2008-2017  AURA/LSST.
+#
+# This product includes software developed by the
+# LSST Project (http://www.lsst.org/).
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the LSST License Statement and
+# the GNU General Public License along with this program.  If not,
+# see <https://www.lsstcorp.org/LegalNotices/>.
+#
+from __future__ import print_function
+import unittest
+
+import numpy as np
+
+import lsst.utils.tests
+import lsst.afw.detection as afwDet
+import lsst.afw.geom as afwGeom
+import lsst.afw.image as afwImage
+from lsst.meas.deblender import BaselineUtilsF as butils
+
+
+class MonotonicTestCase(lsst.utils.tests.TestCase):
+    """Check the two algorithms for making templates monotonic."""
+
+    def setUp(self):
+        np.random.seed(12)
+        self.peaks = afwDet.PeakCatalog(afwDet.PeakTable.makeMinimalSchema())
+
+    def makePeak(self, x, y):
+        p = self.peaks.addNew()
+        p.setFx(x)
+        p.setFy(y)
+        p.setIx(int(x))
+        p.setIy(int(y))
+        return p
+
+    def makeImage(self):
+        img = afwImage.ImageF(afwGeom.Box2I(afwGeom.Point2I(10, -3), afwGeom.Extent2I(27, 22)))
+        img.getArray()[:, :] = np.random.uniform(0, 100, size=(22, 27))
+        return img
+
+    def checkRadial(self, cx, cy):
+        img = self.makeImage()
+        before = img.getArray().copy()
+        butils.makeMonotonicRadial(img, self.makePeak(cx, cy))
+        arr = img.getArray()
+        self.assertTrue(np.all(arr <= before))
+        H, W = arr.shape
+        cx -= img.getX0()
+        cy -= img.getY0()
+        for y in range(H):
+            for x in range(W):
+                dx, dy = x - cx, y - cy
+                if dx == 0 and dy == 0:
+                    self.assertEqual(arr[y, x], before[y, x])
+                    continue
+                sx, sy = np.sign(dx), np.sign(dy)
+                nearer = [(x - sx, y - sy)]
+                if abs(dx) > abs(dy):
+                    nearer.append((x - sx, y))
+                elif abs(dy) > abs(dx):
+                    nearer.append((x, y - sy))
+                for nx, ny in nearer:
+                    if 0 <= nx < W and 0 <= ny < H:
+                        self.assertLessEqual(arr[y, x], arr[ny, nx])
+        # applying it again changes nothing
+        again = img.Factory(img, True)
+        butils.makeMonotonicRadial(again, self.makePeak(cx + img.getX0(), cy + img.getY0()))
+        self.assertFloatsEqual(again.getArray(), arr)
+
+    def testRadial(self):
+        self.checkRadial(20, 5)
+        # peak on the edge, and outside the image
+        self.checkRadial(10, 18)
+        self.checkRadial(40, -6)
+
+    def testShadow(self):
+        img = self.makeImage()
+        before = img.getArray().copy()
+        pk = self.makePeak(20, 5)
+        butils.makeMonotonic(img, pk)
+        arr = img.getArray()
+        self.assertTrue(np.all(arr <= before))
+        cx, cy = 20 - img.getX0(), 5 - img.getY0()
+        self.assertEqual(arr[cy, cx], before[cy, cx])
+
+
+class TestMemory(lsst.utils.tests.MemoryTestCase):
+    pass
+
+
+def setup_module(module):
+    lsst.utils.tests.init()
+
+
+if __name__ == "__main__":
+    lsst.utils.tests.init()
+    unittest.main()
@@ -0,0 +1,134 @@
+#!/usr/bin/env python
+#
+# LSST Data Management System
+#
+# Copyright 2008-2017  AURA/LSST.
+#
+# This product includes software developed by the
+# LSST Project (http://www.lsst.org/).
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the LSST License Statement and
+# the GNU General Public License along with this program.  If not,
+# see <https://www.lsstcorp.org/LegalNotices/>.
+#
+from __future__ import print_function
+import unittest
+
+import numpy as np
+
+import lsst.utils.tests
+import lsst.afw.detection as afwDet
+import lsst.afw.geom as afwGeom
+from lsst.meas.deblender import PsfImageCache
+
+
+class PsfImageCacheTestCase(lsst.utils.tests.TestCase):
+
+    def setUp(self):
+        self.psf = afwDet.GaussianPsf(15, 15, 1.5)
+
+    def assertImagesEqual(self, im1, im2):
+        self.assertEqual(im1.getBBox(), im2.getBBox())
+        self.assertFloatsEqual(im1.getArray(), im2.getArray())
+
+    def testExact(self):
+        cache = PsfImageCache(self.psf)
+        pos = afwGeom.Point2D(20.3, 31.7)
+        im = cache.computeImage(pos)
+        self.assertImagesEqual(im, self.psf.computeImage(pos))
+        self.assertEqual((cache.getHits(), cache.getMisses()), (0, 1))
+        self.assertEqual(cache.getBytes(), 8*im.getWidth()*im.getHeight())
+        # python gets a copy, so can't spoil the cached image
+        im *= 2.
+        self.assertImagesEqual(cache.computeImage(pos), self.psf.computeImage(pos))
+        self.assertEqual((cache.getHits(), cache.getMisses()), (1, 1))
+        cache.computeImage(afwGeom.Point2D(20.3, 31.70001))
+        self.assertEqual(cache.getMisses(), 2)
+
+    def testGrid(self):
+        cache = PsfImageCache(self.psf, 0.25)
+        node = afwGeom.Point2D(20.25, 31.75)
+        for pos in [(20.3, 31.7), (20.2, 31.8), (20.25, 31.75)]:
+            self.assertImagesEqual(cache.computeImage(afwGeom.Point2D(*pos)), self.psf.computeImage(node))
+        self.assertEqual((cache.getHits(), cache.getMisses()), (2, 1))
+
+    def testInterpolate(self):
+        cache = PsfImageCache(self.psf, 0.125, interpolate=True)
+        node = afwGeom.Point2D(20.25, 31.75)
+        self.assertImagesEqual(cache.computeImage(node), self.psf.computeImage(node))
+        for pos in [(20.33, 31.71), (20.47, 31.02), (20.52, 31.47)]:
+            pos = afwGeom.Point2D(*pos)
+            im = cache.computeImage(pos)
+            expected = self.psf.computeImage(pos)
+            self.assertEqual(im.getBBox(), expected.getBBox())
+            self.assertFloatsAlmostEqual(im.getArray(), expected.getArray(),
+                                         atol=0.01*expected.getArray().max())
+            self.assertFloatsAlmostEqual(im.getArray().sum(), expected.getArray().sum(), rtol=1e-2)
+
+    def testCoarseGrid(self):
+        """On grids coarser than a pixel, images are moved to the position asked for"""
+        for interpolate in (False, True):
+            cache = PsfImageCache(self.psf, 8., interpolate=interpolate)
+            for pos in [(20.3, 31.7), (20.47, 31.02), (45.9, 3.2)]:
+                pos = afwGeom.Point2D(*pos)
+                im = cache.computeImage(pos)
+                expected = self.psf.computeImage(pos)
+                self.assertEqual(im.getBBox(), expected.getBBox())
+                arr = im.getArray()
+                y, x = np.unravel_index(np.argmax(arr), arr.shape)
+                self.assertEqual((x + im.getX0(), y + im.getY0()),
+                                 (int(np.floor(pos.getX() + 0.5)), int(np.floor(pos.getY() + 0.5))))
+                self.assertFloatsAlmostEqual(arr, expected.getArray(), atol=0.25*expected.getArray().max())
+        # moved images share the cached pixels, which are not changed
+        cache = PsfImageCache(self.psf, 8.)
+        cache.computeImage(afwGeom.Point2D(20.3, 31.7))
+        node = afwGeom.Point2D(24., 32.)
+        self.assertImagesEqual(cache.computeImage(node), self.psf.computeImage(node))
+        self.assertEqual((cache.getHits(), cache.getMisses()), (1, 1))
+
+    def testEviction(self):
+        pos1 = afwGeom.Point2D(20.3, 31.7)
+        im = self.psf.computeImage(pos1)
+        nbytes = 8*im.getWidth()*im.getHeight()
+        cache = PsfImageCache(self.psf, maxBytes=2*nbytes)
+        positions = [pos1, afwGeom.Point2D(40., 10.), afwGeom.Point2D(5., 5.)]
+        for pos in positions:
+            cache.computeImage(pos)
+        self.assertEqual(cache.getBytes(), 2*nbytes)
+        # the most recently used are kept
+        cache.computeImage(positions[2])
+        cache.computeImage(positions[1])
+        self.assertEqual((cache.getHits(), cache.getMisses()), (2, 3))
+        cache.computeImage(pos1)
+        self.assertEqual(cache.getMisses(), 4)
+        cache.clear()
+        self.assertEqual(cache.getBytes(), 0)
+
+    def testBadArgs(self):
+        with self.assertRaises(Exception):
+            PsfImageCache(self.psf, -1.)
+        with self.assertRaises(Exception):
+            PsfImageCache(self.psf, interpolate=True)
+
+
+class TestMemory(lsst.utils.tests.MemoryTestCase):
+    pass
+
+
+def setup_module(module):
+    lsst.utils.tests.init()
+
+
+if __name__ == "__main__":
+    lsst.utils.tests.init()
+    unittest.main()
@@ -0,0 +1,284 @@
+
+
+#!/usr/bin/env python
+#
+# LSST Data Management System
+#
+# Copyright 2008-2017  AURA/LSST.
+#
+# This product includes software developed by the
+# LSST Project (http://www.lsst.org/).
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the LSST License Statement and
+# the GNU General Public License along with this program.  If not,
+# see <https://www.lsstcorp.org/LegalNotices/>.
+#
+from __future__ import print_function
+import unittest
+
+import numpy as np
+
+import lsst.utils.tests
+import lsst.pex.exceptions
+import lsst.afw.detection as afwDet
+import lsst.afw.geom as afwGeom
+import lsst.afw.image as afwImage
+from lsst.meas.deblender import BaselineUtilsF as butils
+from lsst.meas.deblender import SpanIndex, TemplatePipelineF
+from lsst.meas.deblender.plugins import clipFootprintToNonzeroImpl
+
+
+def makeSpanSet(mask, x0, y0):
+    """SpanSet of the True pixels of a boolean array with origin x0, y0."""
+    spans = []
+    for j, row in enumerate(mask):
+        for i in np.flatnonzero(row):
+            spans.append(afwGeom.Span(y0 + j, x0 + int(i), x0 + int(i)))
+    return afwGeom.SpanSet(spans)
+
+
+def pixels(spanset):
+    return set((x, span.getY()) for span in spanset for x in range(span.getX0(), span.getX1() + 1))
+
+
+def rampReference(mimg, fp, t1, tfoot, pk, psfim, S, patchEdges):
+    """rampFluxAtEdge done the long way, painting the ramp into a padded copy of the image."""
+    tbb = tfoot.getBBox()
+    tbb.grow(S)
+    fpcopy = afwDet.Footprint(fp)
+    fpcopy.dilate(S)
+    fpcopy.setSpans(fpcopy.spans.clippedTo(tbb))
+    padim = mimg.Factory(tbb)
+    fpcopy.spans.clippedTo(mimg.getBBox()).copyMaskedImage(mimg, padim)
+    ramped = t1.Factory(tbb)
+    Tout = ramped.getArray()
+    P = psfim.getArray()
+    pbb = psfim.getBBox()
+    for span in butils.getSignificantEdgePixels(t1, tfoot, -1e6).getSpans():
+        y = span.getY()
+        for x in range(span.getX0(), span.getX1() + 1):
+            slc = (slice(y + pbb.getMinY() - tbb.getMinY(), y + pbb.getMaxY() + 1 - tbb.getMinY()),
+                   slice(x + pbb.getMinX() - tbb.getMinX(), x + pbb.getMaxX() + 1 - tbb.getMinX()))
+            Tout[slc] = np.maximum(Tout[slc], t1.getArray()[y - t1.getY0(), x - t1.getX0()]*P)
+    I = (padim.getImage().getArray() == 0)
+    padim.getImage().getArray()[I] = Tout[I]
+    t2, tfoot2, patched = butils.buildSymmetricTemplate(padim, fpcopy, pk, 1., True, patchEdges)
+    tfoot2.clipTo(mimg.getBBox())
+    return t2.Factory(t2, tfoot2.getBBox(), afwImage.PARENT, True), tfoot2, patched
+
+
+class SymmetrizeTestCase(lsst.utils.tests.TestCase):
+
+    def setUp(self):
+        np.random.seed(11)
+        # a footprint with holes and gaps, including whole empty rows
+        mask = np.random.uniform(size=(25, 30)) < 0.7
+        mask[7, :] = False
+        self.spans = makeSpanSet(mask, -4, 3)
+        self.foot = afwDet.Footprint(self.spans)
+
+    def testSymmetrize(self):
+        """The symmetric footprint is the AND of the footprint and its mirror."""
+        index = SpanIndex(self.spans)
+        pix = pixels(self.spans)
+        for (cx, cy) in list(pix)[::37]:
+            expected = set((x, y) for (x, y) in pix if (2*cx - x, 2*cy - y) in pix)
+            sfoot = butils.symmetrizeFootprint(self.foot, cx, cy)
+            self.assertEqual(pixels(sfoot.getSpans()), expected)
+            sfoot = butils.symmetrizeFootprint(self.foot, index, cx, cy)
+            self.assertEqual(pixels(sfoot.getSpans()), expected)
+        # no footprint when the peak is outside
+        self.assertIsNone(butils.symmetrizeFootprint(self.foot, index, -100, -100))
+
+    def testEdgePixels(self):
+        index = SpanIndex(self.spans)
+        self.assertEqual(index.getBBox(), self.spans.getBBox())
+        self.assertEqual(pixels(index.findEdgePixels()), pixels(self.spans.findEdgePixels()))
+
+    def testEdgeMaskPixels(self):
+        """Templates built with the parent's EDGE pixels found up front
+        match those built from scratch."""
+        bbox = self.spans.getBBox()
+        mimg = afwImage.MaskedImageF(bbox)
+        mimg.getImage().getArray()[:, :] = np.random.uniform(0, 10, size=mimg.getImage().getArray().shape)
+        edgebit = mimg.getMask().getPlaneBitMask("EDGE")
+        marr = mimg.getMask().getArray()
+        marr[:, :3] = edgebit
+        marr[5, 10:14] = edgebit | 1
+        edgePixels = butils.findEdgeMaskPixels(mimg, self.foot)
+        x0, y0 = mimg.getX0(), mimg.getY0()
+        expected = set((x, y) for (x, y) in pixels(self.spans) if marr[y - y0, x - x0] & edgebit)
+        self.assertGreater(len(expected), 0)
+        self.assertEqual(pixels(edgePixels), expected)
+
+        index = SpanIndex(self.spans)
+        npatched = 0
+        for (cx, cy) in list(pixels(self.spans))[::37]:
+            peak = self.foot.getPeaks().addNew()
+            peak.setIx(cx)
+            peak.setIy(cy)
+            timg1, tfoot1, patched1 = butils.buildSymmetricTemplate(mimg, self.foot, peak, 1., True, True)
+            timg2, tfoot2, patched2 = butils.buildSymmetricTemplate(mimg, self.foot, index, edgePixels,
+                                                                    peak, 1., True, True)
+            sfoot = butils.symmetrizeFootprint(self.foot, cx, cy)
+            self.assertEqual(patched1, len(pixels(sfoot.getSpans()) & expected) > 0)
+            self.assertEqual(patched2, patched1)
+            self.assertEqual(tfoot1.getSpans(), tfoot2.getSpans())
+            self.assertFloatsEqual(timg1.getArray(), timg2.getArray())
+            npatched += patched1
+        self.assertGreater(npatched, 0)
+
+    def testNanPeakRow(self):
+        """A NaN on the peak's own row is kept where the pixel-by-pixel min kept it."""
+        bbox = afwGeom.Box2I(afwGeom.Point2I(10, 20), afwGeom.Extent2I(5, 3))
+        foot = afwDet.Footprint(afwGeom.SpanSet(bbox))
+        mimg = afwImage.MaskedImageF(bbox)
+        arr = mimg.getImage().getArray()
+        arr[:, :] = np.random.uniform(0, 10, size=arr.shape)
+        arr[1, :] = [1, 2, 3, np.nan, 5]
+        peak = foot.getPeaks().addNew()
+        peak.setIx(12)
+        peak.setIy(21)
+        timg, tfoot, patched = butils.buildSymmetricTemplate(mimg, foot, peak, 1., False, False)
+        self.assertEqual(timg.getBBox(), bbox)
+        tarr = timg.getArray()
+        np.testing.assert_array_equal(tarr[1, :], [1, np.nan, 3, np.nan, 1])
+        expected = np.minimum(arr[0, :], arr[2, ::-1])
+        self.assertFloatsEqual(tarr[0, :], expected)
+        self.assertFloatsEqual(tarr[2, :], expected[::-1])
+
+    def testBuildAll(self):
+        """Templates built for all peaks at once match those built one by one."""
+        bbox = self.spans.getBBox()
+        mimg = afwImage.MaskedImageF(bbox)
+        mimg.getImage().getArray()[:, :] = np.random.uniform(-1, 10, size=mimg.getImage().getArray().shape)
+        mimg.getMask().getArray()[-2:, :] = mimg.getMask().getPlaneBitMask("EDGE")
+        for (cx, cy) in list(pixels(self.spans))[::23] + [(-100, -100)]:
+            peak = self.foot.getPeaks().addNew()
+            peak.setIx(cx)
+            peak.setIy(cy)
+        peaks = self.foot.getPeaks()
+        skip = [i % 4 == 1 for i in range(len(peaks))]
+        for nThreads in (1, 3):
+            timgs, tfoots, patched = butils.buildSymmetricTemplates(mimg, self.foot, peaks, skip, 1.,
+                                                                    False, True, nThreads=nThreads)
+            self.assertEqual(len(timgs), len(peaks))
+            for i, peak in enumerate(peaks):
+                if skip[i]:
+                    self.assertIsNone(timgs[i])
+                    self.assertIsNone(tfoots[i])
+                    continue
+                timg, tfoot, p = butils.buildSymmetricTemplate(mimg, self.foot, peak, 1., False, True)
+                if timg is None:
+                    self.assertIsNone(timgs[i])
+                    continue
+                self.assertEqual(patched[i], p)
+                self.assertEqual(tfoots[i].getSpans(), tfoot.getSpans())
+                self.assertFloatsEqual(timgs[i].getArray(), timg.getArray())
+        with self.assertRaises(lsst.pex.exceptions.LengthError):
+            butils.buildSymmetricTemplates(mimg, self.foot, peaks, [False], 1., False, True)
+
+    def testPipeline(self):
+        """The fused template pipeline matches running the stages one at a time."""
+        bbox = self.spans.getBBox()
+        mimg = afwImage.MaskedImageF(bbox)
+        mimg.getImage().getArray()[:, :] = np.random.uniform(-1, 10, size=mimg.getImage().getArray().shape)
+        for (cx, cy) in list(pixels(self.spans))[::23]:
+            peak = self.foot.getPeaks().addNew()
+            peak.setIx(cx)
+            peak.setIy(cy)
+        peaks = self.foot.getPeaks()
+        for radial, footprintOnly in [(False, False), (True, True)]:
+            pipeline = TemplatePipelineF()
+            pipeline.monotonicRadial = radial
+            pipeline.medianFilterFootprint = footprintOnly
+            pipeline.nThreads = 2
+            timgs, tfoots, patched, ramped, symmetric, sfoots = pipeline.run(mimg, self.foot, peaks, [], 1.,
+                                                                             keepSymmetric=True)
+            for i, peak in enumerate(peaks):
+                timg, tfoot, p = butils.buildSymmetricTemplate(mimg, self.foot, peak, 1., True, False)
+                if timg is None:
+                    self.assertIsNone(timgs[i])
+                    continue
+                self.assertFloatsEqual(symmetric[i].getArray(), timg.getArray())
+                self.assertEqual(sfoots[i].getSpans(), tfoot.getSpans())
+                inimg = timg.Factory(timg, True)
+                if footprintOnly:
+                    butils.medianFilter(inimg, timg, 2, tfoot)
+                elif timg.getWidth() >= 5 and timg.getHeight() >= 5:
+                    butils.medianFilter(inimg, timg, 2)
+                if radial:
+                    butils.makeMonotonicRadial(timg, peak)
+                else:
+                    butils.makeMonotonic(timg, peak)
+                clipFootprintToNonzeroImpl(tfoot, timg)
+                if not tfoot.getBBox().isEmpty() and tfoot.getBBox() != timg.getBBox(afwImage.PARENT):
+                    timg = timg.Factory(timg, tfoot.getBBox(), afwImage.PARENT, True)
+                self.assertEqual(tfoots[i].getSpans(), tfoot.getSpans())
+                self.assertEqual(timgs[i].getBBox(), timg.getBBox())
+                self.assertFloatsEqual(timgs[i].getArray(), timg.getArray())
+
+    def testRamp(self):
+        """Ramped templates match those from a padded copy of the image."""
+        bbox = self.spans.getBBox()
+        mimg = afwImage.MaskedImageF(bbox)
+        mimg.getImage().getArray()[:, :] = np.random.uniform(0, 10, size=mimg.getImage().getArray().shape)
+        mimg.getImage().getArray()[5, 3:9] = 0.
+        mimg.getMask().getArray()[:2, :] = mimg.getMask().getPlaneBitMask("EDGE")
+        psf = afwDet.GaussianPsf(11, 11, 1.5)
+        S = butils.getRampSize(3.5)
+        psfim = butils.getRampPsf(psf, self.foot.getBBox(), S)
+        self.assertEqual(psfim.getArray().max(), 1.)
+        for (cx, cy) in list(pixels(self.spans))[::23]:
+            peak = self.foot.getPeaks().addNew()
+            peak.setIx(cx)
+            peak.setIy(cy)
+        peaks = self.foot.getPeaks()
+        for patchEdges in (False, True):
+            pipeline = TemplatePipelineF()
+            pipeline.patchEdges = patchEdges
+            pipeline.rampFluxAtEdge = True
+            pipeline.medianSmoothTemplate = False
+            pipeline.monotonicTemplate = False
+            pipeline.clipFootprintToNonzero = False
+            timgs, tfoots, patched, ramped, symmetric, sfoots = pipeline.run(mimg, self.foot, peaks, [], 1.,
+                                                                             psf, 3.5)
+            self.assertTrue(any(ramped))
+            for i, peak in enumerate(peaks):
+                t1, tfoot, p = butils.buildSymmetricTemplate(mimg, self.foot, peak, 1., True, patchEdges)
+                if t1 is None:
+                    continue
+                self.assertEqual(ramped[i], butils.hasSignificantFluxAtEdge(t1, tfoot, 3.))
+                if not ramped[i]:
+                    continue
+                t2, tfoot2, p2 = butils.rampFluxAtEdge(mimg, self.foot, t1, tfoot, peak, psfim, S, patchEdges)
+                expected, efoot, ep = rampReference(mimg, self.foot, t1, tfoot, peak, psfim, S, patchEdges)
+                self.assertEqual(p2, ep)
+                self.assertEqual(tfoot2.getSpans(), efoot.getSpans())
+                self.assertFloatsEqual(t2.getArray(), expected.getArray())
+                self.assertEqual(patched[i], p or p2)
+                self.assertEqual(tfoots[i].getSpans(), efoot.getSpans())
+                self.assertFloatsEqual(timgs[i].getArray(), expected.getArray())
+
+
+class TestMemory(lsst.utils.tests.MemoryTestCase):
+    pass
+
+
+def setup_module(module):
+    lsst.utils.tests.init()
+
+
+if __name__ == "__main__":
+    lsst.utils.tests.init()
+    unittest.main()